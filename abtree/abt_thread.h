@@ -24,12 +24,48 @@
 #ifndef __abt_thread_h__
 #define __abt_thread_h__
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
 class abt_lock;
+class abt_unlock;
 class abt_condition;
 
+// Atomic operations on counters shared between threads.  All of them are
+// full memory barriers.
+inline int abt_atomic_add(volatile int& v, int delta)
+{
+	return __sync_add_and_fetch(&v, delta);
+}
+
+inline uint64_t abt_atomic_add(volatile uint64_t& v, uint64_t delta)
+{
+	return __sync_add_and_fetch(&v, delta);
+}
+
+inline bool abt_atomic_cas(volatile int& v, int old_value, int new_value)
+{
+	return __sync_bool_compare_and_swap(&v, old_value, new_value);
+}
+
+// Increments v unless it is zero, returns false if it was
+inline bool abt_atomic_inc_nonzero(volatile int& v)
+{
+	int cur = v;
+	while(cur != 0)
+	{
+		if (abt_atomic_cas(v, cur, cur + 1))
+			return true;
+		cur = v;
+	}
+	return false;
+}
+
 class abt_mutex
 {
 	friend class abt_lock;
+	friend class abt_unlock;
 	friend class abt_condition;
 public:
 	abt_mutex()
@@ -62,6 +98,7 @@ private:
 class abt_lock
 {
 	friend class abt_condition;
+	friend class abt_unlock;
 public:
 	abt_lock(abt_mutex& mutex) 
 		: m_mutex(mutex)
@@ -78,32 +115,90 @@ private:
 	abt_mutex& m_mutex;
 };
 
-/*
+// Releases a held lock for the life of the object, to do slow work such as 
+// I/O without blocking other threads.  Only useful if the lock is not held
+// recursively.
+class abt_unlock
+{
+public:
+	abt_unlock(abt_lock& lock)
+		: m_lock(lock)
+	{
+		pthread_mutex_unlock(&m_lock.m_mutex.m_mutex);
+	}
+
+	~abt_unlock()
+	{
+		pthread_mutex_lock(&m_lock.m_mutex.m_mutex);
+	}
+
+private:
+	abt_lock& m_lock;
+};
+
+// A thread running a plain function, joined explicitly
+class abt_thread
+{
+public:
+	abt_thread() : m_running(false) {}
+	~abt_thread() { join(); }
+
+	void start(void* (*func)(void*), void* arg)
+	{
+		pthread_create(&m_thread, NULL, func, arg);
+		m_running = true;
+	}
+
+	void join()
+	{
+		if (!m_running) return;
+		pthread_join(m_thread, NULL);
+		m_running = false;
+	}
+
+	bool running() const { return m_running; }
+
+private:
+	pthread_t m_thread;
+	bool m_running;
+};
+
 class abt_condition
 {
 public:
 	abt_condition()
 	{
-	//	pthread_cond_init(&m_cond, NULL);
+		pthread_cond_init(&m_cond, NULL);
 	}
 
 	~abt_condition()
 	{
-	//	pthread_cond_destroy(&m_cond);
+		pthread_cond_destroy(&m_cond);
 	}
 
+	// The lock must not be held recursively
 	void wait(abt_lock& lock)
 	{
-	//	pthread_cond_wait(&m_cond, &lock.m_mutex.m_mutex);
+		pthread_cond_wait(&m_cond, &lock.m_mutex.m_mutex);
+	}
+
+	// Waits at most 'seconds', returns false on a timeout
+	bool wait_for(abt_lock& lock, double seconds)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		long long ns = ts.tv_nsec + (long long) (seconds * 1e9);
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		return pthread_cond_timedwait(&m_cond, &lock.m_mutex.m_mutex, &ts) == 0;
 	}
 
 	void notify_all()
 	{
-	//	pthread_cond_broadcast(&m_cond);	
+		pthread_cond_broadcast(&m_cond);	
 	}
 private:
-	//pthread_cond_t m_cond;
+	pthread_cond_t m_cond;
 };
-*/
 
 #endif
@@ -19,7 +19,9 @@
 #define __bcache_h__
 
 #include <set>
+#include <deque>
 #include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/foreach.hpp>
 #define foreach BOOST_FOREACH
@@ -27,6 +29,8 @@
 #include "abtree/bdecl.h"
 #include "abtree/vector_io.h"
 #include "abtree/abt_thread.h"
+#include "abtree/replacement.h"
+#include "abtree/bstats.h"
 
 namespace btree_impl {
 
@@ -40,6 +44,9 @@ class bcache
 	typedef boost::shared_ptr<tree_t> tree_ptr_t;
 	typedef typename Policy::store_t store_t;
 	typedef abt_lock lock_t;
+	typedef typename Policy::template replacement<proxy_t>::type replacement_t;
+	typedef typename Policy::key_t key_t;
+	typedef pinned_proxy<Policy> pinned_t;
 
 	typedef std::map<std::string, tree_ptr_t> roots_t;
 public:
@@ -47,9 +54,30 @@ public:
 		: m_store(store)
 		, m_max_unwritten_size(max_unwritten_size)
 		, m_max_lru_size(max_lru_size)
+		, m_max_inner_size(std::numeric_limits<size_t>::max())
+		, m_max_unwritten_bytes(std::numeric_limits<size_t>::max())
+		, m_max_lru_bytes(std::numeric_limits<size_t>::max())
+		, m_unwritten_bytes(0)
+		, m_cached_bytes(0)
+		, m_written_entries(0)
+		, m_written_bytes(0)
+		, m_unwritten_peak(0)
 		, m_is_synced(false)
+		, m_sync_requested(0)
+		, m_sync_done(0)
+		, m_sync_running(false)
 		, m_default_policy(policy)
+		, m_writer_low(0)
+		, m_writer_hard(0)
+		, m_stop_writer(false)
+		, m_readahead(0)
+		, m_stop_prefetcher(false)
+		, m_compact_target(0)
+		, m_compact_rate(0)
+		, m_stop_compactor(false)
 	{
+		m_leaves.set_capacity(max_lru_size);
+		m_inner.set_capacity(std::min(m_max_inner_size, max_lru_size));
 		std::vector<char> buf;
 		m_store.read_root(buf);
 		if (buf.size() == 0)
@@ -79,98 +107,141 @@ public:
 
 	~bcache()
 	{
-		while(m_lru.size() > 0)
-			reduce_lru();
+		stop_compactor();
+		stop_writer();
+		stop_prefetcher();
+		claim_unpinned claim;
+		while(proxy_t* proxy = m_leaves.evict(claim))
+			unload(*proxy);
+		while(proxy_t* proxy = m_inner.evict(claim))
+			unload(*proxy);
 	}
 
+	// Reference counting and pinning of nodes that are already in memory
+	// never take the cache lock, so readers only contend on misses.
+
 	void inc(proxy_t& proxy)
 	{
-		lock_t lock(m_mutex);
-		proxy.m_ref_count++;
+		abt_atomic_add(proxy.m_ref_count, 1);
 	}
 
 	void dec(proxy_t& proxy)
 	{
+		if (abt_atomic_add(proxy.m_ref_count, -1) != 0)
+			return;
+		// That was the last reference.  lookup() never revives a proxy
+		// whose count has reached zero, so this thread owns it now.
 		lock_t lock(m_mutex);
-		proxy.m_ref_count--;
-		if (proxy.m_ref_count == 0)
+		assert(proxy.m_pin_count <= 0);
+		if (proxy.m_state == proxy_t::unwritten)  // If it's unwritten
 		{
-			assert(proxy.m_pin_count == 0);
-			if (proxy.m_state == proxy_t::unwritten)  // If it's unwritten
-			{
-				// Remove from list to write, delete node and proxy
-				m_unwritten.erase(m_unwritten.iterator_to(proxy));  
-				delete proxy.m_ptr;
-			}
-			else if (proxy.m_state == proxy_t::unloaded)
-			{
-				// Just erase for offset 
-				m_oldest.erase(&proxy);
-				m_by_off.erase(proxy.m_off);
-			}
-			else if (proxy.m_state == proxy_t::cached)
-			{
-				m_oldest.erase(&proxy);
-				m_by_off.erase(proxy.m_off);
-				m_lru.erase(m_lru.iterator_to(proxy));
-				delete proxy.m_ptr;
-			}
-			else
-				assert(false);
-
-			delete &proxy;
+			// Remove from list to write, delete node and proxy
+			m_unwritten.erase(m_unwritten.iterator_to(proxy));  
+			m_unwritten_bytes -= proxy.m_bytes;
+			// It may have an old copy, if it was being moved
+			forget(proxy);
+			delete proxy.m_ptr;
 		}
-	}
+		else if (proxy.m_state == proxy_t::unloaded)
+		{
+			// Just erase for offset 
+			forget(proxy);
+		}
+		else if (proxy.m_state == proxy_t::cached)
+		{
+			forget(proxy);
+			uncache(proxy);
+			delete proxy.m_ptr;
+		}
+		else
+			assert(false);
 
+		delete &proxy;
+	}
 
 	void pin(proxy_t& proxy) 
 	{
-		lock_t lock(m_mutex);
-		proxy.m_pin_count++;
-		if (proxy.m_state == proxy_t::cached)
+		// If the node is in memory, count the pin and mark it used 
+		int count = proxy.m_pin_count;
+		while(count >= 0)
 		{
-			// First pinner removes cached nodes from LRU so they
-			// aren't removed from under the pinning thread
- 			if (proxy.m_pin_count == 1)
-				m_lru.erase(m_lru.iterator_to(proxy));
+			if (abt_atomic_cas(proxy.m_pin_count, count, count + 1))
+			{
+				proxy.m_accessed = 1;
+				m_stats.hits.add();
+				return;
+			}
+			count = proxy.m_pin_count;
 		}
-		else if (proxy.m_state == proxy_t::unloaded)
+		// Otherwise load it, unless someone beat us to it.  If another
+		// thread is loading it already, wait for that load instead.
+		lock_t lock(m_mutex);
+		if (proxy.m_state == proxy_t::loading)
+			m_stats.load_waits.add();
+		while(proxy.m_state == proxy_t::loading)
+			m_loaded.wait(lock);
+		if (proxy.m_pin_count < 0)
 		{
-			assert(proxy.m_pin_count == 1);
+			assert(proxy.m_state == proxy_t::unloaded);
+			m_stats.misses.add();
+			proxy.m_state = proxy_t::loading;
 			// Create a new node to load into
 			node_t* node = new node_t(proxy.m_policy, 0);
-			// Do the actual load
-			read_node(proxy.m_off, *node);
+			size_t bytes;
+			try
+			{
+				// Do the actual load without the lock
+				abt_unlock unlock(lock);
+				stats_timer timer(m_stats.load);
+				bytes = read_node(proxy.m_off, *node);
+			}
+			catch(...)
+			{
+				delete node;
+				proxy.m_state = proxy_t::unloaded;
+				m_loaded.notify_all();
+				throw;
+			}
 			proxy.m_ptr = node;
 			proxy.m_state = proxy_t::cached; // Set state to cached
+			// Publish the node, going from -1 to 1 pins
+			proxy.m_accessed = 1;
+			proxy.m_bytes = bytes;
+			cache(proxy);
+			abt_atomic_add(proxy.m_pin_count, 2);
+			m_loaded.notify_all();
+			shrink();
+			return;
 		}
+		// No eviction can happen while we hold the lock
+		abt_atomic_add(proxy.m_pin_count, 1);
+		proxy.m_accessed = 1;
+		m_stats.hits.add();
 		// Now node is in 'cached, or unwritten' state
 		// All of which are totally good to read data in			
 	}
 
 	void unpin(proxy_t& proxy)
 	{
-		lock_t lock(m_mutex);
-		proxy.m_pin_count--;
-		if (proxy.m_pin_count == 0 && proxy.m_state == proxy_t::cached)
-		{
-			m_lru.push_back(proxy);  // Put at end of LRU
-			while(m_lru.size() > m_max_lru_size)
-				reduce_lru();  // Reduce if needed
-		}
+		abt_atomic_add(proxy.m_pin_count, -1);
 	}
 
 	ptr_t new_node(node_t* node)
 	{
-		lock_t lock(m_mutex);
 		assert(node != NULL);
 		proxy_t* proxy = new proxy_t(*this, node); // Make the proxy
-		m_unwritten.push_back(*proxy); // Add it to unwritten
-		// Calculate m_oldest
 		ptr_t r(proxy);
+		{
+			lock_t lock(m_mutex);
+			// Guess it's size from the nodes written so far
+			size_t per_entry = (m_written_entries ? m_written_bytes / m_written_entries : 64);
+			proxy->m_bytes = node->size() * per_entry;
+			m_unwritten.push_back(*proxy); // Add it to unwritten
+			m_unwritten_bytes += proxy->m_bytes;
+			m_unwritten_peak = std::max(m_unwritten_peak, m_unwritten.size());
+		}
 		// Write data if our buffer is full
-		while(m_unwritten.size() > m_max_unwritten_size)
-			write_front();
+		write_if_full();
 		// Return new pointer
 		return r;
 	}
@@ -180,18 +251,18 @@ public:
 		lock_t lock(m_mutex);
 		assert(off != 0);
 		proxy_t* r;
+		// Parents written before a child was moved still have it's old offset
+		for(moved_t::const_iterator mit = m_moved.find(off); mit != m_moved.end(); mit = m_moved.find(off))
+			off = mit->second;
 		typename by_off_t::iterator it = m_by_off.find(off);
-		if (it == m_by_off.end())
-		{
-			r = new proxy_t(*this, off, oldest, height, policy);
-			m_oldest.insert(r);
-			m_by_off[off] = r;
-		}
-		else
-		{
-			r = it->second;
-			r->m_ref_count++;
-		}
+		if (it != m_by_off.end() && abt_atomic_inc_nonzero(it->second->m_ref_count))
+			return ptr_t(it->second);
+		// Either unknown, or the old proxy is being freed, make a new one
+		r = new proxy_t(*this, off, oldest, height, policy);
+		// A replaced node read back from an older root, such as by compaction
+		r->m_superseded = m_replaced.count(off) != 0;
+		m_oldest.insert(r);
+		m_by_off[off] = r;
 		return ptr_t(r);
 	}
 
@@ -246,60 +317,367 @@ public:
 		copy_roots(m_mark, m_current);
 		m_mark = m_current;
 		m_is_synced = false;
+		// What was replaced so far is not in the marked roots
+		m_retired_marked.insert(m_retired_marked.end(), m_retired.begin(), m_retired.end());
+		m_retired.clear();
 	}
 
 	void revert()
 	{
 		lock_t lock(m_mutex);
 		copy_roots(m_current, m_mark);
+		// Nodes replaced since the mark may be back in use, old copies of
+		// moved nodes stay garbage.  Unwritten nodes are all cleared too,
+		// those no tree uses are dropped before they are written anyway.
+		retired_t kept;
+		for(size_t i = 0; i < m_retired.size(); i++)
+		{
+			const retired_node& r = m_retired[i];
+			if (!r.replaced)
+			{
+				kept.push_back(r);
+				continue;
+			}
+			m_replaced.erase(r.off);
+			typename by_off_t::iterator it = m_by_off.find(r.off);
+			if (it != m_by_off.end())
+				it->second->m_superseded = false;
+		}
+		m_retired.swap(kept);
+		typename unwritten_t::iterator it, itEnd = m_unwritten.end();
+		for(it = m_unwritten.begin(); it != itEnd; ++it)
+			it->m_superseded = false;
 	}
 		
+	// Writes everything marked so far and the roots, then commits them
+	// to the store.  Callers that arrive while a sync is running wait and
+	// share the next one, so a slow commit is paid once for all of them.
 	void sync()
 	{
+		check_writer();
 		lock_t lock(m_mutex);
-		// Maybe skip sync if no new marks
-		if (m_is_synced) return;
-		// Set up for post sync world
-		copy_roots(m_syncing, m_mark);
-		m_syncing = m_mark;
-		m_is_synced = true;
-		// Put in a 'sync node
-		proxy_t* p = new proxy_t(*this, m_default_policy);
-		m_unwritten.push_back(*p);
+		uint64_t ticket = ++m_sync_requested;
+		bool led = false;
+		while(m_sync_done < ticket)
+		{
+			if (m_sync_running)
+			{
+				m_synced.wait(lock);
+				continue;
+			}
+			// Lead a sync, which covers everyone waiting so far
+			m_sync_running = true;
+			led = true;
+			uint64_t covers = m_sync_requested;
+			try
+			{
+				abt_unlock unlock(lock);
+				sync_once();
+			}
+			catch(...)
+			{
+				m_sync_running = false;
+				m_synced.notify_all();
+				throw;
+			}
+			m_sync_done = covers;
+			m_sync_running = false;
+			m_synced.notify_all();
+		}
+		if (!led)
+			m_stats.sync_joins.add();
+	}
+
+private:
+	void sync_once()
+	{
+		// Only one sync or write at a time
+		lock_t write_lock(m_write_mutex);
+		uint64_t start = stats_now_ns();
+		size_t start_bytes;
+		proxy_t* p;
+		{
+			lock_t lock(m_mutex);
+			// Maybe skip sync if no new marks
+			if (m_is_synced) return;
+			start_bytes = m_written_bytes;
+			// Set up for post sync world
+			copy_roots(m_syncing, m_mark);
+			m_syncing = m_mark;
+			m_is_synced = true;
+			// Nothing marked uses these, they are counted as garbage in 
+			// the live counts written with the root
+			for(size_t i = 0; i < m_retired_marked.size(); i++)
+			{
+				const retired_node& r = m_retired_marked[i];
+				m_store.free_node(r.off, r.bytes);
+				if (r.replaced)
+					m_replaced.erase(r.off);
+			}
+			m_retired_marked.clear();
+			// Put in a 'sync node
+			p = new proxy_t(*this, m_default_policy);
+			m_unwritten.push_back(*p);
+		}
 		// Go until I hit it
-		while(p->m_state != proxy_t::root_marker_done)
-			write_front();
+		try
+		{
+			while(p->m_state != proxy_t::root_marker_done)
+				write_front();
+		}
+		catch(...)
+		{
+			// A failed write leaves the marker queued, and the next sync
+			// has to try again
+			lock_t lock(m_mutex);
+			if (p->is_linked())
+				m_unwritten.erase(m_unwritten.iterator_to(*p));
+			delete p;
+			m_is_synced = false;
+			throw;
+		}
 		delete p;
+		// The root must be durable before the data it replaces is freed
+		m_store.commit();
+		lock_t lock(m_mutex);
 		//  allow system to clear old data
 		if (m_oldest.size())
 		{
 			off_t oldest = (*m_oldest.begin())->m_oldest;
 			if (oldest != std::numeric_limits<off_t>::max())
+			{
 				m_store.clear_before(oldest);
+				// No node still points below the oldest offset in use
+				m_moved.erase(m_moved.begin(), m_moved.lower_bound(oldest));
+			}
 		}
 		// Remove excess cached nodes
-		while(m_lru.size() > m_max_lru_size)
-			reduce_lru();
+		shrink();
+		if (m_compactor.running() && space_amplification() > m_compact_target)
+			m_compactor_wake.notify_all();
+		m_stats.syncs.add();
+		m_stats.sync_bytes.add(m_written_bytes - start_bytes);
+		m_stats.sync.record(stats_now_ns() - start);
 	}		
 
-	void clean_one()
+public:
+
+	// Sets how many children ahead of an iterator are loaded in the 
+	// background, 0 turns it off.  The first call with a non-zero count
+	// starts the prefetch thread.
+	void set_readahead(size_t count)
 	{
 		lock_t lock(m_mutex);
-		off_t oldest = std::numeric_limits<off_t>::max();
-		typename roots_t::const_iterator it, itEnd = m_current.end();
-		// Find the oldest element that is current
-		for(it = m_current.begin(); it != itEnd; ++it)
+		m_readahead = count;
+		if (count != 0 && !m_prefetcher.running())
 		{
-			if (it->second->size() != 0)
-				oldest = std::min(oldest, it->second->get_root().get_oldest());
+			m_stop_prefetcher = false;
+			m_prefetcher.start(prefetcher_main, this);
 		}
-		// If it's not on disk, forget it
-		if (oldest == std::numeric_limits<off_t>::max()) return;
-		// Otherwise move it forward
-		for(it = m_current.begin(); it != itEnd; ++it)
+	}
+
+	// Called by iterators as they move within an inner node, queues the
+	// children from 'first' on that aren't in memory to be loaded
+	void readahead(proxy_t& parent, size_t first)
+	{
+		if (m_readahead == 0 || parent.m_height == 0)
+			return;
+		pinned_t node(&parent);
+		size_t last = std::min(node->size(), first + m_readahead);
+		for(size_t i = first; i < last; i++)
+		{
+			const ptr_t& child = node->ptr(i);
+			if (child.m_proxy->m_pin_count < 0)
+				queue_prefetch(prefetch_job(child));
+		}
+	}
+
+	// Loads the paths from root to both ends of a range in the background,
+	// so they are read in parallel with each other and with the caller.
+	// Does nothing unless readahead is on.
+	void prefetch_range(const ptr_t& root, const key_t& start, const key_t& end)
+	{
+		if (m_readahead == 0 || root == ptr_t())
+			return;
+		queue_prefetch(prefetch_job(root, start));
+		queue_prefetch(prefetch_job(root, end));
+	}
+
+	// Starts a thread that writes unwritten nodes in the background.  It 
+	// wakes when the unwritten nodes go over budget and writes until they
+	// are down to low_ratio of it.  Threads making new nodes only write
+	// them themselves once the buffer is past hard_ratio of the budget.
+	void start_writer(double low_ratio = 0.5, double hard_ratio = 2.0)
+	{
+		lock_t lock(m_mutex);
+		if (m_writer.running()) return;
+		m_writer_low = low_ratio;
+		m_writer_hard = hard_ratio;
+		m_stop_writer = false;
+		m_writer.start(writer_main, this);
+	}
+
+	// Stops the background writer, unwritten nodes are left for sync.  If
+	// the writer fails, it stops itself, and the error is thrown by the
+	// next sync or write.
+	void stop_writer()
+	{
 		{
-			it->second->load_below(oldest);
+			lock_t lock(m_mutex);
+			if (!m_writer.running()) return;
+			m_stop_writer = true;
+			m_writer_wake.notify_all();
 		}
+		m_writer.join();
+		write_if_full();
+	}
+
+	// The budgets can all be changed while the cache is in use.  Node
+	// sizes are their serialized sizes.  Unwritten nodes are counted at an
+	// estimate based on the nodes written so far.
+
+	void set_max_unwritten_size(size_t max_unwritten_size)
+	{
+		{
+			lock_t lock(m_mutex);
+			m_max_unwritten_size = max_unwritten_size;
+		}
+		write_if_full();
+	}
+
+	void set_max_unwritten_bytes(size_t max_unwritten_bytes)
+	{
+		{
+			lock_t lock(m_mutex);
+			m_max_unwritten_bytes = max_unwritten_bytes;
+		}
+		write_if_full();
+	}
+
+	void set_max_lru_size(size_t max_lru_size)
+	{
+		lock_t lock(m_mutex);
+		m_max_lru_size = max_lru_size;
+		m_leaves.set_capacity(max_lru_size);
+		m_inner.set_capacity(std::min(m_max_inner_size, m_max_lru_size));
+		shrink();
+	}
+
+	void set_max_lru_bytes(size_t max_lru_bytes)
+	{
+		lock_t lock(m_mutex);
+		m_max_lru_bytes = max_lru_bytes;
+		shrink();
+	}
+
+	size_t unwritten_bytes() const { return m_unwritten_bytes; }
+	size_t cached_bytes() const { return m_cached_bytes; }
+
+	cache_stats stats()
+	{
+		cache_stats r;
+		m_stats.get(r);
+		lock_t lock(m_mutex);
+		r.cached_nodes = m_leaves.size() + m_inner.size();
+		r.cached_inner = m_inner.size();
+		r.cached_bytes = m_cached_bytes;
+		r.unwritten_nodes = m_unwritten.size();
+		r.unwritten_bytes = m_unwritten_bytes;
+		r.unwritten_peak = m_unwritten_peak;
+		return r;
+	}
+
+	// Limits the number of inner nodes cached.  By default they are only 
+	// limited by max_lru_size, which also counts them, and are evicted only
+	// when there are no leaves left to evict.
+	void set_max_inner_size(size_t max_inner_size)
+	{
+		lock_t lock(m_mutex);
+		m_max_inner_size = max_inner_size;
+		m_inner.set_capacity(std::min(m_max_inner_size, m_max_lru_size));
+		shrink();
+	}
+
+	// Called when a node is replaced by a modified copy.  It's bytes are
+	// counted as garbage by the first sync of a mark made after this, since
+	// until then the marked or synced roots may still use it.  Trees copied
+	// from one another share nodes, so a node replaced in one is counted
+	// even while a copy still uses it.
+	void superseded(const ptr_t& ptr)
+	{
+		lock_t lock(m_mutex);
+		proxy_t* proxy = ptr.m_proxy;
+		if (proxy->m_superseded)
+			return;
+		proxy->m_superseded = true;
+		// If it isn't written yet, stage() retires it once it is
+		if (proxy->m_off != 0)
+			retire(proxy->m_off, proxy->m_bytes, true);
+	}
+
+	// Estimated bytes the store holds per byte of live data
+	double space_amplification() { return m_store.space_amplification(); }
+
+	// Moves live nodes off the oldest slabs, by queueing them to be written
+	// again at the end of the store, along with every
+	// node above them.  The store picks which of the oldest slabs, by how 
+	// much of them is garbage.  Nodes keep their proxies, so trees and 
+	// iterators never see the move.  The slabs are freed by the sync after
+	// all the roots that used them have been rewritten.  Only roots as of the last
+	// sync are followed, since the current trees may be changing under us,
+	// so freeing a slab may take a few syncs.  Returns the bytes queued to
+	// be written, which is about max_bytes at most.
+	size_t compact(size_t max_bytes)
+	{
+		std::vector<ptr_t> roots;
+		off_t end;
+		{
+			lock_t lock(m_mutex);
+			if (m_oldest.empty())
+				return 0;
+			off_t oldest = (*m_oldest.begin())->m_oldest;
+			if (oldest == std::numeric_limits<off_t>::max())
+				return 0;
+			// Nothing to do if only the slab being written is in use
+			end = m_store.pick_victim(oldest);
+			if (end == 0)
+				return 0;
+			foreach(const typename roots_t::value_type& kvp, m_syncing)
+			{
+				if (kvp.second->get_root() != ptr_t())
+					roots.push_back(kvp.second->get_root());
+			}
+		}
+		stats_timer timer(m_stats.compaction);
+		m_stats.compactions.add();
+		size_t bytes = 0;
+		for(size_t i = 0; i < roots.size() && bytes < max_bytes; i++)
+			relocate(roots[i], end, max_bytes, bytes);
+		return bytes;
+	}
+
+	// Starts a thread that compacts whenever the space amplification is 
+	// over target, moving no more than bytes_per_sec.  Updates never 
+	// compact themselves.
+	void start_compactor(double target = 2.0, size_t bytes_per_sec = 8*1024*1024)
+	{
+		lock_t lock(m_mutex);
+		m_compact_target = target;
+		m_compact_rate = std::max(bytes_per_sec, size_t(1));
+		if (m_compactor.running()) return;
+		m_stop_compactor = false;
+		m_compactor.start(compactor_main, this);
+	}
+
+	void stop_compactor()
+	{
+		{
+			lock_t lock(m_mutex);
+			if (!m_compactor.running()) return;
+			m_stop_compactor = true;
+			m_compactor_wake.notify_all();
+		}
+		m_compactor.join();
 	}
 	
 private:
@@ -327,73 +705,688 @@ private:
 			serialize(out, t->get_height()); 
 			serialize(out, t->size());
 		}
+		stats_timer timer(m_stats.store_write);
 		m_store.write_root(buf);
+		m_stats.store_writes.add();
+		m_stats.store_write_bytes.add(buf.size());
 	}
 
-	void write_front()
+	// Queues the nodes below 'ptr' from before 'end' to be rewritten, and
+	// the nodes above them.  Children are queued before their parents, so
+	// parents are written with the new offsets.  A node is only entered
+	// while there is budget left, but once entered it is always queued,
+	// even if the budget runs out or a load fails below it, so no parent
+	// is left pointing at a child's old offset.  The write buffer is kept
+	// within budget as we go, so threads making new nodes aren't left to
+	// write the moved ones.
+	void relocate(const ptr_t& ptr, off_t end, size_t max_bytes, size_t& bytes)
 	{
-		// Pop front writable node
-		proxy_t& proxy = m_unwritten.front();
-		m_unwritten.pop_front();
-		// Handle special case of 'root' write
-		if (proxy.m_state == proxy_t::root_marker)
 		{
-			write_root(m_syncing);
-			proxy.m_state = proxy_t::root_marker_done;
+			lock_t lock(m_mutex);
+			if (ptr.get_oldest() >= end)
+				return;
 		}
-		else
+		pinned_t node(ptr.m_proxy);
+		try
 		{
-			// Do actual write
-			off_t off = write_node(*proxy.m_ptr);
-			// Update offset
-			//m_oldest.erase(&proxy);
-			proxy.m_off = off;
-			proxy.m_oldest = off;
-			const node_t* node = proxy.m_ptr;
 			if (node->height() != 0)
 			{
-				for(size_t i = 0; i < node->size(); i++)
-					proxy.m_oldest = std::min(proxy.m_oldest, node->ptr(i).get_oldest());
+				for(size_t i = 0; i < node->size() && bytes < max_bytes; i++)
+					relocate(node->ptr(i), end, max_bytes, bytes);
+			}
+		}
+		catch(...)
+		{
+			bytes += requeue(*ptr.m_proxy);
+			throw;
+		}
+		bytes += requeue(*ptr.m_proxy);
+		write_if_full();
+	}
+
+	// Moves a written node that is in memory back to the unwritten list.
+	// It stays indexed at it's old offset until it is written again, and
+	// lookups of the old offset lead to the new one after.  A node that is
+	// already unwritten goes to the back, behind the children just queued,
+	// and one being written is queued again once it's done.
+	size_t requeue(proxy_t& proxy)
+	{
+		lock_t lock(m_mutex);
+		if (proxy.m_state == proxy_t::unwritten)
+		{
+			m_unwritten.erase(m_unwritten.iterator_to(proxy));
+			m_unwritten.push_back(proxy);
+			return 0;
+		}
+		if (proxy.m_state == proxy_t::writing)
+		{
+			proxy.m_requeue = true;
+			return 0;
+		}
+		if (proxy.m_state != proxy_t::cached)
+			return 0;
+		uncache(proxy);
+		proxy.m_state = proxy_t::unwritten;
+		m_unwritten.push_back(proxy);
+		m_unwritten_bytes += proxy.m_bytes;
+		m_unwritten_peak = std::max(m_unwritten_peak, m_unwritten.size());
+		m_stats.compaction_moves.add();
+		m_stats.compaction_bytes.add(proxy.m_bytes);
+		return std::max(proxy.m_bytes, size_t(1));
+	}
+
+	static void* compactor_main(void* self)
+	{
+		((bcache*) self)->compactor_loop();
+		return NULL;
+	}
+
+	static const uint64_t k_compact_backoff = 5000000000ull;  // ns after an error
+
+	void compactor_loop()
+	{
+		lock_t lock(m_mutex);
+		while(!m_stop_compactor)
+		{
+			size_t bytes = 0;
+			bool failed = false;
+			if (space_amplification() > m_compact_target)
+			{
+				// Work in batches of a tenth of a second's worth
+				size_t batch = std::max(m_compact_rate / 10, size_t(1));
+				abt_unlock unlock(lock);
+				try
+				{
+					bytes = compact(batch);
+				}
+				catch(...)
+				{
+					// Nodes that failed to load are left unloaded, so
+					// it's safe to try again later
+					m_stats.compaction_errors.add();
+					failed = true;
+				}
+			}
+			if (failed)
+			{
+				// Back off, the error may be lasting
+				uint64_t until = stats_now_ns() + k_compact_backoff;
+				for(uint64_t now = stats_now_ns(); !m_stop_compactor && now < until; now = stats_now_ns())
+					m_compactor_wake.wait_for(lock, (until - now) / 1e9);
+				continue;
 			}
-			m_oldest.insert(&proxy);
-			// Change state to cached
+			if (bytes == 0)
+			{
+				// Idle until a sync makes more garbage
+				if (!m_stop_compactor)
+					m_compactor_wake.wait_for(lock, 1.0);
+				continue;
+			}
+			// Keep to the rate, even if woken
+			uint64_t until = stats_now_ns() + uint64_t(1e9 * bytes / m_compact_rate);
+			for(uint64_t now = stats_now_ns(); !m_stop_compactor && now < until; now = stats_now_ns())
+				m_compactor_wake.wait_for(lock, (until - now) / 1e9);
+		}
+	}
+
+	static const size_t k_write_batch = 1024 * 1024;
+
+	// Writes the oldest unwritten nodes while there are more than 
+	// max_count unwritten nodes or more than max_bytes, up to 
+	// k_write_batch bytes of them with a single write.  Returns false if
+	// there was nothing to write.  Nodes are written in the order they 
+	// were made, so children always get their offsets before their parents
+	// are serialized.  A batch stops at a root marker, which is written on
+	// it's own.  Writes are serialized by m_write_mutex, and the 
+	// serialization and I/O happen without the cache lock.
+	bool write_front(size_t max_count = 0, size_t max_bytes = 0)
+	{
+		lock_t write_lock(m_write_mutex);
+		std::vector<proxy_t*> batch;
+		{
+			lock_t lock(m_mutex);
+			size_t batch_bytes = 0;
+			while(batch_bytes < k_write_batch && unwritten_over(max_count, max_bytes))
+			{
+				// Skip over nodes whose last reference is being dropped, the
+				// thread dropping it will remove them from the list
+				typename unwritten_t::iterator it, itEnd = m_unwritten.end();
+				for(it = m_unwritten.begin(); it != itEnd; ++it)
+				{
+					if (it->m_state == proxy_t::root_marker || abt_atomic_inc_nonzero(it->m_ref_count))
+						break;
+				}
+				if (it == itEnd)
+					break;
+				if (it->m_state == proxy_t::root_marker && !batch.empty())
+					break;
+				proxy_t* proxy = &*it;
+				m_unwritten.erase(it);
+				m_unwritten_bytes -= proxy->m_bytes;
+				batch.push_back(proxy);
+				if (proxy->m_state == proxy_t::root_marker)
+					break;
+				proxy->m_state = proxy_t::writing;
+				batch_bytes += proxy->m_bytes;
+			}
+		}
+		if (batch.empty())
+			return false;
+		// Handle special case of 'root' write
+		if (batch[0]->m_state == proxy_t::root_marker)
+		{
+			try
+			{
+				// The nodes go to disk before the root that uses them
+				m_store.commit();
+				write_root(m_syncing);
+			}
+			catch(...)
+			{
+				unwrite(batch);
+				throw;
+			}
+			lock_t lock(m_mutex);
+			batch[0]->m_state = proxy_t::root_marker_done;
+			return true;
+		}
+		try
+		{
+			for(size_t i = 0; i < batch.size(); i++)
+				stage(batch[i]);
+			stats_timer timer(m_stats.store_write);
+			m_store.write_pending();
+		}
+		catch(...)
+		{
+			unwrite(batch);
+			throw;
+		}
+		m_stats.store_writes.add();
+		{
+			// Only now can they be evicted, and read back
+			lock_t lock(m_mutex);
+			for(size_t i = 0; i < batch.size(); i++)
+			{
+				proxy_t* proxy = batch[i];
+				if (proxy->m_requeue)
+				{
+					// Children moved meanwhile, it may hold their old offsets
+					proxy->m_requeue = false;
+					proxy->m_state = proxy_t::unwritten;
+					m_unwritten.push_back(*proxy);
+					m_unwritten_bytes += proxy->m_bytes;
+					continue;
+				}
+				proxy->m_state = proxy_t::cached;
+				cache(*proxy);
+			}
+			shrink();
+		}
+		// Drop the references taken above
+		for(size_t i = 0; i < batch.size(); i++)
+			dec(*batch[i]);
+		return true;
+	}
+
+	// Puts a batch that failed to write back at the front of the unwritten
+	// list, in order, and drops the references write_front took.  Nodes 
+	// already staged keep their new offsets, and are moved from them when
+	// written again.
+	void unwrite(const std::vector<proxy_t*>& batch)
+	{
+		{
+			lock_t lock(m_mutex);
+			typename unwritten_t::iterator front = m_unwritten.begin();
+			for(size_t i = 0; i < batch.size(); i++)
+			{
+				proxy_t* proxy = batch[i];
+				m_unwritten.insert(front, *proxy);
+				if (proxy->m_state == proxy_t::root_marker)
+					return;
+				proxy->m_state = proxy_t::unwritten;
+				proxy->m_requeue = false;
+				m_unwritten_bytes += proxy->m_bytes;
+			}
+		}
+		for(size_t i = 0; i < batch.size(); i++)
+			dec(*batch[i]);
+	}
+
+	// Serializes a node and gives it it's offset in the store, the node 
+	// stays readable meanwhile.  The store holds the data until the batch
+	// is written.
+	void stage(proxy_t* proxy)
+	{
+		size_t bytes;
+		uint64_t start = stats_now_ns();
+		off_t off = write_node(*proxy->m_ptr, bytes);
+		m_stats.write_front.record(stats_now_ns() - start);
+		m_stats.nodes_written.add();
+		m_stats.bytes_written.add(bytes);
+		lock_t lock(m_mutex);
+		if (proxy->m_off != 0)
+		{
+			// It was moved, drop it's old location
+			forget(*proxy);
+			m_moved[proxy->m_off] = off;
+			if (!proxy->m_superseded)
+				retire(proxy->m_off, proxy->m_bytes, false);
+		}
+		m_written_entries += proxy->m_ptr->size();
+		m_written_bytes += bytes;
+		proxy->m_bytes = bytes;
+		// Update offset
+		proxy->m_off = off;
+		proxy->m_oldest = off;
+		const node_t* node = proxy->m_ptr;
+		if (node->height() != 0)
+		{
+			for(size_t i = 0; i < node->size(); i++)
+				proxy->m_oldest = std::min(proxy->m_oldest, node->ptr(i).get_oldest());
+		}
+		m_oldest.insert(proxy);
+		// Written after being replaced, so the new copy is garbage too
+		if (proxy->m_superseded)
+			retire(off, bytes, true);
+	}
+
+	// Queues a node location to be counted as garbage, see superseded().
+	// Called with the lock held.
+	void retire(off_t off, size_t bytes, bool replaced)
+	{
+		m_retired.push_back(retired_node(off, bytes, replaced));
+		if (replaced)
+			m_replaced.insert(off);
+	}
+
+	bool unwritten_over(size_t max_count, size_t max_bytes) const
+	{
+		return m_unwritten.size() > max_count || m_unwritten_bytes > max_bytes;
+	}
+
+	// Called after adding unwritten nodes.  Without a background writer
+	// the caller writes until the buffer is within budget.  With one, the 
+	// writer is woken at the budget, and callers only write themselves past
+	// the hard limit, which stops them from outrunning it.
+	void write_if_full()
+	{
+		size_t max_count = m_max_unwritten_size;
+		size_t max_bytes = m_max_unwritten_bytes;
+		if (m_writer.running())
+		{
+			check_writer();
+			lock_t lock(m_mutex);
+			if (unwritten_over(m_max_unwritten_size, m_max_unwritten_bytes))
+				m_writer_wake.notify_all();
+			max_count = scale(m_max_unwritten_size, m_writer_hard);
+			max_bytes = scale(m_max_unwritten_bytes, m_writer_hard);
+		}
+		while(write_front(max_count, max_bytes)) {}
+	}
+
+	static size_t scale(size_t budget, double ratio)
+	{
+		if (budget == std::numeric_limits<size_t>::max())
+			return budget;
+		return size_t(budget * ratio);
+	}
+
+	static void* writer_main(void* self)
+	{
+		((bcache*) self)->writer_loop();
+		return NULL;
+	}
+
+	// Sleeps until the unwritten nodes are over budget, then writes until
+	// they are down to the low watermark.  The stop flag is checked under
+	// the lock between batches.
+	void writer_loop()
+	{
+		lock_t lock(m_mutex);
+		bool draining = false;
+		while(!m_stop_writer)
+		{
+			if (!draining && !unwritten_over(m_max_unwritten_size, m_max_unwritten_bytes))
+			{
+				m_writer_wake.wait(lock);
+				continue;
+			}
+			size_t max_count = scale(m_max_unwritten_size, m_writer_low);
+			size_t max_bytes = scale(m_max_unwritten_bytes, m_writer_low);
+			std::string error;
+			{
+				abt_unlock unlock(lock);
+				try
+				{
+					draining = write_front(max_count, max_bytes);
+				}
+				catch(const std::exception& e)
+				{
+					error = e.what();
+				}
+				catch(...)
+				{
+					error = "Unknown error";
+				}
+			}
+			if (!error.empty())
+			{
+				// Left for check_writer
+				m_writer_error = error;
+				return;
+			}
+		}
+	}
+
+	// Throws the error the background writer stopped on, once
+	void check_writer()
+	{
+		std::string error;
+		{
+			lock_t lock(m_mutex);
+			if (m_writer_error.empty())
+				return;
+			error.swap(m_writer_error);
+		}
+		m_writer.join();
+		throw io_exception("Background writer failed: " + error);
+	}
+
+	// Either a single node to load, or a path to follow towards a key
+	struct prefetch_job
+	{
+		prefetch_job(const ptr_t& _node) : node(_node), descend(false) {}
+		prefetch_job(const ptr_t& _node, const key_t& _key) : node(_node), descend(true), key(_key) {}
+		ptr_t node;
+		bool descend;
+		key_t key;
+	};
+
+	static const size_t k_max_prefetch = 1024;
+
+	void queue_prefetch(const prefetch_job& job)
+	{
+		lock_t lock(m_mutex);
+		proxy_t& proxy = *job.node.m_proxy;
+		if (m_prefetch.size() >= k_max_prefetch)
+			return;
+		if (!job.descend)
+		{
+			if (proxy.m_queued) return;
+			proxy.m_queued = true;
+		}
+		m_prefetch.push_back(job);
+		m_stats.prefetches.add();
+		// The prefetcher only sleeps once the queue is empty
+		if (m_prefetch.size() == 1)
+			m_prefetch_wake.notify_all();
+	}
+
+	static void* prefetcher_main(void* self)
+	{
+		((bcache*) self)->prefetch_loop();
+		return NULL;
+	}
+
+	void prefetch_loop()
+	{
+		lock_t lock(m_mutex);
+		while(!m_stop_prefetcher)
+		{
+			if (m_prefetch.empty())
+			{
+				m_prefetch_wake.wait(lock);
+				continue;
+			}
+			prefetch_job job = m_prefetch.front();
+			m_prefetch.pop_front();
+			if (job.descend)
+			{
+				abt_unlock unlock(lock);
+				run_prefetch(job);
+				continue;
+			}
+			// Single nodes, such as readahead, are read in batches
+			std::vector<ptr_t> batch(1, job.node);
+			job.node.m_proxy->m_queued = false;
+			while(batch.size() < k_read_batch && !m_prefetch.empty() && !m_prefetch.front().descend)
+			{
+				batch.push_back(m_prefetch.front().node);
+				batch.back().m_proxy->m_queued = false;
+				m_prefetch.pop_front();
+			}
+			abt_unlock unlock(lock);
+			// Dropped like the errors of run_prefetch, the nodes are left
+			// unloaded for pins to read again
+			try
+			{
+				load_batch(batch);
+			}
+			catch(...) {}
+		}
+	}
+
+	static const size_t k_read_batch = 32;
+
+	// Loads the nodes that aren't in memory or being loaded with one call
+	// to the store, so it can read them all at once.  They are left
+	// unpinned.
+	void load_batch(const std::vector<ptr_t>& nodes)
+	{
+		std::vector<proxy_t*> batch;
+		std::vector<off_t> offs;
+		{
+			lock_t lock(m_mutex);
+			for(size_t i = 0; i < nodes.size(); i++)
+			{
+				proxy_t* proxy = nodes[i].m_proxy;
+				if (proxy->m_state != proxy_t::unloaded)
+					continue;
+				m_stats.misses.add();
+				proxy->m_state = proxy_t::loading;
+				batch.push_back(proxy);
+				offs.push_back(proxy->m_off);
+			}
+		}
+		if (batch.empty())
+			return;
+		std::vector<node_t*> loaded(batch.size());
+		std::vector<typename store_t::node_view> views;
+		try
+		{
+			stats_timer timer(m_stats.load);
+			{
+				stats_timer timer(m_stats.store_read);
+				m_store.read_nodes(offs, views);
+			}
+			for(size_t i = 0; i < batch.size(); i++)
+			{
+				m_stats.store_reads.add();
+				m_stats.store_read_bytes.add(views[i].size);
+				loaded[i] = new node_t(batch[i]->m_policy, 0);
+				memory_reader io(views[i].data, views[i].size); 
+				loaded[i]->deserialize(io, *this);
+			}
+		}
+		catch(...)
+		{
+			lock_t lock(m_mutex);
+			for(size_t i = 0; i < batch.size(); i++)
+			{
+				delete loaded[i];
+				batch[i]->m_state = proxy_t::unloaded;
+			}
+			m_loaded.notify_all();
+			throw;
+		}
+		lock_t lock(m_mutex);
+		for(size_t i = 0; i < batch.size(); i++)
+		{
+			proxy_t& proxy = *batch[i];
+			proxy.m_ptr = loaded[i];
 			proxy.m_state = proxy_t::cached;
-			// Add to LRU if appropriate
-			if (proxy.m_pin_count == 0)
-				m_lru.push_back(proxy);
+			proxy.m_accessed = 1;
+			proxy.m_bytes = views[i].size;
+			cache(proxy);
+			// Publish the node, going from -1 to 0 pins
+			abt_atomic_add(proxy.m_pin_count, 1);
+		}
+		m_loaded.notify_all();
+		shrink();
+	}
+
+	// Pins each node to get it loaded, then lets it go.  A prefetch is
+	// only a hint, so errors are dropped, the pin that needs the node will
+	// read it again and report them.
+	void run_prefetch(const prefetch_job& job)
+	{
+		ptr_t cur = job.node;
+		try
+		{
+			while(cur != ptr_t())
+			{
+				ptr_t next;
+				{
+					pinned_t node(cur.m_proxy);
+					if (job.descend && node->height() != 0 && node->size() != 0)
+					{
+						size_t i = node->upper_bound(job.key);
+						next = node->ptr(i == 0 ? 0 : i - 1);
+					}
+				}
+				cur = next;
+			}
+		}
+		catch(...) {}
+	}
+
+	void stop_prefetcher()
+	{
+		{
+			lock_t lock(m_mutex);
+			if (!m_prefetcher.running()) return;
+			m_stop_prefetcher = true;
+			m_prefetch_wake.notify_all();
+		}
+		m_prefetcher.join();
+		lock_t lock(m_mutex);
+		while(!m_prefetch.empty())
+		{
+			if (!m_prefetch.front().descend)
+				m_prefetch.front().node.m_proxy->m_queued = false;
+			m_prefetch.pop_front();
+		}
+	}
+
+	// Claims a node for eviction if it is not pinned, after which pinners
+	// will have to take the slow path.
+	struct claim_unpinned
+	{
+		bool operator()(proxy_t& proxy) const 
+		{ 
+			return abt_atomic_cas(proxy.m_pin_count, 0, -1); 
+		}
+	};
+
+	// Adds a node that has come into memory to it's tier
+	void cache(proxy_t& proxy)
+	{
+		tier(proxy).insert(proxy);
+		m_cached_bytes += proxy.m_bytes;
+	}
+
+	// Removes a node in memory from it's tier
+	void uncache(proxy_t& proxy)
+	{
+		tier(proxy).erase(proxy);
+		m_cached_bytes -= proxy.m_bytes;
+	}
+
+	// Leaves and inner nodes are cached in separate tiers, so scans over
+	// many leaves can't push out the inner nodes that every lookup goes
+	// through.
+	replacement_t& tier(const proxy_t& proxy)
+	{
+		return proxy.m_height == 0 ? m_leaves : m_inner;
+	}
+
+	// Evicts cached nodes until they are within the count and byte budgets,
+	// and there are no more than m_max_inner_size inner nodes, or all that
+	// remain are pinned.  Leaves go first, inner nodes are only evicted if no leaf
+	// can be.  Proxies are never deleted here, even unreferenced ones, 
+	// that is left to dec().
+	void shrink()
+	{
+		claim_unpinned claim;
+		while(m_inner.size() > m_max_inner_size)
+		{
+			if (!evict(m_inner, claim))
+				break;
+		}
+		while(m_leaves.size() + m_inner.size() > m_max_lru_size || m_cached_bytes > m_max_lru_bytes)
+		{
+			if (!evict(m_leaves, claim) && !evict(m_inner, claim))
+				break;
 		}
 	}
 
-	void reduce_lru()
+	bool evict(replacement_t& replacement, claim_unpinned& claim)
 	{
-		proxy_t& proxy = m_lru.front();
-		m_lru.pop_front();
+		proxy_t* proxy = replacement.evict(claim);
+		if (proxy == NULL)
+			return false;
+		if (&replacement == &m_leaves)
+			m_stats.leaf_evictions.add();
+		else
+			m_stats.inner_evictions.add();
+		unload(*proxy);
+		return true;
+	}
+
+	// Frees the node of a proxy that has been claimed and evicted
+	void unload(proxy_t& proxy)
+	{
+		m_cached_bytes -= proxy.m_bytes;
 		delete proxy.m_ptr;
 		proxy.m_state = proxy_t::unloaded;
 		proxy.m_ptr = NULL;
-		if (proxy.m_ref_count == 0)
-		{
-			m_oldest.erase(&proxy);
-			m_by_off.erase(proxy.m_off);
-			delete &proxy;
-		}
+		proxy.m_pin_count = -1;
+	}
+
+	// Drops a proxy from the offset indexes
+	void forget(proxy_t& proxy)
+	{
+		m_oldest.erase(&proxy);
+		typename by_off_t::iterator it = m_by_off.find(proxy.m_off);
+		if (it != m_by_off.end() && it->second == &proxy)
+			m_by_off.erase(it);
 	}
 
-        off_t write_node(const node_t& bnode)
+        off_t write_node(const node_t& bnode, size_t& bytes)
         {
                 std::vector<char> buf;
                 vector_writer io(buf);
                 bnode.serialize(io);
                 off_t r = m_store.write_node(buf);
+                bytes = buf.size();
+                m_stats.store_write_bytes.add(bytes);
                 return r;
         }
 
-	void read_node(off_t loc, node_t& bnode) 
+	// Returns the serialized size
+	size_t read_node(off_t loc, node_t& bnode) 
 	{ 
-		std::vector<char> buf; 
-		m_store.read_node(loc, buf); 
-		vector_reader io(buf); 
+		typename store_t::node_view view;
+		{
+			stats_timer timer(m_stats.store_read);
+			m_store.read_node(loc, view); 
+		}
+		m_stats.store_reads.add();
+		m_stats.store_read_bytes.add(view.size);
+		memory_reader io(view.data, view.size); 
 		bnode.deserialize(io, *this);
+		return view.size;
 	}
 
 	struct cmp_oldest
@@ -411,18 +1404,65 @@ private:
 	store_t& m_store;
 	size_t m_max_unwritten_size;
 	size_t m_max_lru_size;
-	boost::intrusive::list<proxy_t> m_unwritten;
-	boost::intrusive::list<proxy_t> m_lru;
+	size_t m_max_inner_size;
+	size_t m_max_unwritten_bytes;
+	size_t m_max_lru_bytes;
+	size_t m_unwritten_bytes;  // Estimated, nodes are sized when written
+	size_t m_cached_bytes;
+	size_t m_written_entries;  // Totals used to estimate unwritten sizes
+	size_t m_written_bytes;
+	size_t m_unwritten_peak;
+	typedef boost::intrusive::list<proxy_t> unwritten_t;
+	unwritten_t m_unwritten;
+	replacement_t m_leaves;  // Tracks cached leaves, picks victims
+	replacement_t m_inner;  // The same for inner nodes
 	typedef boost::unordered_map<off_t, proxy_t*> by_off_t;
 	by_off_t m_by_off;
+	typedef std::map<off_t, off_t> moved_t;
+	moved_t m_moved;  // Where nodes moved by compaction went
 	typedef std::set<proxy_t*, cmp_oldest> oldest_t;
 	oldest_t m_oldest;
 	bool m_is_synced;
+	uint64_t m_sync_requested;  // Group commit, calls to sync so far
+	uint64_t m_sync_done;  // Calls covered by finished syncs
+	bool m_sync_running;
+	abt_condition m_synced;
 	roots_t m_current;
 	roots_t m_mark;
 	roots_t m_syncing;
+	// A location to count as garbage, of a replaced node or a moved one
+	struct retired_node
+	{
+		retired_node(off_t _off, size_t _bytes, bool _replaced) : off(_off), bytes(_bytes), replaced(_replaced) {}
+		off_t off;
+		size_t bytes;
+		bool replaced;
+	};
+	typedef std::vector<retired_node> retired_t;
+	retired_t m_retired;  // Since the last mark
+	retired_t m_retired_marked;  // Before it, counted by the next sync
+	boost::unordered_set<off_t> m_replaced;  // Locations of replaced nodes in either
 	Policy m_default_policy;
-	abt_mutex m_mutex;
+	abt_mutex m_mutex;  // Guards everything but the node I/O
+	abt_mutex m_write_mutex;  // Held by the one thread writing nodes
+	abt_condition m_loaded;  // Signalled when a node leaves 'loading'
+	double m_writer_low;  // Background writer watermarks, as budget ratios
+	double m_writer_hard;
+	volatile bool m_stop_writer;
+	std::string m_writer_error;  // Why the writer stopped, until thrown
+	abt_condition m_writer_wake;
+	abt_thread m_writer;
+	std::deque<prefetch_job> m_prefetch;  // Nodes for the prefetcher to load
+	size_t m_readahead;
+	volatile bool m_stop_prefetcher;
+	abt_condition m_prefetch_wake;
+	abt_thread m_prefetcher;
+	double m_compact_target;  // Space amplification to compact down to
+	size_t m_compact_rate;  // Bytes per second to move at most
+	volatile bool m_stop_compactor;
+	abt_condition m_compactor_wake;
+	abt_thread m_compactor;
+	cache_counters m_stats;
 };
 
 template<class Policy>
@@ -433,7 +1473,9 @@ public:
 	typedef bnode<Policy> node_t;
 	typedef typename apply_policy<Policy>::ptr_t ptr_t;
 	ptr_t new_node(node_t* node) { return ptr_t(node); }
-	void clean_one() {}
+	void superseded(const ptr_t& ptr) {}
+	template<class Key>
+	void prefetch_range(const ptr_t& root, const Key& start, const Key& end) {}
 };
 
 }
@@ -188,6 +188,7 @@ public:
 			m_nodes[i+1] = m_nodes[i]->ptr(m_iters[i]);	
 		}
 		m_iters[m_height - 1] = 0;
+		readahead_from(0);
 		set_pair();
 	}
 
@@ -234,11 +235,15 @@ public:
 			set_begin();
 			return;
 		}
+		// Inner keys are the first keys of their children, so the child
+		// that would hold k is the last one whose key is <= k.  Stopping one
+		// child early when k is a first key would read an extra leaf.
 		for(size_t i = 0; i + 1 < m_height;i++)
 		{
-			m_iters[i] = m_nodes[i]->lower_bound(k) - 1;
+			m_iters[i] = m_nodes[i]->upper_bound(k) - 1;
 			m_nodes[i+1] = m_nodes[i]->ptr(m_iters[i]);
 		}
+		readahead_from(0);
 		m_iters[m_height - 1] = m_nodes[m_height-1]->lower_bound(k);
 		m_iters[m_height - 1]--;
 		increment();
@@ -258,6 +263,7 @@ public:
 			m_iters[i] = m_nodes[i]->upper_bound(k) - 1;
 			m_nodes[i+1] = m_nodes[i]->ptr(m_iters[i]);
 		}
+		readahead_from(0);
 		m_iters[m_height - 1] = m_nodes[m_height-1]->upper_bound(k);
 		m_iters[m_height - 1]--;
 		increment();
@@ -280,6 +286,7 @@ public:
 			m_iters[cur]++;
 		}
 
+		int moved = cur;
 		cur++;
 		while(cur < (int) m_height)
 		{
@@ -287,6 +294,9 @@ public:
 			m_iters[cur] = 0;
 			cur++;
 		}
+		// We moved into a new leaf, keep the readahead going
+		if (moved + 1 < (int) m_height)
+			readahead_from(moved);
 		set_pair();
 	}
 
@@ -332,6 +342,15 @@ public:
 	size_t get_height() const { return m_height; }
 
 private:
+	// For disk trees, has the cache load the nodes just after the cursor 
+	// at each inner level from 'level' down, ready for the iteration to 
+	// reach them.
+	void readahead_from(size_t level)
+	{
+		for(size_t i = level; i + 1 < m_height; i++)
+			readahead(m_nodes[i], m_iters[i] + 1);
+	}
+
 	void set_pair() 
 	{
 		delete m_pair;
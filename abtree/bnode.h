@@ -105,7 +105,7 @@ private:
 			if (m_height != 0)
 			{
 				off_t child_loc = ptr(i).get_offset();
-				off_t child_oldest = ptr(i).get_offset();
+				off_t child_oldest = ptr(i).get_oldest();
 				::serialize(out, child_loc);
 				::serialize(out, child_oldest);
 			}
@@ -232,6 +232,8 @@ private:
 			delete new_node;
 			return ur_nop;
 		}
+		// Whatever happened, the old child is gone
+		cache.superseded(ptr(i));
 		if (r == ur_modify || r == ur_erase || r == ur_insert)
 		{
 			// Easy case, keep new node, peer is untouched
@@ -267,23 +269,6 @@ private:
 		return erase_fixup(cache, peer);  // Do an erase fixup
 	}
 
-	bool load_below(cache_t& cache, off_t min_offset)
-	{
-		if (m_height == 0)
-			return false;
-
-		for(size_t i = 0; i < m_size; i++)
-		{
-			if (ptr(i).get_oldest() > min_offset)
-				continue;
-			bnode* new_node = m_ptrs[i]->copy();
-			new_node->load_below(cache, min_offset);
-			m_ptrs[i] = cache.new_node(new_node);
-			return true;
-		}
-		return false;
-	}
-
 	ptr_t& ptrnc(size_t i) { return m_ptrs[i]; } 
 
 public:
@@ -523,6 +508,7 @@ private:
 		}
 		// We are going to modify peer, let's copy first
 		bnode* peer = peer_ptr->copy();
+		cache.superseded(peer_ptr);
 		// Now we try to steal from peer
 		if (peer->size() > min_size)
 		{
@@ -19,6 +19,7 @@
 #define __bnode_proxy_h__
 
 #include <assert.h>
+#include <limits>
 #include <boost/intrusive/list.hpp>
 
 #include "abtree/abt_thread.h"
@@ -70,6 +71,12 @@ private:
 		, m_state(unwritten)
 		, m_ref_count(1)
 		, m_pin_count(0)
+		, m_accessed(0)
+		, m_queue(0)
+		, m_bytes(0)
+		, m_queued(false)
+		, m_superseded(false)
+		, m_requeue(false)
 		, m_ptr(rhs)
 		, m_off(0)
 		, m_oldest(std::numeric_limits<off_t>::max())
@@ -82,7 +89,13 @@ private:
 		, m_policy(policy)
 		, m_state(unloaded)
 		, m_ref_count(1)
-		, m_pin_count(0)
+		, m_pin_count(-1)
+		, m_accessed(0)
+		, m_queue(0)
+		, m_bytes(0)
+		, m_queued(false)
+		, m_superseded(false)
+		, m_requeue(false)
 		, m_ptr(NULL)
 		, m_off(off)
 		, m_oldest(oldest)
@@ -96,6 +109,12 @@ private:
 		, m_state(root_marker)
 		, m_ref_count(0)
 		, m_pin_count(0)
+		, m_accessed(0)
+		, m_queue(0)
+		, m_bytes(0)
+		, m_queued(false)
+		, m_superseded(false)
+		, m_requeue(false)
 		, m_ptr(NULL)
 		, m_off(0)
 		, m_oldest(std::numeric_limits<off_t>::max())
@@ -114,6 +133,10 @@ public:
 	{
 		m_cache.dec(*this);
 	}
+	void readahead(size_t first)
+	{
+		m_cache.readahead(*this, first);
+	}
 	
 	off_t get_offset() const
 	{
@@ -125,20 +148,37 @@ public:
 		return m_oldest;
 	}
 
+	// Used by the replacement policy
+	bool get_accessed() const { return m_accessed; }
+	void set_accessed(bool accessed) { m_accessed = accessed; }
+	int get_queue() const { return m_queue; }
+	void set_queue(int queue) { m_queue = queue; }
+
 private:
 	enum proxy_state
 	{
 		unwritten,   // Node is new and not yet written to disk
+		writing,     // Node is being written, outside of the cache lock
 		cached,      // Node is on disk, and also cached in memory
 		unloaded,    // Node is on disk only, m_ptr = NULL
+		loading,     // Node is being read, outside of the cache lock
 		root_marker,  // Fake proxy node used purely to 
 		root_marker_done   // Root has been written
 	};
 	cache_t& m_cache;	
 	Policy m_policy;
 	proxy_state m_state;
-	int m_ref_count;
-	int m_pin_count;
+	// The counts are changed atomically, without the cache lock.  The pin
+	// count is -1 while the node is not in memory, so pinning a node that
+	// is can be done with a single compare and swap.
+	volatile int m_ref_count;
+	volatile int m_pin_count;
+	volatile int m_accessed;  // Set on pin, cleared by the replacement policy
+	int m_queue;  // Which list of the replacement policy it's on
+	size_t m_bytes;  // Serialized size of the node, estimated until written
+	bool m_queued;  // Waiting to be prefetched
+	bool m_superseded;  // Replaced by a copy, and counted as garbage
+	bool m_requeue;  // Children were moved while it was being written
 	const node_t* m_ptr;
 	off_t m_off;
 	off_t m_oldest;
@@ -63,6 +63,10 @@ public:
 		assert(m_proxy);
 		return m_proxy->get_oldest();
 	}
+	// Asks the cache to load the children from 'first' on in the background
+	void readahead(size_t first) const {
+		if (m_proxy) m_proxy->readahead(first);
+	}
 	
 private:
 	void inc() { if (m_proxy) m_proxy->inc(); }
@@ -71,5 +75,13 @@ private:
 	proxy_t* m_proxy;
 };
 
+// Readahead for whichever kind of node pointer a tree uses, in memory
+// trees there is nothing to do
+template<class Policy>
+void readahead(const bnode_cache_ptr<Policy>& node, size_t first) { node.readahead(first); }
+
+template<class Node>
+void readahead(const boost::shared_ptr<Node>& node, size_t first) {}
+
 }
 #endif
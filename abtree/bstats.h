@@ -0,0 +1,269 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __bstats_h__
+#define __bstats_h__
+
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "abtree/abt_thread.h"
+
+namespace btree_impl {
+
+// Counters are split into stripes, each on it's own cache line, and each
+// thread adds to it's own stripe, so counting on hot paths doesn't make
+// threads fight over a line.  Reads add up the stripes, and are only
+// approximate while other threads are counting.
+static const size_t k_stats_stripes = 16;
+
+inline size_t stats_stripe()
+{
+	static volatile int next = 0;
+	static __thread int stripe = -1;
+	if (stripe < 0)
+		stripe = abt_atomic_add(next, 1) % k_stats_stripes;
+	return stripe;
+}
+
+inline uint64_t stats_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class stats_counter
+{
+public:
+	stats_counter() { memset(m_stripes, 0, sizeof(m_stripes)); }
+
+	void add(uint64_t n = 1) { abt_atomic_add(m_stripes[stats_stripe()].value, n); }
+
+	uint64_t get() const
+	{
+		uint64_t r = 0;
+		for(size_t i = 0; i < k_stats_stripes; i++)
+			r += m_stripes[i].value;
+		return r;
+	}
+
+private:
+	struct stripe
+	{
+		volatile uint64_t value;
+		char pad[64 - sizeof(uint64_t)];
+	};
+	stripe m_stripes[k_stats_stripes];
+};
+
+// A snapshot of a latency histogram.  Bucket i counts the samples that
+// took less than 2^i ns, but not less than 2^(i-1).
+struct latency_stats
+{
+	latency_stats() : count(0), total_ns(0) {}
+
+	uint64_t count;
+	uint64_t total_ns;
+	std::vector<uint64_t> buckets;
+
+	double mean_us() const { return count ? total_ns / 1000.0 / count : 0.0; }
+
+	// An upper bound on the p'th fraction of samples, to within a factor
+	// of two
+	double percentile_us(double p) const
+	{
+		if (count == 0)
+			return 0.0;
+		uint64_t want = uint64_t(p * count);
+		uint64_t seen = 0;
+		for(size_t i = 0; i < buckets.size(); i++)
+		{
+			seen += buckets[i];
+			if (seen > want || seen == count)
+				return (uint64_t(1) << i) / 1000.0;
+		}
+		return 0.0;
+	}
+};
+
+class stats_histogram
+{
+public:
+	static const size_t k_buckets = 40;  // The last holds everything over 9 minutes
+
+	stats_histogram() { memset(m_stripes, 0, sizeof(m_stripes)); }
+
+	void record(uint64_t ns)
+	{
+		size_t bucket = (ns == 0 ? 0 : 64 - __builtin_clzll(ns));
+		if (bucket >= k_buckets)
+			bucket = k_buckets - 1;
+		stripe& s = m_stripes[stats_stripe()];
+		abt_atomic_add(s.buckets[bucket], 1);
+		abt_atomic_add(s.total_ns, ns);
+	}
+
+	void get(latency_stats& out) const
+	{
+		out.count = 0;
+		out.total_ns = 0;
+		out.buckets.assign(k_buckets, 0);
+		for(size_t i = 0; i < k_stats_stripes; i++)
+		{
+			out.total_ns += m_stripes[i].total_ns;
+			for(size_t j = 0; j < k_buckets; j++)
+			{
+				out.buckets[j] += m_stripes[i].buckets[j];
+				out.count += m_stripes[i].buckets[j];
+			}
+		}
+	}
+
+private:
+	struct stripe
+	{
+		volatile uint64_t buckets[k_buckets];
+		volatile uint64_t total_ns;
+		char pad[64 - sizeof(uint64_t)];
+	};
+	stripe m_stripes[k_stats_stripes];
+};
+
+// Records the time until it goes out of scope
+class stats_timer
+{
+public:
+	stats_timer(stats_histogram& histogram)
+		: m_histogram(histogram)
+		, m_start(stats_now_ns())
+	{}
+	~stats_timer() { m_histogram.record(stats_now_ns() - m_start); }
+
+private:
+	stats_histogram& m_histogram;
+	uint64_t m_start;
+};
+
+// What bcache::stats() returns.  Counts are totals since the cache was
+// made, sizes are as of the call.
+struct cache_stats
+{
+	// Node cache
+	uint64_t hits;  // Pins of nodes already in memory
+	uint64_t misses;  // Pins that had to read the node
+	uint64_t load_waits;  // Pins that waited on another thread's read
+	uint64_t leaf_evictions;
+	uint64_t inner_evictions;
+	uint64_t prefetches;  // Nodes queued for the prefetch thread
+	size_t cached_nodes;
+	size_t cached_inner;
+	size_t cached_bytes;
+	latency_stats load;  // Misses, read and deserialize
+
+	// Write buffer
+	size_t unwritten_nodes;
+	size_t unwritten_bytes;  // Estimated, see bcache
+	size_t unwritten_peak;  // Most unwritten nodes there have been at once
+	uint64_t nodes_written;
+	uint64_t bytes_written;
+	latency_stats write_front;  // Serialize and stage one node
+	uint64_t syncs;  // Syncs that had anything to write
+	uint64_t sync_joins;  // Calls to sync that shared another's commit
+	uint64_t sync_bytes;  // Node bytes written by those syncs
+	latency_stats sync;
+
+	// The store, timed from the cache, so they include waiting on the
+	// store's own locks
+	uint64_t store_reads;
+	uint64_t store_read_bytes;
+	latency_stats store_read;
+	uint64_t store_writes;  // Batches of nodes, and root records
+	uint64_t store_write_bytes;
+	latency_stats store_write;
+
+	// Compaction, moving live nodes off the oldest slab
+	uint64_t compactions;  // Batches
+	uint64_t compaction_moves;  // Nodes queued to be rewritten
+	uint64_t compaction_bytes;
+	uint64_t compaction_errors;  // Batches that failed, the compactor backs off
+	latency_stats compaction;
+};
+
+// The live counters behind cache_stats
+struct cache_counters
+{
+	stats_counter hits;
+	stats_counter misses;
+	stats_counter load_waits;
+	stats_counter leaf_evictions;
+	stats_counter inner_evictions;
+	stats_counter prefetches;
+	stats_histogram load;
+	stats_counter nodes_written;
+	stats_counter bytes_written;
+	stats_histogram write_front;
+	stats_counter syncs;
+	stats_counter sync_joins;
+	stats_counter sync_bytes;
+	stats_histogram sync;
+	stats_counter store_reads;
+	stats_counter store_read_bytes;
+	stats_histogram store_read;
+	stats_counter store_writes;
+	stats_counter store_write_bytes;
+	stats_histogram store_write;
+	stats_counter compactions;
+	stats_counter compaction_moves;
+	stats_counter compaction_bytes;
+	stats_counter compaction_errors;
+	stats_histogram compaction;
+
+	void get(cache_stats& out) const
+	{
+		out.hits = hits.get();
+		out.misses = misses.get();
+		out.load_waits = load_waits.get();
+		out.leaf_evictions = leaf_evictions.get();
+		out.inner_evictions = inner_evictions.get();
+		out.prefetches = prefetches.get();
+		load.get(out.load);
+		out.nodes_written = nodes_written.get();
+		out.bytes_written = bytes_written.get();
+		write_front.get(out.write_front);
+		out.syncs = syncs.get();
+		out.sync_joins = sync_joins.get();
+		out.sync_bytes = sync_bytes.get();
+		sync.get(out.sync);
+		out.store_reads = store_reads.get();
+		out.store_read_bytes = store_read_bytes.get();
+		store_read.get(out.store_read);
+		out.store_writes = store_writes.get();
+		out.store_write_bytes = store_write_bytes.get();
+		store_write.get(out.store_write);
+		out.compactions = compactions.get();
+		out.compaction_moves = compaction_moves.get();
+		out.compaction_bytes = compaction_bytes.get();
+		out.compaction_errors = compaction_errors.get();
+		compaction.get(out.compaction);
+	}
+};
+
+}
+#endif
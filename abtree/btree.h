@@ -108,10 +108,10 @@ public:
 			delete w_root;
 			return false;
 		}
-		else if (r == node_type::ur_modify)
+		m_cache->superseded(m_root);
+		if (r == node_type::ur_modify)
 		{
 			m_root = m_cache->new_node(w_root);
-			m_cache->clean_one();
 		}
 		else if (r == node_type::ur_insert)
 		{
@@ -155,28 +155,55 @@ public:
 		return true;	
 	}
 
-	bool load_below(off_t off) 
+	// Replaces the contents of the tree with the entries in [first, last),
+	// which must be sorted and have unique keys.  The tree is built bottom
+	// up, with each level packed into as few nodes as possible and the
+	// entries spread evenly between them, so it takes O(n) time and leaves
+	// every node close to full.
+	template<class InputIterator>
+	void bulk_load(InputIterator first, InputIterator last)
 	{
-		// If empty, skip
-		if (m_root == node_ptr_type())
-			return false;
-		// If not that old skip
-		if (m_root.get_oldest() > off)
-			return false;
-
-		// Otherwise, give it a go
-		node_type* w_root = m_root->copy();
-		bool r = w_root->load_below(*m_cache, off);
-		if (r)
-			m_root = m_cache->new_node(w_root);
-		else
-			delete w_root;
-		return r;
+		assert(m_cache);
+		std::vector<std::pair<key_type, data_t> > entries(first, last);
+		for(size_t i = 1; i < entries.size(); i++)
+			assert(m_policy.less(entries[i-1].first, entries[i].first));
+		std::vector<node_ptr_type> level;
+		size_t count = packed_count(entries.size());
+		for(size_t i = 0; i < count; i++)
+		{
+			node_type* node = new node_type(m_policy, 0);
+			for(size_t j = i * entries.size() / count; j < (i + 1) * entries.size() / count; j++)
+				node->insert(entries[j].first, entries[j].second, node_ptr_type());
+			node->recompute_total();
+			level.push_back(m_cache->new_node(node));
+		}
+		size_t height = (level.size() ? 1 : 0);
+		while(level.size() > 1)
+		{
+			std::vector<node_ptr_type> next;
+			count = packed_count(level.size());
+			for(size_t i = 0; i < count; i++)
+			{
+				node_type* node = new node_type(m_policy, height);
+				for(size_t j = i * level.size() / count; j < (i + 1) * level.size() / count; j++)
+					node->insert(level[j]);
+				node->recompute_total();
+				next.push_back(m_cache->new_node(node));
+			}
+			level.swap(next);
+			height++;
+		}
+		m_root = (level.size() ? level[0] : node_ptr_type());
+		m_height = height;
+		m_size = entries.size();
 	}
-	
+
 private:
 	class mutable_iterator;
 
+	// Number of full nodes needed to hold n entries
+	static size_t packed_count(size_t n) { return (n + Policy::max_size - 1) / Policy::max_size; }
+
 public:
 	class const_iterator : public boost::iterator_facade<
 		const_iterator,
@@ -520,6 +547,15 @@ public:
 		bool operator()(const data_t& total) const { return false; }
 	};
 
+	// Hint that the keys from start to end are about to be used, say by 
+	// total() or accumulate_until.  If the store has readahead on, the paths
+	// to both ends are loaded in the background, while the caller goes on
+	// to build it's iterators.
+	void prefetch(const key_type& start, const key_type& end) const
+	{
+		m_cache->prefetch_range(m_root, start, end);
+	}
+
 	data_t total(const const_iterator& start, const const_iterator& end, const data_t base = data_t())
 	{
 		if (start == end)
@@ -584,10 +620,12 @@ public:
 	Compare less;
 };
 
-template<class BasePolicy, class File>
+template<class BasePolicy, class File, template<class> class Replacement = clock_replacement>
 class disk_policy
 {
 public:
+	template<class Proxy>
+	struct replacement { typedef Replacement<Proxy> type; };
 	static const bool use_cache = true;
 	static const size_t min_size = BasePolicy::node_size/2;
 	static const size_t max_size = (BasePolicy::node_size/2)*2;
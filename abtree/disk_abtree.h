@@ -20,14 +20,19 @@
 
 #include "abtree/btree.h"
 
-template<class BasePolicy, class File = file_bstore>
+// A set of named trees kept in a directory, sharing one node cache.  The
+// cache's replacement policy is one of those in replacement.h.  The default
+// clock is the cheapest, btree_impl::two_queue_replacement and 
+// btree_impl::car_replacement keep the working set through large scans.
+template<class BasePolicy, class File = file_bstore, 
+	template<class> class Replacement = btree_impl::clock_replacement>
 class abtree_store
 {
+	typedef btree_impl::disk_policy<BasePolicy, File, Replacement> policy_t;
 public:
-	typedef btree_impl::btree_base<btree_impl::disk_policy<BasePolicy, File> > tree_type;
+	typedef btree_impl::btree_base<policy_t> tree_type;
 	typedef boost::shared_ptr<tree_type> tree_ptr_t;
 private:
-	typedef btree_impl::disk_policy<BasePolicy, File> policy_t;
 	typedef btree_impl::bcache<policy_t> cache_t;
 	typedef btree_impl::btree_base<policy_t> base_t;
 	typedef typename btree_impl::apply_policy<policy_t>::cache_ptr_t cache_ptr_t;
@@ -46,6 +51,51 @@ public:
 		return tree_ptr_t(new tree_type(&m_cache, policy));
 	}
 
+	// Number of nodes ahead of an iterator to load in the background, 0, 
+	// the default, turns off readahead and tree prefetch() hints
+	void set_readahead(size_t count) { m_cache.set_readahead(count); }
+
+	// Writes new nodes from a background thread rather than from the
+	// threads updating trees, see bcache::start_writer
+	void start_writer(double low_ratio = 0.5, double hard_ratio = 2.0) { m_cache.start_writer(low_ratio, hard_ratio); }
+	void stop_writer() { m_cache.stop_writer(); }
+
+	// Cache and write buffer budgets, which can be changed at any time.
+	// max_unwritten and max_lru from the constructor are node counts, the 
+	// byte budgets are unlimited unless set, and whichever is hit first 
+	// applies.  Bytes are serialized sizes of nodes.
+	void set_max_unwritten(size_t max_unwritten) { m_cache.set_max_unwritten_size(max_unwritten); }
+	void set_max_lru(size_t max_lru) { m_cache.set_max_lru_size(max_lru); }
+	void set_max_unwritten_bytes(size_t max_bytes) { m_cache.set_max_unwritten_bytes(max_bytes); }
+	void set_max_lru_bytes(size_t max_bytes) { m_cache.set_max_lru_bytes(max_bytes); }
+	size_t unwritten_bytes() const { return m_cache.unwritten_bytes(); }
+	size_t cached_bytes() const { return m_cache.cached_bytes(); }
+
+	// Inner nodes are cached apart from leaves and evicted only when no 
+	// leaf can be, so lookups need at most one read as long as they fit in
+	// max_lru.  This sets a separate limit on them.
+	void set_max_inner(size_t max_inner) { m_cache.set_max_inner_size(max_inner); }
+
+	// Counters and latency histograms for the cache, the write buffer, the
+	// store and compaction, see bstats.h
+	typedef btree_impl::cache_stats stats_type;
+	stats_type stats() { return m_cache.stats(); }
+
+	// Old versions of nodes are left in the store until compaction moves
+	// the live nodes off the slabs they share, see bcache::compact.  This
+	// can be run from a background thread, or a batch at a time by the
+	// caller with compact(), which returns the bytes moved.  Space is 
+	// freed by sync.
+	void start_compactor(double target_amplification = 2.0, size_t bytes_per_sec = 8*1024*1024) 
+	{ 
+		m_cache.start_compactor(target_amplification, bytes_per_sec); 
+	}
+	void stop_compactor() { m_cache.stop_compactor(); }
+	size_t compact(size_t max_bytes) { return m_cache.compact(max_bytes); }
+	double space_amplification() { return m_cache.space_amplification(); }
+
+	File& get_file() { return m_file; }
+
 	void mark() { m_cache.mark(); }
 	void revert() { m_cache.revert(); }
 	void sync() { m_cache.sync(); }
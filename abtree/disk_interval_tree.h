@@ -0,0 +1,117 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __disk_interval_tree_h__
+#define __disk_interval_tree_h__
+
+#include "abtree/interval_tree.h"
+#include "abtree/disk_abtree.h"
+
+// Policy for keeping intervals in an abtree_store.  Values are stored
+// inline in the keys and need serialize/deserialize overloads, as does the
+// position type.  The start is recomputed from the value on load.  Keys 
+// of the end count tree have no value, just a position.
+template<
+	class Value,
+	class Position,
+	class IntervalGet = default_interval_functor<Value, Position>,
+	class ValueCmp = std::less<Value>
+>
+class interval_policy
+{
+public:
+	static const size_t node_size = 20;
+	typedef interval_key<Value, Position> key_type;
+	typedef interval_summary<Position> mapped_type;
+
+	interval_policy(const IntervalGet& interval_functor = IntervalGet(), const ValueCmp& vc = ValueCmp())
+		: m_interval_functor(interval_functor)
+		, m_less(vc)
+	{}
+
+	bool less(const key_type& a, const key_type& b) const { return m_less(a, b); }
+	void aggregate(mapped_type& out, const mapped_type& in) const { interval_summary_aggregate<Position>()(out, in); }
+	void serialize(writable& out, const key_type& k, const mapped_type& v) const
+	{
+		::serialize(out, int(k.is_position()));
+		if (k.is_position())
+			serialize_value(out, k.start);
+		else
+			serialize_value(out, k.value);
+		serialize_value(out, v.end);
+		::serialize(out, v.count);
+		::serialize(out, v.empty);
+	}
+	void deserialize(readable& in, key_type& k, mapped_type& v) const
+	{
+		int is_position;
+		::deserialize(in, is_position);
+		if (is_position)
+		{
+			Position start;
+			deserialize_value(in, start);
+			k = key_type(start);
+		}
+		else
+		{
+			deserialize_value(in, k.value);
+			k.start = m_interval_functor(k.value).first;
+		}
+		deserialize_value(in, v.end);
+		::deserialize(in, v.count);
+		::deserialize(in, v.empty);
+	}
+private:
+	IntervalGet m_interval_functor;
+	interval_key_cmp<ValueCmp> m_less;
+};
+
+// Interval tree on top of trees from an abtree_store, so it's nodes are
+// paged through the cache rather than held in memory.  The intervals and
+// the end counts are kept in two trees, 'name' and 'name:ends'.
+template<
+	class Value,
+	class Position,
+	class IntervalGet = default_interval_functor<Value, Position>,
+	class ValueCmp = std::less<Value>,
+	class File = file_bstore
+>
+class disk_interval_tree : public basic_interval_tree<
+	Value,
+	Position,
+	interval_inline_storage<Value, Position>,
+	typename abtree_store<interval_policy<Value, Position, IntervalGet, ValueCmp>, File>::tree_type,
+	IntervalGet
+>
+{
+public:
+	typedef interval_policy<Value, Position, IntervalGet, ValueCmp> policy_type;
+	typedef abtree_store<policy_type, File> store_type;
+private:
+	typedef basic_interval_tree<Value, Position, interval_inline_storage<Value, Position>,
+		typename store_type::tree_type, IntervalGet> base_t;
+public:
+	disk_interval_tree(store_type& store, const std::string& name, const IntervalGet& interval_functor = IntervalGet(), const ValueCmp& vc = ValueCmp())
+		: base_t(
+			store.attach(name, policy_type(interval_functor, vc)),
+			store.attach(name + ":ends", policy_type(interval_functor, vc)),
+			interval_inline_storage<Value, Position>(), 
+			interval_functor)
+	{}
+};
+
+#endif
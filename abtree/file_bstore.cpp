@@ -16,15 +16,26 @@
 */
 
 #include <stdlib.h>
+#include <algorithm>
+#include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 //#include <bzlib.h>
 #include "abtree/file_bstore.h"
 #include "abtree/serial.h"
 
-file_bstore::file_bstore(const std::string& dir, bool create)
-	: m_size(0)
+file_bstore::file_bstore(const std::string& dir, bool create, backend slabs)
+	: m_backend(slabs)
+	, m_ring(slabs == backend_uring ? new uring_reader() : NULL)
+	, m_durability(durability_flush)
+	, m_dir_dirty(false)
+	, m_super_fd(-1)
+	, m_super_seq(0)
+	, m_super_dirty(false)
+	, m_slab_size(k_goal_slab_size)
+	, m_size(0)
 	, m_root(0)
 	, m_next_slab(0)
 	, m_cur_slab(NULL)
@@ -40,6 +51,7 @@ file_bstore::file_bstore(const std::string& dir, bool create)
 		// Try to create the directory, thow if fail
 		if (mkdir(dir.c_str(), 0755) != 0)
 			throw io_exception("Unable to create directory");
+		open_super();
 		// Make an initial file
 		next_file();
 		return;
@@ -62,20 +74,28 @@ file_bstore::file_bstore(const std::string& dir, bool create)
 		// Find next file
 		de = readdir(d);
 	}
+	open_super();
 	// If there was nothing, add a file
 	if (m_slabs.size() == 0)
 		next_file();
 	else
-		m_root = find_root();
+	{
+		// Only the last slab is ever written again
+		for(slabs_t::iterator it = m_slabs.begin(); it->second.io.get() != m_cur_slab; ++it)
+			close_slab(it->second);
+		if (!read_super())
+			m_root = find_root();
+	}
+	read_live(m_saved_live);
 }
 
 file_bstore::~file_bstore()
 {
 	lock_t lock(m_mutex);
-
-	// Close any open files (m_cur_slab is also in m_slabs)
-	for(slabs_t::const_iterator it = m_slabs.begin(); it != m_slabs.end(); ++it)
-		delete it->second.io;
+	write_pending();
+	delete m_ring;
+	if (m_super_fd >= 0)
+		close(m_super_fd);
 }
 
 off_t file_bstore::write_node(const std::vector<char>& record) 
@@ -89,7 +109,11 @@ off_t file_bstore::write_node(const std::vector<char>& record)
 	//outbuf.resize(4 + outlen);
 	lock_t lock(m_mutex); 
 	//return write_record('N', outbuf); 
-	return write_record('N', record); 
+	off_t slab_start = m_slabs.rbegin()->first;
+	off_t r = write_record('N', record); 
+	lock_t live_lock(m_live_mutex);
+	m_live[slab_start] += record.size();
+	return r;
 }
 
 void file_bstore::write_root(const std::vector<char>& record) 
@@ -97,25 +121,132 @@ void file_bstore::write_root(const std::vector<char>& record)
 	if (m_cur_slab == NULL)
 		throw io_exception("file_store is not open");
 	lock_t lock(m_mutex); 
+	off_t live = write_live();
 	m_root = write_record('R', record);
+	write_pending();
+	write_super(live);
 	//printf("Writing root record: %d\n", (int) m_root);
 }
 
 void file_bstore::read_node(off_t which, std::vector<char>& record) 
+{ 
+	node_view view;
+	read_node(which, view);
+	record.assign(view.data, view.data + view.size);
+}
+
+void file_bstore::read_node(off_t which, node_view& view) 
 { 
 	if (m_cur_slab == NULL)
 		throw io_exception("file_store is not open");
-	//std::vector<char> inbuf;
-	//{
-	lock_t lock(m_mutex);
-	//safe_read_record(which, 'N', inbuf);
-	safe_read_record(which, 'N', record);
-	//}
+	boost::shared_ptr<slab_file> file;
+	off_t start;
+	{
+		lock_t lock(m_mutex);
+		if (!find_slab(which, file, start))
+			throw io_exception("EOF in read of data");
+		// Stdio slabs share their buffer with the writer
+		if (!file->concurrent_reads())
+		{
+			read_view(file, which - start, view);
+			return;
+		}
+	}
+	// The slab stays open while we hold it, even if it's cleared
+	read_view(file, which - start, view);
 	//unsigned int destlen = ntohl(*((uint32_t *) (inbuf.data())));
 	//record.resize(destlen);
 	//BZ2_bzBuffToBuffDecompress(&record[0], &destlen, &inbuf[4], inbuf.size() - 4, 0, 0);
 }
 
+void file_bstore::read_nodes(const std::vector<off_t>& which, std::vector<node_view>& views)
+{
+	views.resize(which.size());
+	if (m_ring == NULL || !m_ring->available())
+	{
+		for(size_t i = 0; i < which.size(); i++)
+			read_node(which[i], views[i]);
+		return;
+	}
+	std::vector<boost::shared_ptr<slab_file> > files(which.size());
+	std::vector<off_t> offsets(which.size());
+	{
+		lock_t lock(m_mutex);
+		for(size_t i = 0; i < which.size(); i++)
+		{
+			off_t start;
+			if (!find_slab(which[i], files[i], start))
+				throw io_exception("EOF in read of data");
+			offsets[i] = which[i] - start;
+		}
+	}
+	// Read a guess at each node's size, most fit, the rest get another read
+	std::vector<uring_reader::request> requests(which.size());
+	for(size_t i = 0; i < which.size(); i++)
+	{
+		views[i].copy.resize(k_read_guess);
+		requests[i] = uring_reader::request(files[i]->fd(), offsets[i], &views[i].copy[0], k_read_guess);
+	}
+	m_ring->read(requests);
+	for(size_t i = 0; i < which.size(); i++)
+	{
+		views[i].copy.resize(requests[i].done);
+		finish_view(*files[i], offsets[i], views[i]);
+	}
+}
+
+void file_bstore::finish_view(slab_file& file, off_t offset, node_view& view)
+{
+	std::vector<char>& copy = view.copy;
+	if (copy.empty())
+		throw io_exception("EOF in read of data");
+	memory_reader in(copy.data(), copy.size());
+	char prefix;
+	in.read(&prefix, 1);
+	if (prefix != 'N') 
+		throw io_exception("Mismatched prefix"); 
+	size_t s;
+	deserialize(in, s);
+	size_t header = in.get_offset();
+	size_t have = copy.size();
+	if (header + s > have)
+	{
+		copy.resize(header + s);
+		if (file.read_at(offset + have, &copy[have], header + s - have) != header + s - have)
+			throw io_exception("EOF in read of data");
+	}
+	view.data = copy.data() + header;
+	view.size = s;
+}
+
+void file_bstore::read_view(const boost::shared_ptr<slab_file>& file, off_t offset, node_view& view)
+{
+	char prefix;
+	if (file->data() && offset < file->size())
+	{
+		// Mapped slabs are read in place
+		size_t left = file->size() - offset;
+		memory_reader in(file->data() + offset, left);
+		in.read(&prefix, 1);
+		size_t s;
+		deserialize(in, s);
+		if (s > left - in.get_offset())
+			throw io_exception("EOF in read of data");
+		view.data = file->data() + offset + in.get_offset();
+		view.size = s;
+		view.slab = file;
+	}
+	else
+	{
+		if (!read_record(*file, offset, prefix, view.copy))
+			throw io_exception("EOF in read of data");
+		view.data = view.copy.data();
+		view.size = view.copy.size();
+	}
+	if (prefix != 'N') 
+		throw io_exception("Mismatched prefix"); 
+}
+
 void file_bstore::read_root(std::vector<char>& record)
 {
 	if (m_cur_slab == NULL)
@@ -142,26 +273,274 @@ void file_bstore::clear_before(off_t offset)
 		slabs_t::iterator itNext = it;
 		++itNext;
 		//printf("Offset = %d, Deleting %d-%d\n", (int) offset, (int) it->first, (int) itNext->first);
-		it->second.io->close();
 		unlink(it->second.name.c_str());
 	}
 	m_slabs.erase(m_slabs.begin(), itEnd);
+	lock_t live_lock(m_live_mutex);
+	m_live.erase(m_live.begin(), m_live.lower_bound(itEnd->first));
+}
+
+void file_bstore::free_node(off_t which, size_t bytes)
+{
+	lock_t lock(m_live_mutex);
+	live_t::iterator it = m_live.upper_bound(which);
+	if (it == m_live.begin())
+		return;  // Already freed
+	--it;
+	it->second -= std::min(it->second, (off_t) bytes);
+}
+
+off_t file_bstore::live_size()
+{
+	lock_t lock(m_live_mutex);
+	off_t r = 0;
+	for(live_t::const_iterator it = m_live.begin(); it != m_live.end(); ++it)
+		r += it->second;
+	return r;
+}
+
+double file_bstore::space_amplification()
+{
+	return double(disk_size()) / std::max(live_size(), off_t(1));
+}
+
+off_t file_bstore::pick_victim(off_t oldest)
+{
+	lock_t lock(m_mutex);
+	lock_t live_lock(m_live_mutex);
+	slabs_t::iterator first = m_slabs.upper_bound(oldest);
+	if (first == m_slabs.begin())
+		return 0;
+	--first;
+	off_t best_end = 0;
+	double best_ratio = -1.0;
+	off_t total = 0;
+	off_t live = 0;
+	for(slabs_t::iterator it = first; it != m_slabs.end(); ++it)
+	{
+		slabs_t::iterator next = it;
+		++next;
+		if (next == m_slabs.end())
+			break;  // Never the slab being written
+		total += next->first - it->first;
+		live += m_live[it->first];
+		double ratio = 1.0 - double(live) / total;
+		if (ratio > best_ratio)
+		{
+			best_ratio = ratio;
+			best_end = next->first;
+		}
+	}
+	return best_end;
+}
+
+off_t file_bstore::write_live()
+{
+	std::vector<char> buf;
+	vector_writer out(buf);
+	{
+		lock_t live_lock(m_live_mutex);
+		serialize(out, m_live.size());
+		for(live_t::const_iterator it = m_live.begin(); it != m_live.end(); ++it)
+		{
+			serialize(out, it->first);
+			serialize(out, it->second);
+		}
+	}
+	// Kept in the same slab as the root that follows
+	return write_record('L', buf, false);
+}
+
+void file_bstore::open_super()
+{
+	std::string name = m_dir + "/super";
+	m_super_fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_super_fd < 0)
+		throw io_exception("Unable to open superblock");
+	if (lseek(m_super_fd, 0, SEEK_END) == 0)
+		m_dir_dirty = true;
+}
+
+// FNV-1a, enough to catch a slot that was never finished
+static size_t super_checksum(const char* buf, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char) buf[i]) * 16777619u;
+	return h;
+}
+
+bool file_bstore::read_super_slot(size_t slot, size_t& seq, off_t& root, off_t& live)
+{
+	std::vector<char> buf(k_super_slot);
+	if (pread(m_super_fd, &buf[0], k_super_slot, slot * k_super_slot) != (ssize_t) k_super_slot)
+		return false;
+	try
+	{
+		memory_reader in(buf.data(), buf.size());
+		size_t magic;
+		deserialize(in, magic);
+		if (magic != k_super_magic)
+			return false;
+		deserialize(in, seq);
+		deserialize(in, root);
+		deserialize(in, live);
+		if (root <= 0 || root >= m_size || live < 0 || live >= m_size)
+			return false;
+		size_t len = in.get_offset();
+		size_t checksum;
+		deserialize(in, checksum);
+		if (checksum != super_checksum(buf.data(), len))
+			return false;
+		// The root must still be there, it may not have reached the disk
+		std::vector<char> record;
+		safe_read_record(root, 'R', record);
+		if (live != 0)
+			safe_read_record(live, 'L', record);
+	}
+	catch(const io_exception& e)
+	{
+		return false;
+	}
+	return true;
+}
+
+bool file_bstore::read_super()
+{
+	off_t best_root = 0;
+	off_t best_live = 0;
+	for(size_t slot = 0; slot < 2; slot++)
+	{
+		size_t seq;
+		off_t root;
+		off_t live;
+		if (read_super_slot(slot, seq, root, live) && seq > m_super_seq)
+		{
+			m_super_seq = seq;
+			best_root = root;
+			best_live = live;
+		}
+	}
+	if (best_root == 0)
+		return false;
+	m_root = best_root;
+	m_saved_live.clear();
+	if (best_live != 0)
+		safe_read_record(best_live, 'L', m_saved_live);
+	return true;
+}
+
+void file_bstore::write_super(off_t live)
+{
+	// Written over the other slot, so the last one stays good until this
+	// one is done
+	m_super_seq++;
+	std::vector<char> buf;
+	vector_writer out(buf);
+	size_t magic = k_super_magic;
+	serialize(out, magic);
+	serialize(out, m_super_seq);
+	serialize(out, m_root);
+	serialize(out, live);
+	serialize(out, super_checksum(buf.data(), buf.size()));
+	buf.resize(k_super_slot);
+	off_t offset = (m_super_seq % 2) * k_super_slot;
+	if (pwrite(m_super_fd, buf.data(), buf.size(), offset) != (ssize_t) buf.size())
+		throw io_exception("Unable to write superblock");
+	m_super_dirty = true;
+}
+
+void file_bstore::read_live(std::vector<char>& record)
+{
+	if (record.size() == 0)
+		return;  // Older stores, every slab is assumed live
+	vector_reader in(record);
+	size_t count;
+	deserialize(in, count);
+	lock_t live_lock(m_live_mutex);
+	for(size_t i = 0; i < count; i++)
+	{
+		off_t start;
+		off_t live;
+		deserialize(in, start);
+		deserialize(in, live);
+		live_t::iterator it = m_live.find(start);
+		if (it != m_live.end())
+			it->second = live;
+	}
+}
+
+void file_bstore::set_durability(durability level)
+{
+	lock_t lock(m_mutex);
+	m_durability = level;
+}
+
+void file_bstore::commit()
+{
+	lock_t lock(m_mutex);
+	write_pending();
+	if (m_durability != durability_none)
+	{
+		for(std::set<off_t>::const_iterator it = m_dirty.begin(); it != m_dirty.end(); ++it)
+		{
+			slabs_t::iterator slab = m_slabs.find(*it);
+			if (slab == m_slabs.end())
+				continue;  // Already deleted
+			if (m_durability == durability_fdatasync)
+				slab->second.io->datasync();
+			else
+				slab->second.io->flush();
+		}
+		if (m_durability == durability_fdatasync && m_super_dirty && fdatasync(m_super_fd) != 0)
+			throw io_exception("Unable to sync superblock");
+		// New slabs also need their directory entries on disk
+		if (m_durability == durability_fdatasync && m_dir_dirty)
+		{
+			int fd = open(m_dir.c_str(), O_RDONLY);
+			if (fd < 0 || fsync(fd) != 0)
+			{
+				if (fd >= 0) close(fd);
+				throw io_exception("Unable to sync directory");
+			}
+			close(fd);
+		}
+	}
+	m_dirty.clear();
+	m_dir_dirty = false;
+	m_super_dirty = false;
+}
+
+off_t file_bstore::disk_size()
+{
+	lock_t lock(m_mutex);
+	return m_size - m_slabs.begin()->first;
+}
+
+void file_bstore::set_slab_size(off_t slab_size)
+{
+	lock_t lock(m_mutex);
+	m_slab_size = slab_size;
 }
 		
-off_t file_bstore::find_root(off_t offset, file_io* f)
+off_t file_bstore::find_root(off_t offset, slab_file* f)
 {
 	off_t best_root = 0;
 	char prefix = 0;
-	f->seek(0);
 	std::vector<char> record;
-	off_t cur_offset = offset + f->get_offset();
-	while(read_record(f, prefix, record))
+	std::vector<char> live;
+	off_t cur_offset = 0;
+	slab_reader in(*f, 0);
+	while(read_record(in, prefix, record))
 	{
+		if (prefix == 'L')
+			live = record;
 		if (prefix == 'R')
 		{
-			best_root = cur_offset;
+			best_root = offset + cur_offset;
+			m_saved_live = live;
 		}
-		cur_offset = offset + f->get_offset();
+		cur_offset = in.get_offset();
 	}
 	return best_root;
 }
@@ -172,7 +551,7 @@ off_t file_bstore::find_root()
 	slabs_t::reverse_iterator it = m_slabs.rbegin();
 	while(it != m_slabs.rend())
 	{
-		best_root = find_root(it->first, it->second.io);
+		best_root = find_root(it->first, it->second.io.get());
 		if (best_root != 0)
 			break;
 		it++;
@@ -180,50 +559,91 @@ off_t file_bstore::find_root()
 	return best_root;
 }
 
-off_t file_bstore::write_record(char prefix, const std::vector<char>& record)
+off_t file_bstore::write_record(char prefix, const std::vector<char>& record, bool can_roll)
 {
 	off_t r = m_size;
 	off_t slab_start = m_slabs.rbegin()->first;
-	m_cur_slab->seek_end();
-	m_cur_slab->write(&prefix, 1);
-	serialize(*m_cur_slab, record.size());
-	m_cur_slab->write(record.data(), record.size());
-	m_size = slab_start + m_cur_slab->get_offset();
-	if (m_size - slab_start >= (off_t) k_goal_slab_size)
+	m_dirty.insert(slab_start);
+	size_t old_size = m_pending.size();
+	vector_writer out(m_pending);
+	out.write(&prefix, 1);
+	serialize(out, record.size());
+	out.write(record.data(), record.size());
+	m_size += m_pending.size() - old_size;
+	if (can_roll && m_size - slab_start >= m_slab_size)
+	{
+		write_pending();
 		next_file();
+	}
 	return r;
 }
 
-bool file_bstore::read_record(file_io* file, char& prefix, std::vector<char>& record)
+void file_bstore::write_pending()
+{
+	lock_t lock(m_mutex);
+	if (m_pending.empty())
+		return;
+	m_cur_slab->append(m_pending.data(), m_pending.size());
+	m_pending.clear();
+}
+
+bool file_bstore::read_record(slab_file& file, off_t& offset, char& prefix, std::vector<char>& record)
 {
-	if (!file->read(&prefix, 1))
+	slab_reader in(file, offset);
+	if (!read_record(in, prefix, record))
+		return false;
+	offset = in.get_offset();
+	return true;
+}
+
+bool file_bstore::read_record(slab_reader& in, char& prefix, std::vector<char>& record)
+{
+	if (!in.read(&prefix, 1))
 		return false;
 	size_t s;
-	deserialize(*file, s);
+	deserialize(in, s);
 	record.resize(s);
-	if (file->read(record.data(), s) != s)
+	if (in.read(record.data(), s) != s)
 		throw io_exception("EOF in read of data");
 	return true;
 }
 
-bool file_bstore::read_record(off_t offset, char& prefix, std::vector<char>& record)
+bool file_bstore::find_slab(off_t offset, boost::shared_ptr<slab_file>& file, off_t& start)
 {
 	if (offset == m_size)
 		return false;
-
+	if (offset >= m_size - off_t(m_pending.size()))
+		write_pending();
 	slabs_t::iterator it = m_slabs.upper_bound(offset);
 	if (it == m_slabs.begin())
 		throw io_exception(printstring("Invalid offset on read: %d", (int) offset));
 	it--;
-	file_io* file = it->second.io;
-	file->seek(offset - it->first);
-	bool r = read_record(file, prefix, record);
-	if (r == false && file != m_slabs.rbegin()->second.io)
+	file = it->second.io;
+	start = it->first;
+	return true;
+}
+
+bool file_bstore::read_record(off_t offset, char& prefix, std::vector<char>& record)
+{
+	boost::shared_ptr<slab_file> file;
+	off_t start;
+	if (!find_slab(offset, file, start))
+		return false;
+	off_t slab_offset = offset - start;
+	bool r = read_record(*file, slab_offset, prefix, record);
+	if (r == false && file.get() != m_cur_slab)
 		throw io_exception("End of file in inter-slab region");
 	
 	return true;
 }
 
+slab_file* file_bstore::open_slab(const std::string& name)
+{
+	if (m_backend != backend_stdio)
+		return new fd_slab(name);
+	return new stdio_slab(name);
+}
+
 void file_bstore::safe_read_record(off_t offset, char req_prefix, std::vector<char>& record) 
 { 
 	char prefix; 
@@ -232,13 +652,28 @@ void file_bstore::safe_read_record(off_t offset, char req_prefix, std::vector<ch
 	if (prefix != req_prefix) throw io_exception("Mismatched prefix"); 
 }
 
+void file_bstore::close_slab(file_info& fi)
+{
+	if (m_backend == backend_uring)
+		return;
+	fi.io->flush();
+	fi.io.reset(new mapped_slab(fi.name));
+}
+
 void file_bstore::next_file()
 {
+	if (m_cur_slab != NULL)
+		close_slab(m_slabs.rbegin()->second);
 	file_info fi;
 	fi.name = m_dir + "/" + printstring("data_%d", m_next_slab++);
-	m_cur_slab = new file_io(fi.name);
-	fi.io = m_cur_slab;
+	m_cur_slab = open_slab(fi.name);
+	fi.io.reset(m_cur_slab);
 	m_slabs.insert(std::make_pair(m_size, fi));
+	m_dir_dirty = true;
+	{
+		lock_t live_lock(m_live_mutex);
+		m_live[m_size] = 0;
+	}
 	std::vector<char> buf;
 	vector_writer vw(buf);
 	serialize(vw, m_size);
@@ -249,12 +684,12 @@ void file_bstore::add_file(const std::string& name)
 {
 	file_info fi;
 	fi.name = m_dir + "/" + name;
-	file_io* file = new file_io(fi.name);
-	fi.io = file;
+	slab_file* file = open_slab(fi.name);
+	fi.io.reset(file);
 	char prefix;
 	std::vector<char> record;
-	file->seek(0);
-	if (!read_record(file, prefix, record))
+	off_t offset = 0;
+	if (!read_record(*file, offset, prefix, record))
 		throw io_exception("File has no header data");
 	if (prefix != 'S')
 		throw io_exception("File has incorrect header data");
@@ -263,8 +698,8 @@ void file_bstore::add_file(const std::string& name)
 	off_t start_loc;
 	deserialize(vr, start_loc);
 	m_slabs.insert(std::make_pair(start_loc, fi));
-	file->seek_end();
-	off_t file_size = file->get_offset();
+	off_t file_size = file->size();
+	m_live[start_loc] = file_size;  // Until the saved counts are read
 	if (start_loc + file_size > m_size)
 	{
 		m_cur_slab = file;
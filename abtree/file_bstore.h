@@ -20,21 +20,27 @@
 
 #include <vector>
 #include <map>
+#include <set>
 
 #include <assert.h>
+#include <boost/shared_ptr.hpp>
 #include "abtree/vector_io.h"
-#include "abtree/file_io.h"
+#include "abtree/slab_file.h"
+#include "abtree/uring.h"
 #include "abtree/serial.h"
 #include "abtree/abt_thread.h"
 
 class file_bstore
 {
 	const static off_t k_goal_slab_size = 100*1024*1024;  // 100 Mb slabs
+	const static size_t k_read_guess = 4096;  // First read of a batched node
+	const static size_t k_super_slot = 512;  // A sector, so a slot is never torn in two
+	const static size_t k_super_magic = 0x41425453;
 
 	struct file_info
 	{
 		std::string name;
-		file_io* io;
+		boost::shared_ptr<slab_file> io;  // Held by readers outside the lock
 	};
 	
 	typedef std::map<off_t, file_info> slabs_t;
@@ -42,37 +48,153 @@ class file_bstore
 	typedef abt_lock lock_t;
 
 public:
+	// How far commit() goes to make data durable.  With no more than 
+	// flush, a power failure can leave roots on disk without the nodes
+	// they use.
+	enum durability
+	{
+		durability_none,  // Left to stdio, a process crash may lose syncs
+		durability_flush,  // Handed to the OS, survives process crashes
+		durability_fdatasync,  // On the disk, survives power failures
+	};
+
+	// How slabs are read and written
+	enum backend
+	{
+		backend_stdio,
+		backend_fd,  // pread and pwrite, see fd_bstore
+		backend_uring,  // The same, with batched reads, see uring_bstore
+	};
+
 	// Direct user API
-	file_bstore(const std::string& dir, bool create = false);
+	file_bstore(const std::string& dir, bool create = false, backend slabs = backend_stdio);
 	~file_bstore();
+	void set_durability(durability level);  // durability_flush by default
 
-	// Required API to bcache
+	// A node as read by read_node, in place in a mapped slab, or in copy
+	// when it's slab is still being written.  The mapping lasts as long as
+	// the view, even if the slab is cleared.
+	struct node_view
+	{
+		node_view() : data(NULL), size(0) {}
+		const char* data;
+		size_t size;
+		std::vector<char> copy;
+		boost::shared_ptr<slab_file> slab;
+	};
+
+	// Required API to bcache.  Nodes are given their offsets at once, but
+	// are only staged, write_pending() writes them all with one write.  
+	// Anything that reads or commits writes them first.  Slabs are mapped
+	// once rolled, and never change again.
 	off_t write_node(const std::vector<char>& record);
+	void write_pending();
 	void write_root(const std::vector<char>& record);
+	void read_node(off_t which, node_view& view);
 	void read_node(off_t which, std::vector<char>& record);
+	// Reads several nodes, at once if the backend can
+	void read_nodes(const std::vector<off_t>& which, std::vector<node_view>& views);
 	void read_root(std::vector<char>& record);
 	void clear_before(off_t lowest);
+	void commit();  // Makes everything written so far durable
+
+	// Garbage accounting, used to pick what to compact.  Each slab counts
+	// the bytes of nodes written to it that are still live, the cache
+	// reports nodes once the roots it syncs no longer use them.  The counts
+	// are saved with each root.
+	void free_node(off_t which, size_t bytes);
+	off_t disk_size();  // Bytes in all the slabs
+	off_t live_size();  // Bytes of live nodes
+	double space_amplification();
+	// Picks slabs to compact, always a run of the oldest, since only those
+	// can be freed.  Of the runs that include the slab holding 'oldest' 
+	// and stop before the slab being written, returns the end of the one
+	// that is the largest fraction garbage, or 0 if there are none.
+	off_t pick_victim(off_t oldest);
+
+	// Size at which a new slab is started, 100Mb by default
+	void set_slab_size(off_t slab_size);
 
 protected:
 	void next_file(); // Create a new output file
+	off_t write_live();  // Saves the live counts, before a root
+
+	// The superblock file holds two slots, written in turn after each
+	// root with it's offset, a sequence number and a checksum.  Opening
+	// uses the newest slot that checks out, and only scans the slabs for
+	// the last root if neither does, such as for older stores.
+	void open_super();
+	bool read_super();
+	bool read_super_slot(size_t slot, size_t& seq, off_t& root, off_t& live);
+	void write_super(off_t live);
+	void read_live(std::vector<char>& record);
 	void add_file(const std::string& name); // Add a new i/o file
+	slab_file* open_slab(const std::string& name);
+	void close_slab(file_info& fi);  // Maps a slab that is done with
 
 	// Finds roots during reload
-	off_t find_root(off_t offset, file_io* f);
+	off_t find_root(off_t offset, slab_file* f);
 	off_t find_root();
 
-	off_t write_record(char prefix, const std::vector<char>& record);  
-	bool read_record(file_io* f, char& prefix, std::vector<char>& record);  
+	off_t write_record(char prefix, const std::vector<char>& record, bool can_roll = true);  
+	// Reads the record at 'offset' within a slab, and moves it past it
+	bool read_record(slab_file& f, off_t& offset, char& prefix, std::vector<char>& record);  
+	// Reads the next record from 'in', so a scan can share one buffer
+	bool read_record(slab_reader& in, char& prefix, std::vector<char>& record);
 	bool read_record(off_t offset, char& prefix, std::vector<char>& record);  
 	void safe_read_record(off_t offset, char req_prefix, std::vector<char>& record);
+	void read_view(const boost::shared_ptr<slab_file>& file, off_t offset, node_view& view);
+	// Makes a view from the start of a record read into it's copy
+	void finish_view(slab_file& file, off_t offset, node_view& view);
+	// Finds the slab holding 'offset', writing it first if it's staged
+	bool find_slab(off_t offset, boost::shared_ptr<slab_file>& file, off_t& start);
 
+	backend m_backend;
+	uring_reader* m_ring;  // For backend_uring
+	durability m_durability;
+	std::set<off_t> m_dirty;  // Slabs written since the last commit
+	bool m_dir_dirty;  // Slabs made since the last commit
+	int m_super_fd;
+	size_t m_super_seq;  // Of the slot the root was last read from or written to
+	bool m_super_dirty;  // Written since the last commit
+	std::vector<char> m_pending;  // Records staged for the end of the current slab
+	off_t m_slab_size;  // Size to start a new slab at
 	off_t m_size;  // The current 'logical size'
 	off_t m_root;  // The current 'root'
 	unsigned int m_next_slab;  // The next slab number to use
 	std::string m_dir;  // The directory the slabs live in
-	file_io* m_cur_slab;  // The current slab
+	slab_file* m_cur_slab;  // The current slab
 	slabs_t m_slabs;  // All the slabs
-	mutex_t m_mutex;  // IO mutex, could be per slab, but I'm lazy
+	mutex_t m_mutex;  // IO mutex, only fd and mapped slabs are read without it
+	typedef std::map<off_t, off_t> live_t;
+	live_t m_live;  // Live bytes by slab start
+	mutex_t m_live_mutex;  // Guards m_live without waiting on I/O
+	std::vector<char> m_saved_live;  // Live counts found with the root
+};
+
+// The same store on raw file descriptors, using pread and pwrite, so
+// reads from any number of threads go to the OS at once, and never wait 
+// on writes, even of the slab being written.  Use it as the File of 
+// abtree_store.
+class fd_bstore : public file_bstore
+{
+public:
+	fd_bstore(const std::string& dir, bool create = false)
+		: file_bstore(dir, create, backend_fd)
+	{}
+};
+
+// fd_bstore, with the nodes of a batch read (by the prefetch thread) 
+// submitted together through io_uring, so a fast device works on them
+// at once.  Falls back to pread where io_uring isn't available.  Closed
+// slabs are not mapped, as faults on a mapping are taken one at a time.
+class uring_bstore : public file_bstore
+{
+public:
+	uring_bstore(const std::string& dir, bool create = false)
+		: file_bstore(dir, create, backend_uring)
+	{}
+	bool uring_available() const { return m_ring->available(); }
 };
 
 #endif
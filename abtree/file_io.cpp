@@ -15,6 +15,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <unistd.h>
 #include "abtree/file_io.h"
 
 file_reader::file_reader(FILE* file) 
@@ -114,6 +115,13 @@ void file_io::seek(off_t offset)
 		throw io_exception("Failed to seek");
 }
 
+void file_io::datasync()
+{
+	flush();
+	if (fdatasync(fileno(m_file)) != 0)
+		throw io_exception("Failed to sync");
+}
+
 void file_io::seek_end()
 {
 	if (fseeko(m_file, 0, SEEK_END) != 0)
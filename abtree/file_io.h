@@ -61,6 +61,7 @@ public:
 	off_t get_offset();
 	void seek(off_t offset);
 	void seek_end();
+	void datasync();  // Flushes, then waits for the data to reach the disk
 
 private:
 	int base_read(char* buf, int len);
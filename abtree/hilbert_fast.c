@@ -0,0 +1,389 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include "abtree/hilbert_fast.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_BMI2_DISPATCH
+#include <immintrin.h>
+#endif
+
+#define ones(T,k) ((((T)2) << (k-1)) - 1)
+
+#define rotateRight(arg, nRots, nDims)                                  \
+((((arg) >> (nRots)) | ((arg) << ((nDims)-(nRots)))) & ones(bitmask_t,nDims))
+
+#define rotateLeft(arg, nRots, nDims)                                   \
+((((arg) << (nRots)) | ((arg) >> ((nDims)-(nRots)))) & ones(bitmask_t,nDims))
+
+/*
+ * The inner loop of hilbert.c walks the index nDims bits (one 'digit') at a
+ * time, carrying a rotation and a flip bit.  For a given number of dimensions
+ * that is a small state machine, so we precompute what happens for several
+ * digits at once and drive it from a table.  A state is encoded as
+ * rotation * (nDims + 1) + flip, where flip is 0 for no flip bit, or one more
+ * than the position of the flip bit.
+ */
+
+enum { k_digits_2d = 4, k_digits_3d = 3 };
+enum { k_states_2d = 2 * 3, k_states_3d = 3 * 4 };
+
+typedef struct
+{
+	unsigned short out;
+	unsigned char next;
+} table_entry;
+
+static table_entry s_c2i_2d[k_states_2d][1 << (2 * k_digits_2d)];
+static table_entry s_i2c_2d[k_states_2d][1 << (2 * k_digits_2d)];
+static table_entry s_c2i_3d[k_states_3d][1 << (3 * k_digits_3d)];
+static table_entry s_i2c_3d[k_states_3d][1 << (3 * k_digits_3d)];
+static pthread_once_t s_tables_once = PTHREAD_ONCE_INIT;
+
+/* Single digit steps, exactly as in hilbert_c2i and hilbert_i2c */
+static unsigned
+step(unsigned nDims, unsigned state, unsigned digit, int inverse, unsigned* out)
+{
+	unsigned rotation = state / (nDims + 1);
+	unsigned flip = state % (nDims + 1);
+	unsigned flipBit = flip ? 1u << (flip - 1) : 0;
+	unsigned bits;
+	if (inverse)
+	{
+		*out = (unsigned) (rotateLeft((bitmask_t) digit, rotation, nDims) ^ flipBit);
+		bits = digit;
+	}
+	else
+	{
+		bits = (unsigned) rotateRight((bitmask_t) (flipBit ^ digit), rotation, nDims);
+		*out = bits;
+	}
+	flip = rotation + 1;
+	/* rotation = (rotation + 1 + ffs(bits)) % nDims */
+	bits &= -bits & (ones(unsigned, nDims) >> 1);
+	while (bits)
+		bits >>= 1, ++rotation;
+	if (++rotation >= nDims)
+		rotation -= nDims;
+	return rotation * (nDims + 1) + flip;
+}
+
+static void
+build_table(unsigned nDims, unsigned nDigits, unsigned nStates, table_entry* table, int inverse)
+{
+	unsigned inBits = nDims * nDigits;
+	unsigned s, in, i;
+	for (s = 0; s < nStates; ++s)
+		for (in = 0; in < (1u << inBits); ++in)
+		{
+			unsigned state = s;
+			unsigned out = 0;
+			for (i = nDigits; i--; )
+			{
+				unsigned digit_out;
+				state = step(nDims, state, (in >> (i * nDims)) & ones(unsigned, nDims), inverse, &digit_out);
+				out = (out << nDims) | digit_out;
+			}
+			table[s * (1u << inBits) + in].out = (unsigned short) out;
+			table[s * (1u << inBits) + in].next = (unsigned char) state;
+		}
+}
+
+static void
+build_tables(void)
+{
+	build_table(2, k_digits_2d, k_states_2d, &s_c2i_2d[0][0], 0);
+	build_table(2, k_digits_2d, k_states_2d, &s_i2c_2d[0][0], 1);
+	build_table(3, k_digits_3d, k_states_3d, &s_c2i_3d[0][0], 0);
+	build_table(3, k_digits_3d, k_states_3d, &s_i2c_3d[0][0], 1);
+}
+
+/* Runs the state machine over all nDims*nBits bits of 'in' */
+static bitmask_t
+run_machine(unsigned nDims, unsigned nBits, bitmask_t in, int inverse)
+{
+	unsigned b = nDims * nBits;
+	unsigned state = 0;
+	bitmask_t out = 0;
+	const table_entry* table = NULL;
+	unsigned chunk = 0;
+	if (nDims == 2)
+	{
+		table = inverse ? &s_i2c_2d[0][0] : &s_c2i_2d[0][0];
+		chunk = 2 * k_digits_2d;
+	}
+	else if (nDims == 3)
+	{
+		table = inverse ? &s_i2c_3d[0][0] : &s_c2i_3d[0][0];
+		chunk = 3 * k_digits_3d;
+	}
+	if (table)
+	{
+		while (b >= chunk)
+		{
+			const table_entry* e = &table[(state << chunk) + ((in >> (b -= chunk)) & ones(bitmask_t, chunk))];
+			out = (out << chunk) | e->out;
+			state = e->next;
+		}
+	}
+	while (b)
+	{
+		unsigned digit_out;
+		state = step(nDims, state, (unsigned) ((in >> (b -= nDims)) & ones(bitmask_t, nDims)), inverse, &digit_out);
+		out = (out << nDims) | digit_out;
+	}
+	return out;
+}
+
+/* Portable interleave, only for 2 and 3 dimensions */
+static bitmask_t
+spread(unsigned nDims, bitmask_t x)
+{
+	if (nDims == 2)
+	{
+		x &= 0xffffffffULL;
+		x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+		x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+		x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		x = (x | (x << 2)) & 0x3333333333333333ULL;
+		x = (x | (x << 1)) & 0x5555555555555555ULL;
+	}
+	else
+	{
+		x &= 0x1fffffULL;
+		x = (x | (x << 32)) & 0x001f00000000ffffULL;
+		x = (x | (x << 16)) & 0x001f0000ff0000ffULL;
+		x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+		x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+		x = (x | (x << 2)) & 0x1249249249249249ULL;
+	}
+	return x;
+}
+
+static bitmask_t
+compact(unsigned nDims, bitmask_t x)
+{
+	if (nDims == 2)
+	{
+		x &= 0x5555555555555555ULL;
+		x = (x | (x >> 1)) & 0x3333333333333333ULL;
+		x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+		x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+		x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+		x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+	}
+	else
+	{
+		x &= 0x1249249249249249ULL;
+		x = (x | (x >> 2)) & 0x10c30c30c30c30c3ULL;
+		x = (x | (x >> 4)) & 0x100f00f00f00f00fULL;
+		x = (x | (x >> 8)) & 0x001f0000ff0000ffULL;
+		x = (x | (x >> 16)) & 0x001f00000000ffffULL;
+		x = (x | (x >> 32)) & 0x00000000001fffffULL;
+	}
+	return x;
+}
+
+/* Given interleaved coordinates (bit b*nDims+d is bit b of coord d) */
+static bitmask_t
+c2i_interleaved(unsigned nDims, unsigned nBits, bitmask_t coords)
+{
+	unsigned const nDimsBits = nDims*nBits;
+	bitmask_t const nthbits = ones(bitmask_t,nDimsBits) / ones(bitmask_t,nDims);
+	bitmask_t index;
+	unsigned d;
+	coords ^= coords >> nDims;
+	index = run_machine(nDims, nBits, coords, 0);
+	index ^= nthbits >> 1;
+	for (d = 1; d < nDimsBits; d *= 2)
+		index ^= index >> d;
+	return index;
+}
+
+/* Returns interleaved coordinates */
+static bitmask_t
+i2c_interleaved(unsigned nDims, unsigned nBits, bitmask_t index)
+{
+	unsigned const nDimsBits = nDims*nBits;
+	bitmask_t const nthbits = ones(bitmask_t,nDimsBits) / ones(bitmask_t,nDims);
+	bitmask_t coords;
+	unsigned b;
+	index ^= (index ^ nthbits) >> 1;
+	coords = run_machine(nDims, nBits, index, 1);
+	for (b = nDims; b < nDimsBits; b *= 2)
+		coords ^= coords >> b;
+	return coords;
+}
+
+static bitmask_t
+table_c2i(unsigned nDims, unsigned nBits, bitmask_t const coord[])
+{
+	bitmask_t coords = 0;
+	unsigned d;
+	if ((nDims != 2 && nDims != 3) || nBits < 2)
+		return hilbert_c2i(nDims, nBits, coord);
+	for (d = 0; d < nDims; ++d)
+		coords |= spread(nDims, coord[d] & ones(bitmask_t,nBits)) << d;
+	return c2i_interleaved(nDims, nBits, coords);
+}
+
+static void
+table_i2c(unsigned nDims, unsigned nBits, bitmask_t index, bitmask_t coord[])
+{
+	bitmask_t coords;
+	unsigned d;
+	if ((nDims != 2 && nDims != 3) || nBits < 2)
+	{
+		hilbert_i2c(nDims, nBits, index, coord);
+		return;
+	}
+	coords = i2c_interleaved(nDims, nBits, index);
+	for (d = 0; d < nDims; ++d)
+		coord[d] = compact(nDims, coords >> d);
+}
+
+#ifdef HAVE_BMI2_DISPATCH
+
+/* Every nDims'th bit, starting at bit d */
+#define dim_mask(nDims, nBits, d) \
+((ones(bitmask_t,(nDims)*(nBits)) / ones(bitmask_t,nDims)) << (d))
+
+__attribute__((target("bmi2")))
+static bitmask_t
+bmi2_c2i(unsigned nDims, unsigned nBits, bitmask_t const coord[])
+{
+	bitmask_t coords = 0;
+	unsigned d;
+	if (nDims < 2 || nBits < 2)
+		return hilbert_c2i(nDims, nBits, coord);
+	for (d = 0; d < nDims; ++d)
+		coords |= _pdep_u64(coord[d], dim_mask(nDims, nBits, d));
+	return c2i_interleaved(nDims, nBits, coords);
+}
+
+__attribute__((target("bmi2")))
+static void
+bmi2_i2c(unsigned nDims, unsigned nBits, bitmask_t index, bitmask_t coord[])
+{
+	bitmask_t coords;
+	unsigned d;
+	if (nDims < 2 || nBits < 2)
+	{
+		hilbert_i2c(nDims, nBits, index, coord);
+		return;
+	}
+	coords = i2c_interleaved(nDims, nBits, index);
+	for (d = 0; d < nDims; ++d)
+		coord[d] = _pext_u64(coords, dim_mask(nDims, nBits, d));
+}
+
+#endif
+
+typedef bitmask_t (*c2i_func)(unsigned, unsigned, bitmask_t const*);
+typedef void (*i2c_func)(unsigned, unsigned, bitmask_t, bitmask_t*);
+
+/* The pair is published as one pointer, so a thread calling the functions
+   while another selects sees either the old pair or the new one */
+struct hilbert_funcs
+{
+	c2i_func c2i;
+	i2c_func i2c;
+};
+
+static const struct hilbert_funcs s_original = { hilbert_c2i, hilbert_i2c };
+static const struct hilbert_funcs s_table = { table_c2i, table_i2c };
+#ifdef HAVE_BMI2_DISPATCH
+static const struct hilbert_funcs s_bmi2 = { bmi2_c2i, bmi2_i2c };
+#endif
+
+static const struct hilbert_funcs* s_funcs = NULL;
+
+/* Returns the functions for 'which', or NULL if they can't be used here */
+static const struct hilbert_funcs*
+find_funcs(enum hilbert_impl which)
+{
+	const struct hilbert_funcs* best;
+	switch (which)
+	{
+	case hilbert_impl_auto:
+		best = find_funcs(hilbert_impl_bmi2);
+		return best != NULL ? best : &s_table;
+	case hilbert_impl_original:
+		return &s_original;
+	case hilbert_impl_table:
+		return &s_table;
+	case hilbert_impl_bmi2:
+#ifdef HAVE_BMI2_DISPATCH
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("bmi2"))
+			return NULL;
+		return &s_bmi2;
+#else
+		return NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+int
+hilbert_fast_select(enum hilbert_impl which)
+{
+	const struct hilbert_funcs* funcs;
+	pthread_once(&s_tables_once, build_tables);
+	funcs = find_funcs(which);
+	if (funcs == NULL)
+		return 0;
+	__atomic_store_n(&s_funcs, funcs, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Only installed if nothing was selected yet, so it can't undo a 
+   hilbert_fast_select racing with the first call */
+static void
+select_default(void)
+{
+	const struct hilbert_funcs* expected = NULL;
+	pthread_once(&s_tables_once, build_tables);
+	__atomic_compare_exchange_n(&s_funcs, &expected, find_funcs(hilbert_impl_auto),
+		0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static pthread_once_t s_select_once = PTHREAD_ONCE_INIT;
+
+static const struct hilbert_funcs*
+get_funcs(void)
+{
+	const struct hilbert_funcs* funcs = __atomic_load_n(&s_funcs, __ATOMIC_ACQUIRE);
+	if (funcs != NULL)
+		return funcs;
+	pthread_once(&s_select_once, select_default);
+	return __atomic_load_n(&s_funcs, __ATOMIC_ACQUIRE);
+}
+
+bitmask_t
+hilbert_c2i_fast(unsigned nDims, unsigned nBits, bitmask_t const coord[])
+{
+	return get_funcs()->c2i(nDims, nBits, coord);
+}
+
+void
+hilbert_i2c_fast(unsigned nDims, unsigned nBits, bitmask_t index, bitmask_t coord[])
+{
+	get_funcs()->i2c(nDims, nBits, index, coord);
+}
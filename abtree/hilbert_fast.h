@@ -0,0 +1,55 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Faster versions of hilbert_c2i and hilbert_i2c.  They produce exactly the
+   same results as the originals in hilbert.c, which remain the fallback for
+   any case not handled here.  The 2D and 3D gray code state machine is table
+   driven a few digits at a time, and on x86-64 chips with BMI2 the bit
+   interleave uses pdep/pext.  The implementation is picked at runtime.
+*/
+
+#ifndef __hilbert_fast_h__
+#define __hilbert_fast_h__
+
+#include "abtree/hilbert.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum hilbert_impl
+{
+	hilbert_impl_auto,      /* Best supported by this cpu */
+	hilbert_impl_original,  /* Plain hilbert.c */
+	hilbert_impl_table,     /* Portable interleave, table driven state machine */
+	hilbert_impl_bmi2       /* pdep/pext interleave, table driven state machine */
+};
+
+/* Select the implementation to use, returns 0 if it isn't supported here.
+   Threads already using the functions switch over atomically. */
+int hilbert_fast_select(enum hilbert_impl which);
+
+/* Same contracts as hilbert_c2i and hilbert_i2c */
+bitmask_t hilbert_c2i_fast(unsigned nDims, unsigned nBits, bitmask_t const coord[]);
+void hilbert_i2c_fast(unsigned nDims, unsigned nBits, bitmask_t index, bitmask_t coord[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
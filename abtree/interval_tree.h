@@ -1,6 +1,14 @@
 
+#ifndef __interval_tree_h__
+#define __interval_tree_h__
+
 #include "abtree.h"
 #include <stdio.h>
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <vector>
+#include "abtree/slab_pool.h"
 
 template<class value_t, class position_t>
 class default_interval_functor
@@ -12,76 +20,224 @@ public:
 	}
 };
 
-template<
-	class Value, 
-	class Position, 
-	class IntervalGet = default_interval_functor<Value, Position>,
-	class ValueCmp = std::less<Value>
->
-class interval_tree 
+// Key holding a pointer to a separately allocated value.  A key built from
+// just a position has no value, and sorts before every key with a value at
+// that position.  These are used for searches, and as the keys of the 
+// per position count trees.
+template<class Value, class Position>
+struct interval_ptr_key
 {
-	typedef Value value_type;
-	typedef Value key_type;
-	typedef Position position_type;
-	typedef IntervalGet interval_functor_type;
-	typedef ValueCmp base_value_compare;
-	
+	interval_ptr_key() : start(), value(NULL) {}
+	explicit interval_ptr_key(const Position& _start)
+		: start(_start)
+		, value(NULL)
+	{}
+	interval_ptr_key(const Position& _start, const Value* _value)
+		: start(_start)
+		, value(_value)
+	{}
+
+	bool is_position() const { return value == NULL; }
+	const Value& get() const { return *value; }
+
+	Position start;
+	const Value* value;
+};
+
+// Key holding the value itself, required for trees that get serialized
+template<class Value, class Position>
+struct interval_key
+{
+	interval_key() : start(), position_only(false) {}
+	explicit interval_key(const Position& _start)
+		: start(_start)
+		, position_only(true)
+	{}
+	interval_key(const Position& _start, const Value& _value)
+		: start(_start)
+		, value(_value)
+		, position_only(false)
+	{}
+
+	bool is_position() const { return position_only; }
+	const Value& get() const { return value; }
+
+	Position start;
+	Value value;
+	bool position_only;
+};
+
+// Storage policies decide how keys are made from values.  'make' is called
+// when a value enters the tree and 'release' when it leaves, while 'probe'
+// builds a temporary key for lookups.  'release_all' is called with the
+// tree's map when the tree goes away.
+template<class Value, class Position>
+class interval_heap_storage
+{
+public:
+	typedef interval_ptr_key<Value, Position> key_type;
+	key_type make(const Position& start, const Value& v) { return key_type(start, new Value(v)); }
+	key_type probe(const Position& start, const Value& v) const { return key_type(start, &v); }
+	void release(const key_type& k) { delete k.value; }
+	template<class Map>
+	void release_all(const Map& map)
+	{
+		for(typename Map::const_iterator it = map.begin(); it != map.end(); ++it)
+			release(it->first);
+	}
+};
+
+// Values come from a slab_pool owned by the tree, which avoids a trip
+// through malloc per insert and keeps values packed together
+template<class Value, class Position>
+class interval_pool_storage
+{
+public:
+	typedef interval_ptr_key<Value, Position> key_type;
+	interval_pool_storage() : m_pool(new slab_pool<Value>()) {}
+	key_type make(const Position& start, const Value& v) { return key_type(start, m_pool->construct(v)); }
+	key_type probe(const Position& start, const Value& v) const { return key_type(start, &v); }
+	void release(const key_type& k) { m_pool->destroy(const_cast<Value*>(k.value)); }
+	template<class Map>
+	void release_all(const Map& map)
+	{
+		for(typename Map::const_iterator it = map.begin(); it != map.end(); ++it)
+			release(it->first);
+	}
 private:
-	position_type get_start(const value_type& v) const { return m_interval_functor(v).first; }
-	position_type get_end(const value_type& v) const { return m_interval_functor(v).first; }
+	boost::shared_ptr<slab_pool<Value> > m_pool;
+};
 
-	struct augmented_key;
+// Values live in the keys, and so directly in the tree's nodes.  Best for
+// small values, since keys get copied as nodes are rewritten, and the only
+// choice for trees that get serialized.
+template<class Value, class Position>
+class interval_inline_storage
+{
+public:
+	typedef interval_key<Value, Position> key_type;
+	key_type make(const Position& start, const Value& v) { return key_type(start, v); }
+	key_type probe(const Position& start, const Value& v) const { return key_type(start, v); }
+	void release(const key_type& k) {}
+	template<class Map>
+	void release_all(const Map& map) {}
+};
 
-	struct augmented_key_cmp
+// Orders keys by start, and then by value
+template<class ValueCmp>
+class interval_key_cmp
+{
+public:
+	interval_key_cmp(const ValueCmp& val_cmp = ValueCmp())
+		: m_val_cmp(val_cmp)
+	{}
+	template<class Key>
+	bool operator()(const Key& a, const Key& b) const
 	{
-		augmented_key_cmp(const base_value_compare& val_cmp)
-			: m_val_cmp(val_cmp)
-		{}
-		bool operator()(const augmented_key& a, const augmented_key& b) const
-		{
-			if (a.start < b.start)
-				return true;
-			if (b.start < a.start)
-				return false;
-			if (a.value == NULL && b.value != NULL)
-				return true;
-			if (a.value == NULL || b.value == NULL)
-				return false;
-			return m_val_cmp(*a.value, *b.value);
-		}
-	private:
-		base_value_compare m_val_cmp;
-	};
+		if (a.start < b.start)
+			return true;
+		if (b.start < a.start)
+			return false;
+		if (a.is_position() || b.is_position())
+			return a.is_position() && !b.is_position();
+		return m_val_cmp(a.get(), b.get());
+	}
+private:
+	ValueCmp m_val_cmp;
+};
+
+// The value stored against each key.  In the main tree it is the interval's
+// end with a count of one, which aggregates to the largest end and the
+// number of intervals below each node.  The end count tree keeps, for each
+// end position, the number of intervals ending there and how many of those
+// are empty.
+template<class Position>
+struct interval_summary
+{
+	interval_summary() : end(), count(0), empty(0) {}
+	interval_summary(const Position& _end, size_t _count = 1, size_t _empty = 0)
+		: end(_end)
+		, count(_count)
+		, empty(_empty)
+	{}
+
+	Position end;
+	size_t count;
+	size_t empty;
+};
+
+template<class Position>
+struct interval_summary_aggregate
+{
+	void operator()(interval_summary<Position>& out, const interval_summary<Position>& in) const
+	{
+		out.end = std::max(out.end, in.end);
+		out.count += in.count;
+		out.empty += in.empty;
+	}
+};
+
+// Adds or removes one interval from an entry of the end count tree
+template<class Position>
+class interval_count_updater
+{
+public:
+	interval_count_updater(const Position& end, bool is_empty, bool add)
+		: m_end(end)
+		, m_empty(is_empty)
+		, m_add(add)
+	{}
 
-	struct position_aggregate
+	bool operator()(interval_summary<Position>& v, bool& exists) const
 	{
-		void operator()(position_type& out, const position_type& in) const
+		if (!exists)
 		{
-			out = std::max(out, in);
+			assert(m_add);
+			v = interval_summary<Position>(m_end, 0, 0);
+			exists = true;
 		}
-	};
+		if (m_add)
+		{
+			v.count++;
+			if (m_empty) v.empty++;
+		}
+		else
+		{
+			v.count--;
+			if (m_empty) v.empty--;
+		}
+		if (v.count == 0)
+			exists = false;
+		return true;
+	}
+private:
+	Position m_end;
+	bool m_empty;
+	bool m_add;
+};
 
-	struct augmented_key
-	{
-		//augmented_key()
-		//	: start()
-		//	, value(NULL)
-		//{}
+// The interval logic, independent of where the tree lives.  The maps are
+// btrees from Storage::key_type to interval_summary with an
+// interval_summary_aggregate.  The main map holds the intervals by start, 
+// and the ends map holds counts by end position.
+template<class Value, class Position, class Storage, class Map, class IntervalGet>
+class basic_interval_tree : boost::noncopyable
+{
+public:
+	typedef Value value_type;
+	typedef Value key_type;
+	typedef Position position_type;
+	typedef IntervalGet interval_functor_type;
+	typedef Map map_type;
+	typedef boost::shared_ptr<Map> map_ptr_t;
 
-		augmented_key(position_type _start)
-			: start(_start)
-			, value(NULL)
-		{}
-		augmented_key(const position_type& _start, const value_type* rhs)
-			: start(_start)
-			, value(rhs)
-		{}
+protected:
+	typedef typename Storage::key_type augmented_key;
+	typedef interval_summary<Position> summary_type;
 
-		position_type start;
-		const value_type* value;
-	};
+	position_type get_start(const value_type& v) const { return m_interval_functor(v).first; }
+	position_type get_end(const value_type& v) const { return m_interval_functor(v).second; }
 
-	typedef abtree<augmented_key, position_type, position_aggregate, augmented_key_cmp> map_t;
 public:
 	class const_iterator : public boost::iterator_facade<
 		const_iterator,
@@ -90,8 +246,8 @@ public:
 	>
 	{
 		friend class boost::iterator_core_access;
-		friend class interval_tree;
-		typedef typename map_t::const_iterator inner_iterator;
+		friend class basic_interval_tree;
+		typedef typename map_type::const_iterator inner_iterator;
 	public:
 		const_iterator() {}
 
@@ -100,15 +256,15 @@ public:
 		void increment() { m_it++; }
 		void decrement() { m_it--; }
 		bool equal(const_iterator const& other) const { return m_it == other.m_it; }
-                const value_type& dereference() const { return *m_it->first.value; }
+                const value_type& dereference() const { return m_it->first.get(); }
 
 		inner_iterator m_it;
-	};	
+	};
 
 	struct  has_overlap_functor
 	{
 		has_overlap_functor(const position_type& start) : m_start(start) {}
-		bool operator()(const position_type& end) const { return m_start < end; }
+		bool operator()(const summary_type& s) const { return m_start < s.end; }
 		position_type m_start;
 	};
 
@@ -119,23 +275,23 @@ public:
 	>
 	{
 		friend class boost::iterator_core_access;
-		friend class interval_tree;
+		friend class basic_interval_tree;
 	public:
-		overlap_iterator() 
+		overlap_iterator()
 			: map(NULL)
 			, search_start()
 			, search_end()
 		{}
 
 	private:
-		overlap_iterator(const map_t& _map, const position_type& _search_start, const position_type& _search_end, bool is_end)
+		overlap_iterator(const map_type& _map, const position_type& _search_start, const position_type& _search_end, bool is_end)
 			: map(&_map)
 			, search_start(_search_start)
 			, search_end(_search_end)
 		{
 			if (is_end)
 			{
-				cur = map->end(); 
+				cur = map->end();
 				return;
 			}
 
@@ -143,14 +299,14 @@ public:
 			cur = map->begin();
 			skip_ahead();
 		}
-	
+
 		void skip_ahead()
 		{
 			// Go forward until we hit the first 'overlapping' element
-			position_type pos = search_start;
-			map->accumulate_until(cur, pos, map->end(), has_overlap_functor(search_start));
+			summary_type total(search_start, 0);
+			map->accumulate_until(cur, total, map->end(), has_overlap_functor(search_start));
 			// If we are no longer in overlap range, go to end
-			if (cur != map->end() && !(cur->first.start < search_end)) 
+			if (cur != map->end() && !(cur->first.start < search_end))
 				cur = map->end();
 		}
 
@@ -170,73 +326,315 @@ public:
 
 		const value_type& dereference() const
 		{
-			return *cur->first.value;
+			return cur->first.get();
 		}
 
-		const map_t* map;
+		const map_type* map;
 		position_type search_start;
 		position_type search_end;
-		typename map_t::const_iterator cur;
+		typename map_type::const_iterator cur;
 	};
 
-	interval_tree(const base_value_compare& vc = base_value_compare())
-		: m_map(position_aggregate(), augmented_key_cmp(vc))
-	{}
-
 	typedef std::pair<overlap_iterator, overlap_iterator> range_t;
+
 	void insert(const value_type& val)
 	{
 		assert(!(get_end(val) < get_start(val)));
-		value_type* copy = new value_type(val);
-		m_map.insert(std::make_pair(
-			augmented_key(get_start(*copy), copy), get_end(*copy)));
+		if (m_map->find(m_storage.probe(get_start(val), val)) != m_map->end())
+			return;
+		m_map->insert(std::make_pair(m_storage.make(get_start(val), val), summary_type(get_end(val))));
+		count_end(val, true);
 	}
 
 	void erase(const value_type& val)
 	{
 		erase(find(val));
 	}
-	
+
 	void erase(const const_iterator& it)
 	{
-		if (it.m_it == m_map.end())
-			return;
-		const value_type* ptr= it.m_it->first.value;
-		m_map.erase(it.m_it);
-		delete ptr;
+		erase_at(it.m_it);
 	}
 
 	void erase(const overlap_iterator& oit)
 	{
-		if (oit.cur == m_map.end())
-			return;
-		value_type* ptr= oit.cur->first.value;
-		m_map.erase(oit.cur);
-		delete ptr;
+		erase_at(oit.cur);
 	}
 
-	const_iterator begin() const { return const_iterator(m_map.begin()); }
-	const_iterator end() const { return const_iterator(m_map.end()); }
+	const_iterator begin() const { return const_iterator(m_map->begin()); }
+	const_iterator end() const { return const_iterator(m_map->end()); }
 
 	const_iterator find(const value_type& value) const
 	{
-		augmented_key ak(get_start(value), &value);
-		return const_iterator(m_map.find(ak));
+		return const_iterator(m_map->find(m_storage.probe(get_start(value), value)));
 	}
 
 	range_t find(const position_type& start, const position_type& end) const
 	{
 		return std::make_pair(
-			overlap_iterator(m_map, start, end, false), 
-			overlap_iterator(m_map, start, end, true)
-		); 
+			overlap_iterator(*m_map, start, end, false),
+			overlap_iterator(*m_map, start, end, true)
+		);
 	}
 
-	size_t size() const { return m_map.size(); }
+	size_t size() const { return m_map->size(); }
+	const map_type& get_map() const { return *m_map; }
 
-private:
-	map_t m_map;
+	// Number of intervals find(start, end) would return, in O(log N).  Every
+	// interval starting before 'end' overlaps unless it also ends at or
+	// before 'start', and those are counted from the end ordered tree.  When
+	// start == end, the empty intervals at that position are in both counts
+	// without overlapping, so they are added back.
+	size_t count_overlaps(const position_type& start, const position_type& end) const
+	{
+		assert(!(end < start));
+		typename map_type::const_iterator it = m_map->lower_bound(augmented_key(end));
+		size_t starts_before = m_map->total(m_map->begin(), it).count;
+		it = m_ends->upper_bound(augmented_key(start));
+		size_t ended = m_ends->total(m_ends->begin(), it).count;
+		size_t r = starts_before - ended;
+		if (!(start < end))
+		{
+			it = m_ends->find(augmented_key(start));
+			if (it != m_ends->end())
+				r += it->second.empty;
+		}
+		return r;
+	}
+
+	typedef std::pair<position_type, position_type> query_type;
+
+	// Runs many overlap queries with one walk of the tree.  The queries 
+	// must be sorted by start.  Each query (start, end) matches the same
+	// intervals as find(start, end) would, and every match is written to out
+	// as a (query index, value) pair, in tree order.  Each subtree is given
+	// the range of queries that could overlap it, found by binary search on
+	// it's smallest start and largest end, so a node costs O(log Q) per
+	// child rather than a test of every query.
+	template<class OutputIterator>
+	OutputIterator find_batch(const std::vector<query_type>& queries, OutputIterator out) const
+	{
+		return start_batch(overlap_test(queries), queries.size(), out);
+	}
+
+	// Batched stabbing queries, matches intervals with start <= p < end.
+	// The points must be sorted.
+	template<class OutputIterator>
+	OutputIterator stab_batch(const std::vector<position_type>& points, OutputIterator out) const
+	{
+		return start_batch(stab_test(points), points.size(), out);
+	}
+
+	// Finds every pair of overlapping intervals between this tree and other,
+	// writing (ours, theirs) pairs to out.  Both trees are walked together,
+	// and a pair of subtrees is only opened when the smallest start of each
+	// is below the largest end of the other.
+	template<class OtherTree, class OutputIterator>
+	OutputIterator overlap_join(const OtherTree& other, OutputIterator out) const
+	{
+		const typename OtherTree::map_type& other_map = other.get_map();
+		if (m_map->get_height() == 0 || other_map.get_height() == 0)
+			return out;
+		join_walk(m_map->get_root(), m_map->get_height(), other_map.get_root(), other_map.get_height(), out);
+		return out;
+	}
+
+protected:
+	basic_interval_tree(const map_ptr_t& map, const map_ptr_t& ends, const Storage& storage = Storage(), const IntervalGet& interval_functor = IntervalGet())
+		: m_map(map)
+		, m_ends(ends)
+		, m_storage(storage)
+		, m_interval_functor(interval_functor)
+	{}
+
+	~basic_interval_tree()
+	{
+		m_storage.release_all(*m_map);
+	}
+
+	void erase_at(const typename map_type::const_iterator& it)
+	{
+		if (it == m_map->end())
+			return;
+		augmented_key key = it->first;
+		count_end(key.get(), false);
+		m_map->erase(it);
+		m_storage.release(key);
+	}
+
+	void count_end(const value_type& val, bool add)
+	{
+		position_type end = get_end(val);
+		bool is_empty = !(get_start(val) < end);
+		m_ends->update(augmented_key(end), interval_count_updater<Position>(end, is_empty, add));
+	}
+
+	typedef typename map_type::node_ptr_type node_ptr_t;
+
+	// Batch tests narrow a range of sorted queries to those that might
+	// overlap a subtree, with 'first' dropping queries that end by it's
+	// smallest start, and 'last' those that start at or after it's largest
+	// end.  Queries left in the range are then tested one by one at the
+	// leaves.
+
+	static bool query_before(const query_type& q, const position_type& p) { return q.first < p; }
+
+	struct overlap_test
+	{
+		// Queries sorted by start can still end in any order, so queries
+		// are dropped from the front by the largest end so far
+		overlap_test(const std::vector<query_type>& queries) 
+			: m_queries(queries)
+			, m_max_end(queries.size())
+		{
+			for(size_t i = 0; i < queries.size(); i++)
+			{
+				assert(i == 0 || !(queries[i].first < queries[i - 1].first));
+				m_max_end[i] = (i == 0 || m_max_end[i - 1] < queries[i].second ? queries[i].second : m_max_end[i - 1]);
+			}
+		}
+		size_t first(size_t lo, size_t hi, const position_type& min_start) const
+		{
+			return std::upper_bound(m_max_end.begin() + lo, m_max_end.begin() + hi, min_start) - m_max_end.begin();
+		}
+		size_t last(size_t lo, size_t hi, const position_type& max_end) const
+		{
+			return std::lower_bound(m_queries.begin() + lo, m_queries.begin() + hi, max_end, query_before) - m_queries.begin();
+		}
+		bool operator()(size_t i, const position_type& min_start, const position_type& max_end) const
+		{
+			return min_start < m_queries[i].second && m_queries[i].first < max_end;
+		}
+		const std::vector<query_type>& m_queries;
+		std::vector<position_type> m_max_end;
+	};
+
+	struct stab_test
+	{
+		stab_test(const std::vector<position_type>& points) : m_points(points) 
+		{
+			for(size_t i = 1; i < points.size(); i++)
+				assert(!(points[i] < points[i - 1]));
+		}
+		size_t first(size_t lo, size_t hi, const position_type& min_start) const
+		{
+			return std::lower_bound(m_points.begin() + lo, m_points.begin() + hi, min_start) - m_points.begin();
+		}
+		size_t last(size_t lo, size_t hi, const position_type& max_end) const
+		{
+			return std::lower_bound(m_points.begin() + lo, m_points.begin() + hi, max_end) - m_points.begin();
+		}
+		bool operator()(size_t i, const position_type& min_start, const position_type& max_end) const
+		{
+			return !(m_points[i] < min_start) && m_points[i] < max_end;
+		}
+		const std::vector<position_type>& m_points;
+	};
+
+	template<class Test, class OutputIterator>
+	OutputIterator start_batch(const Test& test, size_t count, OutputIterator out) const
+	{
+		if (m_map->get_height() == 0 || count == 0)
+			return out;
+		batch_walk(test, m_map->get_root(), m_map->get_height(), 0, count, out);
+		return out;
+	}
+
+	// Walks the subtree with the queries [lo, hi) that might overlap it.  At
+	// a leaf, the start and end of an entry are exactly the interval's.
+	template<class Test, class OutputIterator>
+	void batch_walk(const Test& test, const node_ptr_t& node, size_t height, size_t lo, size_t hi, OutputIterator& out) const
+	{
+		size_t size = node->size();
+		for(size_t i = 0; i < size; i++)
+		{
+			position_type start = node->key(i).start;
+			position_type end = node->val(i).end;
+			size_t first = test.first(lo, hi, start);
+			size_t last = test.last(first, hi, end);
+			if (first >= last)
+				continue;
+			if (height == 1)
+			{
+				for(size_t j = first; j < last; j++)
+					if (test(j, start, end))
+						*out++ = std::make_pair(j, node->key(i).get());
+			}
+			else
+				batch_walk(test, node->ptr(i), height - 1, first, last, out);
+		}
+	}
+
+	// Always descends the taller side, so both reach the leaves together
+	template<class OtherNode, class OutputIterator>
+	void join_walk(const node_ptr_t& a, size_t ha, const OtherNode& b, size_t hb, OutputIterator& out) const
+	{
+		if (ha > hb)
+		{
+			position_type b_start = b->key(0).start;
+			position_type b_end = b->total().end;
+			for(size_t i = 0; i < a->size(); i++)
+				if (a->key(i).start < b_end && b_start < a->val(i).end)
+					join_walk(a->ptr(i), ha - 1, b, hb, out);
+			return;
+		}
+		if (hb > ha)
+		{
+			position_type a_start = a->key(0).start;
+			position_type a_end = a->total().end;
+			for(size_t j = 0; j < b->size(); j++)
+				if (b->key(j).start < a_end && a_start < b->val(j).end)
+					join_walk(a, ha, b->ptr(j), hb - 1, out);
+			return;
+		}
+		for(size_t i = 0; i < a->size(); i++)
+		{
+			position_type a_start = a->key(i).start;
+			position_type a_end = a->val(i).end;
+			for(size_t j = 0; j < b->size(); j++)
+			{
+				if (!(a_start < b->val(j).end && b->key(j).start < a_end))
+					continue;
+				if (ha == 1)
+					*out++ = std::make_pair(a->key(i).get(), b->key(j).get());
+				else
+					join_walk(a->ptr(i), ha - 1, b->ptr(j), hb - 1, out);
+			}
+		}
+	}
+
+	map_ptr_t m_map;
+	map_ptr_t m_ends;
+	Storage m_storage;
 	interval_functor_type m_interval_functor;
 };
 
- 
+// In memory interval tree.  By default values are kept in a pool owned by
+// the tree, interval_heap_storage gives each value it's own allocation, and
+// interval_inline_storage puts them directly in the nodes.
+template<
+	class Value,
+	class Position,
+	class IntervalGet = default_interval_functor<Value, Position>,
+	class ValueCmp = std::less<Value>,
+	class Storage = interval_pool_storage<Value, Position>
+>
+class interval_tree : public basic_interval_tree<
+	Value,
+	Position,
+	Storage,
+	abtree<typename Storage::key_type, interval_summary<Position>, interval_summary_aggregate<Position>, interval_key_cmp<ValueCmp> >,
+	IntervalGet
+>
+{
+	typedef abtree<typename Storage::key_type, interval_summary<Position>, interval_summary_aggregate<Position>, interval_key_cmp<ValueCmp> > map_t;
+	typedef basic_interval_tree<Value, Position, Storage, map_t, IntervalGet> base_t;
+public:
+	interval_tree(const ValueCmp& vc = ValueCmp())
+		: base_t(
+			typename base_t::map_ptr_t(new map_t(interval_summary_aggregate<Position>(), interval_key_cmp<ValueCmp>(vc))),
+			typename base_t::map_ptr_t(new map_t(interval_summary_aggregate<Position>(), interval_key_cmp<ValueCmp>(vc))))
+	{}
+};
+
+#endif
@@ -0,0 +1,395 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __replacement_h__
+#define __replacement_h__
+
+#include <list>
+#include <algorithm>
+#include <sys/types.h>
+#include <boost/unordered_map.hpp>
+#include <boost/intrusive/list.hpp>
+
+// Replacement policies for bcache.  A policy tracks the nodes that are in
+// memory and picks which to evict.  Hits do not call into the policy at
+// all, they just set the proxy's accessed bit without taking a lock, so
+// every policy here is built on reference bits rather than on moving
+// entries on each access.  All other calls are made with the cache lock
+// held.
+//
+// A policy is a template on the proxy type, which must be linkable into a
+// boost::intrusive::list and provide get_offset(), get_accessed(), 
+// set_accessed(bool), get_queue() and set_queue(int).  The interface is:
+//
+//   void set_capacity(size_t c)  -- how many nodes the cache aims to hold
+//   size_t size() const          -- how many nodes are tracked
+//   void insert(Proxy& p)        -- p has just come into memory
+//   void erase(Proxy& p)         -- p is being freed while in memory
+//   template<class Claim> 
+//   Proxy* evict(Claim& claim)   -- removes and returns a victim for which
+//                                   claim(p) returned true, or NULL if no
+//                                   node could be claimed (all are pinned)
+
+namespace btree_impl {
+
+// Offsets of recently evicted nodes, oldest first, with a limited size
+class ghost_list
+{
+	typedef std::list<off_t> list_t;
+public:
+	ghost_list() : m_size(0) {}
+
+	size_t size() const { return m_size; }
+	bool contains(off_t off) const { return m_index.find(off) != m_index.end(); }
+
+	void push(off_t off)
+	{
+		if (contains(off)) return;
+		m_index[off] = m_list.insert(m_list.end(), off);
+		m_size++;
+	}
+
+	bool erase(off_t off)
+	{
+		index_t::iterator it = m_index.find(off);
+		if (it == m_index.end()) return false;
+		m_list.erase(it->second);
+		m_index.erase(it);
+		m_size--;
+		return true;
+	}
+
+	void pop_oldest()
+	{
+		if (m_size == 0) return;
+		m_index.erase(m_list.front());
+		m_list.pop_front();
+		m_size--;
+	}
+
+	void trim(size_t max_size)
+	{
+		while(m_size > max_size)
+			pop_oldest();
+	}
+
+private:
+	typedef boost::unordered_map<off_t, list_t::iterator> index_t;
+	list_t m_list;
+	index_t m_index;
+	size_t m_size;
+};
+
+// Moves nodes from the front of 'from' to the back of 'to' until one is
+// found that is unused since it was last looked at and can be claimed.
+// Used nodes have their bit cleared, pinned ones stay in 'from'.  Gives up 
+// after 'tries' nodes.
+template<class Proxy, class Claim>
+Proxy* clock_sweep(boost::intrusive::list<Proxy>& from, boost::intrusive::list<Proxy>& to, 
+	int to_queue, size_t tries, Claim& claim)
+{
+	while(from.size() > 0 && tries-- > 0)
+	{
+		Proxy& p = from.front();
+		from.pop_front();
+		if (p.get_accessed())
+		{
+			p.set_accessed(false);
+			p.set_queue(to_queue);
+			to.push_back(p);
+		}
+		else if (claim(p))
+			return &p;
+		else
+			from.push_back(p);
+	}
+	return NULL;
+}
+
+// The clock algorithm, one list where used nodes get a second chance.  This
+// is the default, it's cheap but a large scan will flush the cache.
+template<class Proxy>
+class clock_replacement
+{
+	typedef boost::intrusive::list<Proxy> list_t;
+public:
+	void set_capacity(size_t c) {}
+	size_t size() const { return m_clock.size(); }
+	void insert(Proxy& p) { m_clock.push_back(p); }
+	void erase(Proxy& p) { m_clock.erase(m_clock.iterator_to(p)); }
+
+	template<class Claim>
+	Proxy* evict(Claim& claim)
+	{
+		return clock_sweep(m_clock, m_clock, 0, 2 * m_clock.size(), claim);
+	}
+
+private:
+	list_t m_clock;
+};
+
+// 2Q, with clocks in place of the LRU lists.  New nodes go into a FIFO
+// that holds about a quarter of the cache, and only nodes used again 
+// while there are promoted to the main clock.  Nodes evicted from the 
+// FIFO are remembered for a while, and come back straight into the main
+// clock if loaded again.  A scan only churns the FIFO, so it's working set
+// survives.
+template<class Proxy>
+class two_queue_replacement
+{
+	typedef boost::intrusive::list<Proxy> list_t;
+	enum { in_queue, main_queue };
+public:
+	two_queue_replacement() : m_capacity(0) {}
+
+	void set_capacity(size_t c) 
+	{ 
+		m_capacity = c; 
+		m_out.trim(out_size());
+	}
+	size_t size() const { return m_in.size() + m_main.size(); }
+
+	void insert(Proxy& p)
+	{
+		p.set_accessed(false);
+		if (m_out.erase(p.get_offset()))
+		{
+			p.set_queue(main_queue);
+			m_main.push_back(p);
+		}
+		else
+		{
+			p.set_queue(in_queue);
+			m_in.push_back(p);
+		}
+	}
+
+	void erase(Proxy& p)
+	{
+		list_t& l = (p.get_queue() == in_queue ? m_in : m_main);
+		l.erase(l.iterator_to(p));
+	}
+
+	template<class Claim>
+	Proxy* evict(Claim& claim)
+	{
+		size_t tries = 2 * size() + 1;
+		if (m_in.size() > std::max(size_t(1), m_capacity / 4) || m_main.size() == 0)
+		{
+			Proxy* p = clock_sweep(m_in, m_main, main_queue, m_in.size(), claim);
+			if (p)
+			{
+				m_out.push(p->get_offset());
+				m_out.trim(out_size());
+				return p;
+			}
+		}
+		return clock_sweep(m_main, m_main, main_queue, tries, claim);
+	}
+
+private:
+	size_t out_size() const { return std::max(size_t(1), m_capacity / 2); }
+
+	size_t m_capacity;
+	list_t m_in;
+	list_t m_main;
+	ghost_list m_out;
+};
+
+// CAR, clock with adaptive replacement (Bansal and Modha), the clock
+// version of ARC.  Nodes seen once live in t1 and nodes seen again in t2.
+// Ghost lists b1 and b2 remember recent evictions from each, and hits in
+// them move the target size of t1 towards whichever list would have kept 
+// the node.  Like 2Q it resists scans, and it adapts to workloads that
+// are mostly recency or mostly frequency driven.
+template<class Proxy>
+class car_replacement
+{
+	typedef boost::intrusive::list<Proxy> list_t;
+	enum { t1_queue, t2_queue };
+public:
+	car_replacement() : m_capacity(0), m_target(0) {}
+
+	void set_capacity(size_t c) 
+	{ 
+		m_capacity = c; 
+		m_target = std::min(m_target, c);
+		m_b1.trim(c);
+		m_b2.trim(c);
+	}
+	size_t size() const { return m_t1.size() + m_t2.size(); }
+
+	void insert(Proxy& p)
+	{
+		p.set_accessed(false);
+		off_t off = p.get_offset();
+		if (m_b1.erase(off))
+		{
+			// Recency would have kept it, grow t1
+			m_target = std::min(m_target + std::max(size_t(1), m_b2.size() / std::max(size_t(1), m_b1.size())), m_capacity);
+			p.set_queue(t2_queue);
+			m_t2.push_back(p);
+		}
+		else if (m_b2.erase(off))
+		{
+			// Frequency would have kept it, shrink t1
+			size_t delta = std::max(size_t(1), m_b1.size() / std::max(size_t(1), m_b2.size()));
+			m_target = (m_target > delta ? m_target - delta : 0);
+			p.set_queue(t2_queue);
+			m_t2.push_back(p);
+		}
+		else
+		{
+			// Keep the directory at no more than twice the cache
+			if (m_t1.size() + m_b1.size() >= m_capacity)
+				m_b1.pop_oldest();
+			else if (size() + m_b1.size() + m_b2.size() >= 2 * m_capacity)
+				m_b2.pop_oldest();
+			p.set_queue(t1_queue);
+			m_t1.push_back(p);
+		}
+	}
+
+	void erase(Proxy& p)
+	{
+		list_t& l = (p.get_queue() == t1_queue ? m_t1 : m_t2);
+		l.erase(l.iterator_to(p));
+	}
+
+	template<class Claim>
+	Proxy* evict(Claim& claim)
+	{
+		if (m_t1.size() > 0 && m_t1.size() >= std::max(size_t(1), m_target))
+		{
+			Proxy* p = clock_sweep(m_t1, m_t2, t2_queue, m_t1.size(), claim);
+			if (p)
+			{
+				m_b1.push(p->get_offset());
+				return p;
+			}
+		}
+		Proxy* p = clock_sweep(m_t2, m_t2, t2_queue, 2 * m_t2.size(), claim);
+		if (p)
+		{
+			m_b2.push(p->get_offset());
+			return p;
+		}
+		// Everything in t2 is pinned, fall back on t1
+		p = clock_sweep(m_t1, m_t2, t2_queue, m_t1.size(), claim);
+		if (p)
+		{
+			m_b1.push(p->get_offset());
+			return p;
+		}
+		return NULL;
+	}
+
+private:
+	size_t m_capacity;
+	size_t m_target;  // Target size of t1, 'p' in the paper
+	list_t m_t1;
+	list_t m_t2;
+	ghost_list m_b1;
+	ghost_list m_b2;
+};
+
+// Replays a trace of node offsets through a replacement policy, as a cache
+// holding 'capacity' nodes would see them, and counts the hits.  Used to
+// compare policies on recorded access patterns without any I/O.
+template<template<class> class Replacement>
+class replacement_simulator
+{
+public:
+	class proxy : public boost::intrusive::list_base_hook<>
+	{
+	public:
+		proxy(off_t off) : m_off(off), m_accessed(false), m_queue(0) {}
+		off_t get_offset() const { return m_off; }
+		bool get_accessed() const { return m_accessed; }
+		void set_accessed(bool accessed) { m_accessed = accessed; }
+		int get_queue() const { return m_queue; }
+		void set_queue(int queue) { m_queue = queue; }
+	private:
+		off_t m_off;
+		bool m_accessed;
+		int m_queue;
+	};
+
+	replacement_simulator(size_t capacity)
+		: m_capacity(capacity)
+		, m_hits(0)
+		, m_misses(0)
+	{
+		m_policy.set_capacity(capacity);
+	}
+
+	~replacement_simulator()
+	{
+		claim_all claim;
+		while(proxy* p = m_policy.evict(claim))
+			delete p;
+	}
+
+	// Returns true on a hit
+	bool access(off_t off)
+	{
+		typename resident_t::iterator it = m_resident.find(off);
+		if (it != m_resident.end())
+		{
+			it->second->set_accessed(true);
+			m_hits++;
+			return true;
+		}
+		m_misses++;
+		proxy* p = new proxy(off);
+		p->set_accessed(true);
+		m_policy.insert(*p);
+		m_resident[off] = p;
+		claim_all claim;
+		while(m_policy.size() > m_capacity)
+		{
+			proxy* victim = m_policy.evict(claim);
+			m_resident.erase(victim->get_offset());
+			delete victim;
+		}
+		return false;
+	}
+
+	size_t hits() const { return m_hits; }
+	size_t misses() const { return m_misses; }
+	double hit_rate() const 
+	{ 
+		return m_hits + m_misses == 0 ? 0.0 : double(m_hits) / (m_hits + m_misses); 
+	}
+
+private:
+	struct claim_all
+	{
+		bool operator()(proxy& p) const { return true; }
+	};
+	typedef boost::unordered_map<off_t, proxy*> resident_t;
+
+	size_t m_capacity;
+	Replacement<proxy> m_policy;
+	resident_t m_resident;
+	size_t m_hits;
+	size_t m_misses;
+};
+
+}
+
+#endif
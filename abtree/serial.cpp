@@ -17,6 +17,8 @@
 */
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 #include "abtree/serial.h"
 
 template<class IntType>
@@ -61,6 +63,30 @@ void deserialize(readable& src, off_t& x) { read_variable(src, x); }
 void serialize(writable& dest, size_t x) { write_variable(dest, x); }
 void deserialize(readable& src, size_t& x) { read_variable(src, x); }
 
+// Doubles are written as the 8 bytes of their IEEE bits, least 
+// significant first whatever the host order, which matches what x86 
+// hosts wrote before
+void serialize(writable& dest, double x) 
+{ 
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	unsigned char buf[8];
+	for(size_t i = 0; i < 8; i++)
+		buf[i] = (unsigned char) (bits >> (8 * i));
+	dest.write((const char*) buf, sizeof(buf)); 
+}
+
+void deserialize(readable& src, double& x) 
+{ 
+	unsigned char buf[8];
+	if (src.read((char*) buf, sizeof(buf)) != sizeof(buf))
+		throw io_exception("EOF in read of double");
+	uint64_t bits = 0;
+	for(size_t i = 0; i < 8; i++)
+		bits |= uint64_t(buf[i]) << (8 * i);
+	memcpy(&x, &bits, sizeof(x));
+}
+
 void serialize(writable& dest, const std::vector<char>& v)
 {
 	serialize(dest, v.size());
@@ -28,11 +28,21 @@ void serialize(writable& dest, off_t x);
 void deserialize(readable& src, off_t& x);
 void serialize(writable& dest, size_t x);
 void deserialize(readable& src, size_t& x);
+void serialize(writable& dest, double x);
+void deserialize(readable& src, double& x);
 
 void serialize(writable& dest, const std::vector<char>& v);
 void deserialize(readable& src, std::vector<char>& v);
 void serialize(writable& dest, const std::string& str);
 void deserialize(readable& src, std::string& str);
 
+// For use inside of templates, especially from classes that have their own
+// serialize members.  The unqualified call lets overloads for user types
+// declared after this header be found by argument dependent lookup.
+template<class T>
+void serialize_value(writable& dest, const T& x) { serialize(dest, x); }
+template<class T>
+void deserialize_value(readable& src, T& x) { deserialize(src, x); }
+
 #endif 
 
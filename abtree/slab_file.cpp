@@ -0,0 +1,190 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include "abtree/slab_file.h"
+
+stdio_slab::stdio_slab(const std::string& filename)
+	: m_io(filename)
+{
+	m_io.seek_end();
+	m_size = m_io.get_offset();
+}
+
+size_t stdio_slab::read_at(off_t offset, char* buf, size_t len)
+{
+	m_io.seek(offset);
+	return m_io.read(buf, len);
+}
+
+void stdio_slab::append(const char* buf, size_t len)
+{
+	// Not seek_end, so a retry overwrites what a failed append left
+	m_io.seek(m_size);
+	m_io.write(buf, len);
+	m_size += len;
+}
+
+fd_slab::fd_slab(const std::string& filename)
+	: m_fd(open(filename.c_str(), O_RDWR | O_CREAT, 0644))
+{
+	if (m_fd < 0)
+		throw io_exception("Unable to open file for writing");
+	m_size = lseek(m_fd, 0, SEEK_END);
+	if (m_size < 0)
+	{
+		close(m_fd);
+		throw io_exception("Failed to seek");
+	}
+}
+
+fd_slab::~fd_slab()
+{
+	close(m_fd);
+}
+
+size_t fd_slab::read_at(off_t offset, char* buf, size_t len)
+{
+	size_t total = 0;
+	while(len)
+	{
+		ssize_t r = pread(m_fd, buf, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			throw io_exception(printstring("IO error on read: %d", errno));
+		if (r == 0)
+			break;
+		total += r;
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+	return total;
+}
+
+void fd_slab::append(const char* buf, size_t len)
+{
+	off_t end = m_size;
+	while(len)
+	{
+		ssize_t r = pwrite(m_fd, buf, len, end);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			throw io_exception(printstring("IO error during write: %d", errno));
+		buf += r;
+		len -= r;
+		end += r;
+	}
+	m_size = end;
+}
+
+void fd_slab::datasync()
+{
+	if (fdatasync(m_fd) != 0)
+		throw io_exception("Failed to sync");
+}
+
+mapped_slab::mapped_slab(const std::string& filename)
+	: m_fd(open(filename.c_str(), O_RDONLY))
+	, m_data(NULL)
+{
+	if (m_fd < 0)
+		throw io_exception("Unable to open file for reading");
+	m_size = lseek(m_fd, 0, SEEK_END);
+	if (m_size > 0)
+	{
+		void* p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close(m_fd);
+			throw io_exception(printstring("Unable to map slab: %d", errno));
+		}
+		m_data = (char*) p;
+	}
+}
+
+mapped_slab::~mapped_slab()
+{
+	if (m_data)
+		munmap(m_data, m_size);
+	close(m_fd);
+}
+
+size_t mapped_slab::read_at(off_t offset, char* buf, size_t len)
+{
+	if (offset >= m_size)
+		return 0;
+	len = std::min(len, size_t(m_size - offset));
+	memcpy(buf, m_data + offset, len);
+	return len;
+}
+
+void mapped_slab::append(const char*, size_t)
+{
+	throw io_exception("Write to a closed slab");
+}
+
+void mapped_slab::datasync()
+{
+	if (fdatasync(m_fd) != 0)
+		throw io_exception("Failed to sync");
+}
+
+slab_reader::slab_reader(slab_file& file, off_t offset)
+	: m_file(file)
+	, m_offset(offset)
+	, m_pos(0)
+{}
+
+size_t slab_reader::read(char* buf, size_t len)
+{
+	size_t total = 0;
+	while(len)
+	{
+		if (m_pos == m_buf.size())
+		{
+			// Large reads skip the buffer
+			if (len >= k_buffer_size)
+			{
+				size_t r = m_file.read_at(m_offset, buf, len);
+				m_offset += r;
+				return total + r;
+			}
+			m_buf.resize(k_buffer_size);
+			m_buf.resize(m_file.read_at(m_offset, &m_buf[0], k_buffer_size));
+			m_pos = 0;
+			if (m_buf.empty())
+				break;
+		}
+		size_t n = std::min(len, m_buf.size() - m_pos);
+		memcpy(buf, &m_buf[m_pos], n);
+		m_pos += n;
+		m_offset += n;
+		buf += n;
+		len -= n;
+		total += n;
+	}
+	return total;
+}
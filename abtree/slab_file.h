@@ -0,0 +1,121 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __slab_file_h__
+#define __slab_file_h__
+
+#include <vector>
+#include "abtree/file_io.h"
+
+// The file behind one slab of a file_bstore, read at any offset and
+// appended to.  The store only appends under it's lock, and only reads 
+// without it if concurrent_reads() is true.
+class slab_file
+{
+public:
+	virtual ~slab_file() {}
+
+	virtual off_t size() = 0;
+	// Reads until len or the end of the file, returns the total read
+	virtual size_t read_at(off_t offset, char* buf, size_t len) = 0;
+	// If it throws, size() is unchanged, and the next append writes over 
+	// whatever part of buf reached the file
+	virtual void append(const char* buf, size_t len) = 0;
+	virtual void flush() {}  // Hands buffered appends to the OS
+	virtual void datasync() = 0;  // Waits until the appends are on the disk
+	virtual bool concurrent_reads() const { return false; }
+	virtual const char* data() { return NULL; }  // The whole file, if it's mapped
+	virtual int fd() { return -1; }  // For reads that go around the slab
+};
+
+// Through stdio, so reads seek the buffer the appends go through
+class stdio_slab : public slab_file
+{
+public:
+	stdio_slab(const std::string& filename);
+
+	off_t size() { return m_size; }
+	size_t read_at(off_t offset, char* buf, size_t len);
+	void append(const char* buf, size_t len);
+	void flush() { m_io.flush(); }
+	void datasync() { m_io.datasync(); }
+
+private:
+	file_io m_io;
+	off_t m_size;
+};
+
+// A raw descriptor, with pread and pwrite, which any number of threads 
+// can read at once.  Appends go straight to the OS.
+class fd_slab : public slab_file
+{
+public:
+	fd_slab(const std::string& filename);
+	~fd_slab();
+
+	off_t size() { return m_size; }
+	size_t read_at(off_t offset, char* buf, size_t len);
+	void append(const char* buf, size_t len);
+	void datasync();
+	bool concurrent_reads() const { return true; }
+	int fd() { return m_fd; }
+
+private:
+	int m_fd;
+	off_t m_size;
+};
+
+// A slab that has been rolled, so will never change again, mapped read
+// only.  Reads copy from the mapping, or use data() in place.
+class mapped_slab : public slab_file
+{
+public:
+	mapped_slab(const std::string& filename);
+	~mapped_slab();
+
+	off_t size() { return m_size; }
+	size_t read_at(off_t offset, char* buf, size_t len);
+	void append(const char* buf, size_t len);
+	void datasync();
+	bool concurrent_reads() const { return true; }
+	const char* data() { return m_data; }
+
+private:
+	int m_fd;
+	off_t m_size;
+	char* m_data;
+};
+
+// Reads a slab from an offset on, a buffer at a time
+class slab_reader : public readable
+{
+	static const size_t k_buffer_size = 4096;
+public:
+	slab_reader(slab_file& file, off_t offset);
+
+	size_t read(char* buf, size_t len);
+	off_t get_offset() const { return m_offset; }  // Of the next byte read
+
+private:
+	slab_file& m_file;
+	off_t m_offset;
+	std::vector<char> m_buf;
+	size_t m_pos;  // Of m_offset in m_buf
+};
+
+#endif
@@ -0,0 +1,107 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __slab_pool_h__
+#define __slab_pool_h__
+
+#include <vector>
+#include <new>
+#include <boost/noncopyable.hpp>
+#include <boost/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+// Allocator for objects of one type.  Objects are carved out of large slabs
+// and freed slots go on a free list for reuse, so an allocation is a few
+// pointer moves, and objects made around the same time sit next to each
+// other in memory.  Slabs are only given back when the pool is destroyed,
+// which does not run the destructors of objects still alive.
+template<class T>
+class slab_pool : boost::noncopyable
+{
+	union slot
+	{
+		slot* next;
+		typename boost::aligned_storage<sizeof(T), boost::alignment_of<T>::value>::type storage;
+	};
+public:
+	slab_pool(size_t slab_size = 1024)
+		: m_slab_size(slab_size)
+		, m_free(NULL)
+		, m_used(slab_size)
+		, m_live(0)
+	{}
+
+	~slab_pool()
+	{
+		for(size_t i = 0; i < m_slabs.size(); i++)
+			delete[] m_slabs[i];
+	}
+
+	T* construct(const T& v)
+	{
+		void* p = allocate();
+		try {
+			return new (p) T(v);
+		} catch(...) {
+			deallocate(p);
+			throw;
+		}
+	}
+
+	void destroy(T* p)
+	{
+		p->~T();
+		deallocate(p);
+	}
+
+	size_t live() const { return m_live; }
+	size_t capacity() const { return m_slabs.size() * m_slab_size; }
+
+private:
+	void* allocate()
+	{
+		m_live++;
+		if (m_free)
+		{
+			slot* s = m_free;
+			m_free = s->next;
+			return s;
+		}
+		if (m_used == m_slab_size)
+		{
+			m_slabs.push_back(new slot[m_slab_size]);
+			m_used = 0;
+		}
+		return &m_slabs.back()[m_used++];
+	}
+
+	void deallocate(void* p)
+	{
+		m_live--;
+		slot* s = static_cast<slot*>(p);
+		s->next = m_free;
+		m_free = s;
+	}
+
+	size_t m_slab_size;
+	std::vector<slot*> m_slabs;
+	slot* m_free;
+	size_t m_used;
+	size_t m_live;
+};
+
+#endif
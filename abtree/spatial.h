@@ -2,7 +2,11 @@
 #ifndef __spatial_h__
 #define __spatial_h__
 
+#include <string.h>
+#include <algorithm>
 #include "hilbert.h"
+#include "hilbert_fast.h"
+#include "tree_walker.h"
 
 template<size_t dims>
 struct point
@@ -17,6 +21,28 @@ struct bounding_region
 	point<dims> max_point;
 };
 
+// The bounds of a set of points along with how many there are.  Using this
+// as the value of a spatial tree allows counting without enumeration.
+template<size_t dims>
+struct spatial_summary
+{
+	spatial_summary() : count(0) {}
+	explicit spatial_summary(const point<dims>& p) 
+		: count(1)
+	{
+		region.min_point = p;
+		region.max_point = p;
+	}
+
+	explicit spatial_summary(const bounding_region<dims>& extent)
+		: region(extent)
+		, count(1)
+	{}
+
+	bounding_region<dims> region;
+	size_t count;
+};
+
 class spatial_less 
 {
 public:
@@ -39,6 +65,261 @@ public:
 			a.max_point.coords[i] = std::max(a.max_point.coords[i], b.max_point.coords[i]);
 		}
 	}
+
+	template<size_t dims>
+	void operator()(spatial_summary<dims>& a, const spatial_summary<dims>& b) const
+	{
+		if (b.count == 0) return;
+		if (a.count == 0) { a = b; return; }
+		(*this)(a.region, b.region);
+		a.count += b.count;
+	}
+};
+
+template<size_t dims>
+const bounding_region<dims>& get_region(const bounding_region<dims>& r) { return r; }
+
+template<size_t dims>
+const bounding_region<dims>& get_region(const spatial_summary<dims>& s) { return s.region; }
+
+template<size_t dims>
+bool region_overlap(const bounding_region<dims>& a, const bounding_region<dims>& b)
+{
+	for(size_t i = 0; i < dims; i++)
+		if (b.min_point.coords[i] > a.max_point.coords[i] || b.max_point.coords[i] < a.min_point.coords[i])
+			return false;
+	return true;
+}
+
+template<size_t dims>
+bool region_contains(const bounding_region<dims>& outer, const bounding_region<dims>& inner)
+{
+	for(size_t i = 0; i < dims; i++)
+		if (inner.min_point.coords[i] < outer.min_point.coords[i] || inner.max_point.coords[i] > outer.max_point.coords[i])
+			return false;
+	return true;
+}
+
+// Functor for forward_subset, matches subtrees that overlap a query box
+template<size_t dims>
+class region_overlaps
+{
+public:
+	region_overlaps(const bounding_region<dims>& box) : m_box(box) {}
+	template<class Value>
+	bool operator()(const Value& v) const { return region_overlap(m_box, get_region(v)); }
+private:
+	bounding_region<dims> m_box;
+};
+
+namespace spatial_impl {
+
+template<class Tree, size_t dims>
+void total_within(const Tree& tree, const typename Tree::node_ptr_type& node, size_t height, 
+	const bounding_region<dims>& box, typename Tree::mapped_type& total)
+{
+	size_t size = node->size();
+	for(size_t i = 0; i < size; i++)
+	{
+		typename Tree::mapped_type v = node->val(i);
+		if (!region_overlap(box, get_region(v)))
+			continue;
+		if (height == 1 || region_contains(box, get_region(v)))
+			tree.get_policy().aggregate(total, v);
+		else
+			total_within(tree, node->ptr(i), height - 1, box, total);
+	}
+}
+
+}
+
+// Aggregates the values of every entry overlapping box.  Subtrees which
+// lie entirely inside of the box are added as a whole from their parent's
+// aggregate rather than walked, so only the nodes along the edges of the
+// box are visited.  Works on any spatial tree whose values have a
+// get_region(), and base should be the identity of the aggregate.
+template<class Tree, size_t dims>
+typename Tree::mapped_type total_within(const Tree& tree, const bounding_region<dims>& box, 
+	const typename Tree::mapped_type& base = typename Tree::mapped_type())
+{
+	typename Tree::mapped_type total = base;
+	if (tree.get_height() != 0)
+		spatial_impl::total_within(tree, tree.get_root(), tree.get_height(), box, total);
+	return total;
+}
+
+// Number of entries overlapping box, for trees of spatial_summary
+template<class Tree, size_t dims>
+size_t count_within(const Tree& tree, const bounding_region<dims>& box)
+{
+	return total_within(tree, box).count;
+}
+
+// Walks every entry overlapping box, in key order, skipping any subtree
+// whose bounds miss the box
+template<class Tree, size_t dims>
+std::pair<
+	forward_subset_iterator<Tree, region_overlaps<dims> >,
+	forward_subset_iterator<Tree, region_overlaps<dims> >
+>
+intersecting(const Tree& tree, const bounding_region<dims>& box)
+{
+	return forward_subset(tree, region_overlaps<dims>(box));
+}
+
+// Maps doubles onto unsigned integers such that the integer order matches
+// the IEEE order, and then keeps the top bits.  This works for any input,
+// but since the exponent lands in the high bits the resolution is
+// logarithmic rather than linear.
+class ieee_quantizer
+{
+public:
+	bitmask_t operator()(size_t dim, double x, unsigned bits) const
+	{
+		bitmask_t u;
+		memcpy(&u, &x, sizeof(u));
+		if (u >> 63)
+			u = ~u;
+		else
+			u |= bitmask_t(1) << 63;
+		return u >> (64 - bits);
+	}
+};
+
+// Linearly maps a fixed region of space onto the hilbert grid, points
+// outside of the region are clamped to its edges.
+template<size_t dims>
+class linear_quantizer
+{
+public:
+	linear_quantizer() 
+	{
+		for(size_t i = 0; i < dims; i++)
+		{
+			m_domain.min_point.coords[i] = 0.0;
+			m_domain.max_point.coords[i] = 1.0;
+		}
+	}
+	linear_quantizer(const bounding_region<dims>& domain) : m_domain(domain) {}
+
+	bitmask_t operator()(size_t dim, double x, unsigned bits) const
+	{
+		double lo = m_domain.min_point.coords[dim];
+		double hi = m_domain.max_point.coords[dim];
+		bitmask_t top = (bits == 64 ? ~bitmask_t(0) : (bitmask_t(1) << bits) - 1);
+		if (!(x > lo)) return 0;
+		if (!(x < hi)) return top;
+		return bitmask_t((x - lo) / (hi - lo) * double(top));
+	}
+private:
+	bounding_region<dims> m_domain;
+};
+
+// A point along with it's precomputed position on the hilbert curve.  The
+// index is computed once, at construction time, so comparisons during tree
+// searches only look at a single integer.  Points which quantize to the same
+// grid cell fall back to the exact IEEE hilbert ordering, so distinct points
+// never compare equal.  All keys placed in one tree must use the same 
+// quantizer.
+template<size_t dims>
+struct spatial_key
+{
+	static const unsigned bits_per_dim = (8 * sizeof(bitmask_t)) / dims;
+
+	spatial_key() : index(0) {}
+
+	explicit spatial_key(const point<dims>& p)
+		: pt(p)
+	{
+		compute(ieee_quantizer());
+	}
+
+	template<class Quantizer>
+	spatial_key(const point<dims>& p, const Quantizer& quantize)
+		: pt(p)
+	{
+		compute(quantize);
+	}
+
+	template<class Quantizer>
+	void compute(const Quantizer& quantize)
+	{
+		bitmask_t grid[dims];
+		for(size_t i = 0; i < dims; i++)
+			grid[i] = quantize(i, pt.coords[i], bits_per_dim);
+		index = hilbert_c2i_fast(dims, bits_per_dim, grid);
+	}
+
+	point<dims> pt;
+	bitmask_t index;
+};
+
+class spatial_key_less
+{
+public:
+	template<size_t dims>
+	bool operator()(const spatial_key<dims>& a, const spatial_key<dims>& b) const
+	{
+		if (a.index != b.index)
+			return a.index < b.index;
+		return hilbert_ieee_cmp(dims, a.pt.coords, b.pt.coords) < 0;
+	}
+};
+
+// A box keyed by the hilbert index of it's center.  A tree of these with
+// bounding_region (or spatial_summary) values is a hilbert packed R-tree:
+// nearby boxes share nodes, each node's aggregate is the union of the
+// extents below it, and intersection queries prune on it.  Boxes with the
+// same center are ordered by their corners so distinct boxes never compare
+// equal.
+template<size_t dims>
+struct extent_key
+{
+	extent_key() {}
+
+	explicit extent_key(const bounding_region<dims>& e)
+		: center(center_of(e))
+		, extent(e)
+	{}
+
+	template<class Quantizer>
+	extent_key(const bounding_region<dims>& e, const Quantizer& quantize)
+		: center(center_of(e), quantize)
+		, extent(e)
+	{}
+
+	static point<dims> center_of(const bounding_region<dims>& e)
+	{
+		point<dims> c;
+		for(size_t i = 0; i < dims; i++)
+			c.coords[i] = e.min_point.coords[i] + (e.max_point.coords[i] - e.min_point.coords[i]) / 2;
+		return c;
+	}
+
+	spatial_key<dims> center;
+	bounding_region<dims> extent;
+};
+
+class extent_key_less
+{
+public:
+	template<size_t dims>
+	bool operator()(const extent_key<dims>& a, const extent_key<dims>& b) const
+	{
+		if (spatial_key_less()(a.center, b.center)) return true;
+		if (spatial_key_less()(b.center, a.center)) return false;
+		for(size_t i = 0; i < dims; i++)
+		{
+			if (a.extent.min_point.coords[i] != b.extent.min_point.coords[i])
+				return a.extent.min_point.coords[i] < b.extent.min_point.coords[i];
+		}
+		for(size_t i = 0; i < dims; i++)
+		{
+			if (a.extent.max_point.coords[i] != b.extent.max_point.coords[i])
+				return a.extent.max_point.coords[i] < b.extent.max_point.coords[i];
+		}
+		return false;
+	}
 };
 
 #endif
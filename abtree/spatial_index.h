@@ -0,0 +1,297 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __spatial_index_h__
+#define __spatial_index_h__
+
+#include "abtree/abtree.h"
+#include "abtree/spatial.h"
+#include "abtree/tree_walker.h"
+#include "abtree/serial.h"
+#include <boost/shared_ptr.hpp>
+#include <boost/foreach.hpp>
+#include <functional>
+#include <queue>
+#include <map>
+
+// An entry in the location tree, ordered by position on the hilbert curve
+// and then by id, so that many ids may share one location.
+template<size_t dims, class Id>
+struct spatial_entry
+{
+	spatial_entry() {}
+	spatial_entry(const point<dims>& p, const Id& _id) : loc(p), id(_id) {}
+
+	spatial_key<dims> loc;
+	Id id;
+};
+
+template<class IdLess>
+class spatial_entry_less
+{
+public:
+	spatial_entry_less(const IdLess& id_less = IdLess()) : m_id_less(id_less) {}
+
+	template<size_t dims, class Id>
+	bool operator()(const spatial_entry<dims, Id>& a, const spatial_entry<dims, Id>& b) const
+	{
+		if (spatial_key_less()(a.loc, b.loc)) return true;
+		if (spatial_key_less()(b.loc, a.loc)) return false;
+		return m_id_less(a.id, b.id);
+	}
+private:
+	IdLess m_id_less;
+};
+
+// Squared distance from a point to the closest part of a box
+template<size_t dims>
+double min_dist2(const point<dims>& p, const bounding_region<dims>& b)
+{
+	double r = 0.0;
+	for(size_t i = 0; i < dims; i++)
+	{
+		double d = 0.0;
+		if (p.coords[i] < b.min_point.coords[i])
+			d = b.min_point.coords[i] - p.coords[i];
+		else if (p.coords[i] > b.max_point.coords[i])
+			d = p.coords[i] - b.max_point.coords[i];
+		r += d * d;
+	}
+	return r;
+}
+
+// Policy for keeping the location tree of a spatial_index in an abtree_store.
+// Only the coordinates and the id are written, the hilbert index is
+// recomputed on load.  The id type must have serialize/deserialize overloads.
+template<size_t dims, class Id, class IdLess = std::less<Id> >
+class spatial_index_policy
+{
+public:
+	static const size_t node_size = 20;
+	typedef spatial_entry<dims, Id> key_type;
+	typedef spatial_summary<dims> mapped_type;
+
+	spatial_index_policy(const IdLess& id_less = IdLess()) : m_less(id_less) {}
+
+	bool less(const key_type& a, const key_type& b) const { return m_less(a, b); }
+	void aggregate(mapped_type& out, const mapped_type& in) const { spatial_accumulate()(out, in); }
+	void serialize(writable& out, const key_type& k, const mapped_type& v) const
+	{
+		for(size_t i = 0; i < dims; i++)
+			::serialize(out, k.loc.pt.coords[i]);
+		serialize_value(out, k.id);
+		for(size_t i = 0; i < dims; i++)
+		{
+			::serialize(out, v.region.min_point.coords[i]);
+			::serialize(out, v.region.max_point.coords[i]);
+		}
+		::serialize(out, v.count);
+	}
+	void deserialize(readable& in, key_type& k, mapped_type& v) const
+	{
+		point<dims> p;
+		for(size_t i = 0; i < dims; i++)
+			::deserialize(in, p.coords[i]);
+		deserialize_value(in, k.id);
+		k.loc = spatial_key<dims>(p);
+		for(size_t i = 0; i < dims; i++)
+		{
+			::deserialize(in, v.region.min_point.coords[i]);
+			::deserialize(in, v.region.max_point.coords[i]);
+		}
+		::deserialize(in, v.count);
+	}
+private:
+	spatial_entry_less<IdLess> m_less;
+};
+
+// A set of ids, each with a location.  Ids are kept in a hilbert ordered
+// aggregate btree whose values are bounding boxes with counts, which makes
+// box queries, counts and nearest neighbor searches only visit the parts of
+// the tree that matter.  A forward map from id to location is held in memory.  By default
+// the location tree is an in memory abtree, but any tree with the same key,
+// value and aggregate will do, such as one attached from an
+// abtree_store<spatial_index_policy<dims, Id> >.  In that case the forward
+// map is rebuilt by a scan when the index is constructed.
+template<size_t dims, class Id, class IdLess = std::less<Id>,
+	class Tree = abtree<spatial_entry<dims, Id>, spatial_summary<dims>, spatial_accumulate, spatial_entry_less<IdLess> > >
+class spatial_index
+{
+public:
+	typedef Tree tree_type;
+	typedef boost::shared_ptr<Tree> tree_ptr_t;
+	typedef point<dims> point_type;
+	typedef bounding_region<dims> region_type;
+	typedef spatial_entry<dims, Id> entry_type;
+	typedef std::map<Id, point_type, IdLess> forward_map_t;
+	typedef typename forward_map_t::const_iterator const_iterator;
+
+	spatial_index(const IdLess& id_less = IdLess())
+		: m_tree(new Tree(spatial_accumulate(), spatial_entry_less<IdLess>(id_less)))
+		, m_forward(id_less)
+	{}
+
+	spatial_index(const tree_ptr_t& tree, const IdLess& id_less = IdLess())
+		: m_tree(tree)
+		, m_forward(id_less)
+	{
+		typename Tree::const_iterator it, itEnd = m_tree->end();
+		for(it = m_tree->begin(); it != itEnd; ++it)
+			m_forward[it->first.id] = it->first.loc.pt;
+	}
+
+	size_t size() const { return m_forward.size(); }
+	bool empty() const { return m_forward.empty(); }
+	const_iterator begin() const { return m_forward.begin(); }
+	const_iterator end() const { return m_forward.end(); }
+	const Tree& get_tree() const { return *m_tree; }
+
+	// Returns the location of an id, or NULL if it isn't present
+	const point_type* get(const Id& id) const
+	{
+		const_iterator it = m_forward.find(id);
+		if (it == m_forward.end()) return NULL;
+		return &it->second;
+	}
+
+	// Adds a new id, returns false and does nothing if it already exists
+	bool insert(const Id& id, const point_type& p)
+	{
+		if (!m_forward.insert(std::make_pair(id, p)).second)
+			return false;
+		add(id, p);
+		return true;
+	}
+
+	// Changes the location of an existing id, returns false if it is missing
+	bool move(const Id& id, const point_type& p)
+	{
+		typename forward_map_t::iterator it = m_forward.find(id);
+		if (it == m_forward.end())
+			return false;
+		m_tree->erase(entry_type(it->second, id));
+		it->second = p;
+		add(id, p);
+		return true;
+	}
+
+	// Inserts or moves as needed
+	void set(const Id& id, const point_type& p)
+	{
+		if (!move(id, p))
+			insert(id, p);
+	}
+
+	bool erase(const Id& id)
+	{
+		typename forward_map_t::iterator it = m_forward.find(id);
+		if (it == m_forward.end())
+			return false;
+		m_tree->erase(entry_type(it->second, id));
+		m_forward.erase(it);
+		return true;
+	}
+
+	void clear()
+	{
+		m_tree->clear();
+		m_forward.clear();
+	}
+
+	// Writes the id of every entry inside of box (edges included) to out
+	template<class OutputIterator>
+	OutputIterator within(const region_type& box, OutputIterator out) const
+	{
+		typedef typename Tree::value_type value_t;
+		BOOST_FOREACH(const value_t& kvp, forward_subset(*m_tree, region_overlaps<dims>(box)))
+			*out++ = kvp.first.id;
+		return out;
+	}
+
+	// Number of entries inside of box, without visiting them
+	size_t count_within(const region_type& box) const
+	{
+		return ::count_within(*m_tree, box);
+	}
+
+	// Writes the ids of the k entries closest to p to out, nearest first.
+	// The search is best first, subtrees are opened in order of the
+	// distance to their bounding box, so only the nodes which could hold
+	// one of the results are visited.
+	template<class OutputIterator>
+	OutputIterator nearest(const point_type& p, size_t k, OutputIterator out) const
+	{
+		if (k == 0 || m_tree->get_height() == 0)
+			return out;
+		std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate> > queue;
+		queue.push(candidate(0.0, m_tree->get_root(), m_tree->get_height()));
+		while(!queue.empty() && k > 0)
+		{
+			candidate top = queue.top();
+			queue.pop();
+			if (top.height == 0)
+			{
+				*out++ = top.id;
+				k--;
+				continue;
+			}
+			node_ptr_t node = top.node;
+			size_t size = node->size();
+			for(size_t i = 0; i < size; i++)
+			{
+				double dist = min_dist2(p, get_region(node->val(i)));
+				if (top.height == 1)
+					queue.push(candidate(dist, node->key(i).id));
+				else
+					queue.push(candidate(dist, node->ptr(i), top.height - 1));
+			}
+		}
+		return out;
+	}
+
+private:
+	typedef typename Tree::node_ptr_type node_ptr_t;
+
+	// Either a subtree (height > 0) or a single entry (height == 0)
+	struct candidate
+	{
+		candidate(double _dist, const node_ptr_t& _node, size_t _height)
+			: dist(_dist), node(_node), height(_height) {}
+		candidate(double _dist, const Id& _id)
+			: dist(_dist), height(0), id(_id) {}
+		bool operator>(const candidate& rhs) const
+		{
+			// Entries win ties so results come out as soon as possible
+			if (dist != rhs.dist) return dist > rhs.dist;
+			return height > rhs.height;
+		}
+		double dist;
+		node_ptr_t node;
+		size_t height;
+		Id id;
+	};
+
+	void add(const Id& id, const point_type& p)
+	{
+		m_tree->insert(std::make_pair(entry_type(p, id), spatial_summary<dims>(p)));
+	}
+
+	tree_ptr_t m_tree;
+	forward_map_t m_forward;
+};
+
+#endif
@@ -0,0 +1,172 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "abtree/uring.h"
+#include "abtree/io.h"
+
+// The ring is driven with raw system calls, rather than liburing, so
+// there is nothing more to install.  Without the headers, every read
+// falls back to pread.
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define ABT_HAVE_URING
+#endif
+
+uring_reader::uring_reader(unsigned entries)
+	: m_fd(-1)
+	, m_entries(entries)
+	, m_sq_ring(MAP_FAILED)
+	, m_cq_ring(MAP_FAILED)
+	, m_sqes(MAP_FAILED)
+{
+#ifdef ABT_HAVE_URING
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return;
+	m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+	m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_cq_ring = m_sq_ring;
+	else if (m_sq_ring != MAP_FAILED)
+		m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			fd, IORING_OFF_CQ_RING);
+	m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (m_cq_ring != MAP_FAILED)
+		m_sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+	{
+		if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+			munmap(m_cq_ring, m_cq_ring_size);
+		if (m_sq_ring != MAP_FAILED)
+			munmap(m_sq_ring, m_sq_ring_size);
+		close(fd);
+		return;
+	}
+	char* sq = (char*) m_sq_ring;
+	m_sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	m_sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+	m_sq_array = (unsigned*) (sq + p.sq_off.array);
+	char* cq = (char*) m_cq_ring;
+	m_cq_head = (unsigned*) (cq + p.cq_off.head);
+	m_cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	m_cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+	m_cqes = cq + p.cq_off.cqes;
+	m_entries = p.sq_entries;
+	m_fd = fd;
+#endif
+}
+
+uring_reader::~uring_reader()
+{
+	if (m_fd < 0)
+		return;
+	munmap(m_sqes, m_sqes_size);
+	if (m_cq_ring != m_sq_ring)
+		munmap(m_cq_ring, m_cq_ring_size);
+	munmap(m_sq_ring, m_sq_ring_size);
+	close(m_fd);
+}
+
+void uring_reader::read(std::vector<request>& requests)
+{
+	abt_lock lock(m_mutex);
+	for(size_t i = 0; m_fd >= 0 && i < requests.size(); i += m_entries)
+		submit(requests, i, std::min(size_t(m_entries), requests.size() - i));
+	// Whatever the ring didn't finish, including short reads
+	for(size_t i = 0; i < requests.size(); i++)
+		pread_rest(requests[i]);
+}
+
+void uring_reader::submit(std::vector<request>& requests, size_t first, size_t count)
+{
+#ifdef ABT_HAVE_URING
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*) m_sqes;
+	unsigned tail = *m_sq_tail;
+	for(size_t i = first; i < first + count; i++)
+	{
+		unsigned index = tail & m_sq_mask;
+		struct io_uring_sqe& sqe = sqes[index];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = requests[i].fd;
+		sqe.off = requests[i].offset;
+		sqe.addr = (unsigned long) requests[i].buf;
+		sqe.len = requests[i].len;
+		sqe.user_data = i;
+		m_sq_array[index] = index;
+		tail++;
+	}
+	// The entries must be visible before the new tail
+	__sync_synchronize();
+	*m_sq_tail = tail;
+	__sync_synchronize();
+	unsigned to_submit = count;
+	size_t reaped = 0;
+	while(reaped < count)
+	{
+		int r = syscall(__NR_io_uring_enter, m_fd, to_submit, count - reaped, 
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0 && errno != EINTR)
+			throw io_exception(printstring("io_uring_enter failed: %d", errno));
+		if (r > 0)
+			to_submit -= std::min(to_submit, unsigned(r));
+		unsigned head = *m_cq_head;
+		__sync_synchronize();
+		unsigned cq_tail = *m_cq_tail;
+		struct io_uring_cqe* cqes = (struct io_uring_cqe*) m_cqes;
+		for(; head != cq_tail; head++)
+		{
+			struct io_uring_cqe& cqe = cqes[head & m_cq_mask];
+			// Failures are left to pread, which reports them
+			if (cqe.res > 0)
+				requests[cqe.user_data].done = cqe.res;
+			reaped++;
+		}
+		__sync_synchronize();
+		*m_cq_head = head;
+	}
+#endif
+}
+
+void uring_reader::pread_rest(request& r)
+{
+	while(r.done < r.len)
+	{
+		ssize_t n = pread(r.fd, r.buf + r.done, r.len - r.done, r.offset + r.done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw io_exception(printstring("IO error on read: %d", errno));
+		if (n == 0)
+			break;
+		r.done += n;
+	}
+}
@@ -0,0 +1,74 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __uring_h__
+#define __uring_h__
+
+#include <vector>
+#include <sys/types.h>
+#include "abtree/abt_thread.h"
+
+// Reads many ranges of files with one io_uring submission, so the device
+// works on them all at once.  Where io_uring isn't available, or fails a
+// read, the reads are done with pread one after another.  Only one batch
+// is in flight at a time.
+class uring_reader
+{
+public:
+	struct request
+	{
+		request() : fd(-1), offset(0), buf(NULL), len(0), done(0) {}
+		request(int _fd, off_t _offset, char* _buf, size_t _len) 
+			: fd(_fd), offset(_offset), buf(_buf), len(_len), done(0) {}
+		int fd;
+		off_t offset;
+		char* buf;
+		size_t len;
+		size_t done;  // Bytes read, short only at the end of the file
+	};
+
+	uring_reader(unsigned entries = 64);
+	~uring_reader();
+
+	bool available() const { return m_fd >= 0; }
+	// Blocks until every request is done, throws on errors
+	void read(std::vector<request>& requests);
+
+private:
+	void submit(std::vector<request>& requests, size_t first, size_t count);
+	static void pread_rest(request& r);
+
+	int m_fd;
+	unsigned m_entries;
+	void* m_sq_ring;
+	size_t m_sq_ring_size;
+	void* m_cq_ring;
+	size_t m_cq_ring_size;
+	void* m_sqes;
+	size_t m_sqes_size;
+	volatile unsigned* m_sq_tail;
+	unsigned m_sq_mask;
+	unsigned* m_sq_array;
+	volatile unsigned* m_cq_head;
+	volatile unsigned* m_cq_tail;
+	unsigned m_cq_mask;
+	void* m_cqes;
+	abt_mutex m_mutex;
+};
+
+#endif
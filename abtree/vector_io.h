@@ -19,6 +19,7 @@
 #define __vector_io_h__
 
 #include <vector>
+#include <string.h>
 #include "abtree/io.h"
 
 class vector_writer : public writable
@@ -59,5 +60,30 @@ private:
 	std::vector<char>& m_buffer;
 };
 
+// Reads memory owned by someone else, such as a mapped file
+class memory_reader : public readable
+{
+public:
+	memory_reader(const char* buffer, size_t size)
+		: m_offset(0)
+		, m_buffer(buffer)
+		, m_size(size)
+	{}
+
+	size_t read(char* buf, size_t len)
+	{
+		if (len > (m_size - m_offset))
+			len = m_size - m_offset;
+		memcpy(buf, m_buffer + m_offset, len);
+		m_offset += len;
+		return len;
+	}
+	size_t get_offset() const { return m_offset; }
+private:
+	size_t m_offset;
+	const char* m_buffer;
+	size_t m_size;
+};
+
 #endif
 
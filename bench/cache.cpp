@@ -0,0 +1,478 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "abtree/disk_abtree.h"
+#include "gtest/gtest.h"
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+struct cache_bench_policy
+{
+	typedef int key_type;
+	typedef int mapped_type;
+	static const size_t node_size = 20;
+	bool less(const int& a, const int& b) const { return a < b; }
+	void aggregate(int& out, const int& in) const { out += in; }
+	void serialize(writable& out, const int& k, const int& v) const { ::serialize(out, k); ::serialize(out, v); }
+	void deserialize(readable& in, int& k, int& v) const { ::deserialize(in, k); ::deserialize(in, v); }
+};
+
+typedef abtree_store<cache_bench_policy> cache_store_t;
+typedef cache_store_t::tree_type cache_tree_t;
+
+static const int k_cache_keys = 100000;
+static const size_t k_cache_lookups = 400000;
+
+template<class Tree>
+struct reader_args
+{
+	const Tree* tree;
+	size_t lookups;
+	unsigned int seed;
+	size_t found;
+};
+
+template<class Tree>
+static void* reader(void* p)
+{
+	reader_args<Tree>* args = (reader_args<Tree>*) p;
+	for(size_t i = 0; i < args->lookups; i++)
+	{
+		int k = rand_r(&args->seed) % k_cache_keys;
+		if (args->tree->find(k) != args->tree->end())
+			args->found++;
+	}
+	return NULL;
+}
+
+// Splits a fixed number of random lookups over a varying number of threads
+template<class Tree>
+static void time_readers(const char* name, const Tree& tree)
+{
+	for(size_t threads = 1; threads <= 8; threads *= 2)
+	{
+		std::vector<pthread_t> ids(threads);
+		std::vector<reader_args<Tree> > args(threads);
+		double start = now();
+		for(size_t i = 0; i < threads; i++)
+		{
+			args[i].tree = &tree;
+			args[i].lookups = k_cache_lookups / threads;
+			args[i].seed = i + 1;
+			args[i].found = 0;
+			pthread_create(&ids[i], NULL, reader<Tree>, &args[i]);
+		}
+		size_t found = 0;
+		for(size_t i = 0; i < threads; i++)
+		{
+			pthread_join(ids[i], NULL);
+			found += args[i].found;
+		}
+		double t = now() - start;
+		printf("%s, %d threads: %.0f lookups/s\n", name, (int) threads, k_cache_lookups / t);
+		ASSERT_EQ(found, (threads * (k_cache_lookups / threads)));
+	}
+}
+
+TEST(bench, cache_threads)
+{
+	system("rm -rf /tmp/bench_cache");
+	{
+		cache_store_t store("/tmp/bench_cache", true, 1000, 100000);
+		cache_store_t::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < k_cache_keys; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+		time_readers("resident", *tree);
+	}
+	{
+		// Reopened with a cache much smaller than the tree
+		cache_store_t store("/tmp/bench_cache", false, 1000, 1000);
+		cache_store_t::tree_ptr_t tree = store.attach("root");
+		time_readers("small cache", *tree);
+	}
+	{
+		// Reads of the slabs with pread, outside the store's lock
+		typedef abtree_store<cache_bench_policy, fd_bstore> fd_store_t;
+		fd_store_t store("/tmp/bench_cache", false, 1000, 1000);
+		fd_store_t::tree_ptr_t tree = store.attach("root");
+		time_readers("small cache, fd slabs", *tree);
+	}
+}
+
+// Small slabs, so almost every node is in a closed one, which is mapped
+TEST(bench, mapped_slabs)
+{
+	typedef abtree_store<cache_bench_policy, fd_bstore> fd_store_t;
+	system("rm -rf /tmp/bench_cache");
+	{
+		cache_store_t store("/tmp/bench_cache", true, 1000, 100000);
+		store.get_file().set_slab_size(64 * 1024);
+		cache_store_t::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < k_cache_keys; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+	}
+	{
+		cache_store_t store("/tmp/bench_cache", false, 1000, 1000);
+		time_readers("64k slabs, small cache", *store.attach("root"));
+	}
+	{
+		fd_store_t store("/tmp/bench_cache", false, 1000, 1000);
+		time_readers("64k slabs, small cache, fd slabs", *store.attach("root"));
+	}
+}
+
+// Opening reads the root from the superblock, or without it scans the
+// newest slab for the last root
+TEST(bench, reopen)
+{
+	system("rm -rf /tmp/bench_cache");
+	{
+		file_bstore store("/tmp/bench_cache", true);
+		for(int i = 0; i < 100; i++)
+		{
+			for(int j = 0; j < 1000; j++)
+				store.write_node(std::vector<char>(200, 'x'));
+			store.write_root(std::vector<char>(100, 'r'));
+		}
+		store.commit();
+	}
+	for(int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+			system("rm /tmp/bench_cache/super");
+		double start = now();
+		for(int i = 0; i < 10; i++)
+		{
+			file_bstore store("/tmp/bench_cache");
+			std::vector<char> root;
+			store.read_root(root);
+			ASSERT_EQ(root.size(), size_t(100));
+		}
+		printf("%s: %.2f ms per open\n", pass == 0 ? "superblock" : "scan", (now() - start) * 100);
+	}
+}
+
+typedef cache_tree_t::node_ptr_type cache_node_ptr_t;
+
+// Appends the offsets of the nodes that a find of k visits, root first
+static void trace_find(const cache_tree_t& tree, int k, std::vector<off_t>& trace)
+{
+	cache_node_ptr_t node = tree.get_root();
+	for(size_t h = tree.get_height(); h > 0; h--)
+	{
+		trace.push_back(node.get_offset());
+		if (h == 1) 
+			break;
+		size_t i = node->upper_bound(k);
+		node = node->ptr(i == 0 ? 0 : i - 1);
+	}
+}
+
+// Appends the offsets of every node in key order, as an iteration would
+static void trace_scan(const cache_node_ptr_t& node, size_t height, std::vector<off_t>& trace)
+{
+	trace.push_back(node.get_offset());
+	if (height == 1)
+		return;
+	for(size_t i = 0; i < node->size(); i++)
+		trace_scan(node->ptr(i), height - 1, trace);
+}
+
+// Keys with a hot set, 90% of the lookups go to 1% of the keys
+static int skewed_key(unsigned int& seed)
+{
+	if (rand_r(&seed) % 10 != 0)
+		return (rand_r(&seed) % (k_cache_keys / 100)) * 100;
+	return rand_r(&seed) % k_cache_keys;
+}
+
+template<template<class> class Replacement>
+static double hit_rate(const std::vector<off_t>& trace, size_t capacity)
+{
+	btree_impl::replacement_simulator<Replacement> sim(capacity);
+	for(size_t i = 0; i < trace.size(); i++)
+		sim.access(trace[i]);
+	return sim.hit_rate();
+}
+
+static void compare_policies(const char* name, const std::vector<off_t>& trace, size_t capacity)
+{
+	printf("%-20s clock %5.1f%%  2q %5.1f%%  car %5.1f%%\n", name,
+		100.0 * hit_rate<btree_impl::clock_replacement>(trace, capacity),
+		100.0 * hit_rate<btree_impl::two_queue_replacement>(trace, capacity),
+		100.0 * hit_rate<btree_impl::car_replacement>(trace, capacity));
+}
+
+// The traces are the nodes that finds and scans visit on a real tree,
+// replayed through each replacement policy with a cache of 500 nodes
+TEST(bench, replacement_traces)
+{
+	system("rm -rf /tmp/bench_cache");
+	cache_store_t store("/tmp/bench_cache", true, 1000, 100000);
+	cache_store_t::tree_ptr_t tree = store.attach("root");
+	for(int i = 0; i < k_cache_keys; i++)
+		(*tree)[(i * 7919) % k_cache_keys] = 1;
+	store.mark();
+	store.sync();
+	std::vector<off_t> all;
+	trace_scan(tree->get_root(), tree->get_height(), all);
+	printf("%d nodes\n", (int) all.size());
+
+	unsigned int seed = 1;
+	std::vector<off_t> skewed, scans, loop;
+	for(size_t i = 0; i < 200000; i++)
+		trace_find(*tree, skewed_key(seed), skewed);
+	for(size_t i = 0; i < 200000; i++)
+	{
+		// A full export every 10k lookups
+		if (i % 10000 == 5000)
+			trace_scan(tree->get_root(), tree->get_height(), scans);
+		trace_find(*tree, skewed_key(seed), scans);
+	}
+	for(size_t pass = 0; pass < 20; pass++)
+		for(int k = 0; k < k_cache_keys / 10; k += 10)
+			trace_find(*tree, k, loop);
+	compare_policies("skewed finds", skewed, 500);
+	compare_policies("skewed finds, scans", scans, 500);
+	compare_policies("looping range", loop, 500);
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Latency of single random updates, with a sync every 1000
+static void time_updates(const char* name, bool background)
+{
+	system("rm -rf /tmp/bench_cache");
+	cache_store_t store("/tmp/bench_cache", true, 1000, 10000);
+	if (background)
+		store.start_writer();
+	cache_store_t::tree_ptr_t tree = store.attach("root");
+	std::vector<double> times;
+	srandom(1);
+	for(size_t i = 0; i < 200000; i++)
+	{
+		double start = now_ns();
+		(*tree)[random() % k_cache_keys] = 1;
+		times.push_back(now_ns() - start);
+		if (i % 1000 == 999)
+		{
+			store.mark();
+			store.sync();
+		}
+	}
+	std::sort(times.begin(), times.end());
+	printf("%s: p50 %.0fns  p99 %.0fns  p99.9 %.0fns  max %.0fns\n", name,
+		times[times.size() / 2], times[times.size() * 99 / 100], 
+		times[times.size() * 999 / 1000], times.back());
+}
+
+TEST(bench, background_writer)
+{
+	time_updates("inline writes", false);
+	time_updates("background writer", true);
+}
+
+// Modifies existing keys, syncing every 1000, with or without a compactor
+static void time_modifies(const char* name, bool compactor)
+{
+	system("rm -rf /tmp/bench_cache");
+	cache_store_t store("/tmp/bench_cache", true, 1000, 10000);
+	store.get_file().set_slab_size(4 * 1024 * 1024);
+	cache_store_t::tree_ptr_t tree = store.attach("root");
+	for(int i = 0; i < k_cache_keys; i++)
+		(*tree)[i] = 1;
+	store.mark();
+	store.sync();
+	if (compactor)
+		store.start_compactor(1.5);
+	std::vector<double> times;
+	srandom(1);
+	for(size_t i = 0; i < 200000; i++)
+	{
+		double start = now_ns();
+		(*tree)[random() % k_cache_keys] = 2 + i % 2;
+		times.push_back(now_ns() - start);
+		if (i % 1000 == 999)
+		{
+			store.mark();
+			store.sync();
+		}
+	}
+	std::sort(times.begin(), times.end());
+	printf("%s: p50 %.0fns  p99 %.0fns  p99.9 %.0fns  max %.0fns\n", name,
+		times[times.size() / 2], times[times.size() * 99 / 100], 
+		times[times.size() * 999 / 1000], times.back());
+	printf("    %.1fMb on disk, %.1fMb moved, space amplification %.2f\n", 
+		store.get_file().disk_size() / 1048576.0, 
+		store.stats().compaction_bytes / 1048576.0, store.space_amplification());
+}
+
+TEST(bench, compaction)
+{
+	time_modifies("no compaction", false);
+	time_modifies("background compactor", true);
+}
+
+// Drops the store's files from the OS page cache, so reads go to the disk
+static void drop_page_cache(const std::string& dir)
+{
+	DIR* d = opendir(dir.c_str());
+	while(struct dirent* de = readdir(d))
+	{
+		std::string path = dir + "/" + de->d_name;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) continue;
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	closedir(d);
+}
+
+template<class Store>
+static void time_cold_scan(const char* name, size_t readahead)
+{
+	drop_page_cache("/tmp/bench_cache");
+	Store store("/tmp/bench_cache", false, 1000, 100);
+	store.set_readahead(readahead);
+	typename Store::tree_ptr_t tree = store.attach("root");
+	double start = now();
+	size_t count = 0;
+	for(typename Store::tree_type::const_iterator it = tree->begin(); it != tree->end(); ++it)
+		count++;
+	double scan_time = now() - start;
+	ASSERT_EQ(count, (size_t) 200000);
+
+	srandom(1);
+	start = now();
+	for(size_t i = 0; i < 50; i++)
+	{
+		drop_page_cache("/tmp/bench_cache");
+		int a = random() % 200000;
+		int b = a + random() % (200000 - a);
+		tree->prefetch(a, b);
+		ASSERT_EQ(tree->total(tree->lower_bound(a), tree->lower_bound(b)), b - a);
+	}
+	double total_time = now() - start;
+	printf("%s, readahead %d: cold scan %.0fms, cold total() %.2fms\n", name, (int) readahead,
+		scan_time * 1000, total_time * 1000 / 50);
+}
+
+TEST(bench, readahead)
+{
+	system("rm -rf /tmp/bench_cache");
+	{
+		cache_store_t store("/tmp/bench_cache", true, 1000, 100000);
+		cache_store_t::tree_ptr_t tree = store.attach("root");
+		srandom(1);
+		for(int i = 0; i < 200000; i++)
+			(*tree)[(i * 7919) % 200000] = 1;
+		store.mark();
+		store.sync();
+	}
+	time_cold_scan<cache_store_t>("stdio", 0);
+	time_cold_scan<cache_store_t>("stdio", 16);
+	// Readahead batches read through io_uring
+	time_cold_scan<abtree_store<cache_bench_policy, uring_bstore> >("uring", 16);
+}
+
+struct committer_args
+{
+	cache_store_t* store;
+	cache_tree_t* tree;
+	pthread_mutex_t* mutex;
+	int commits;
+};
+
+// Small transactions, each made durable before the next
+static void* committer(void* p)
+{
+	committer_args* args = (committer_args*) p;
+	for(int i = 0; i < args->commits; i++)
+	{
+		pthread_mutex_lock(args->mutex);
+		for(int j = 0; j < 10; j++)
+			(*args->tree)[random() % k_cache_keys] = i;
+		args->store->mark();
+		pthread_mutex_unlock(args->mutex);
+		args->store->sync();
+	}
+	return NULL;
+}
+
+static void time_commits(const char* name, file_bstore::durability level, int threads)
+{
+	system("rm -rf /tmp/bench_cache");
+	cache_store_t store("/tmp/bench_cache", true, 1000, 10000);
+	store.get_file().set_durability(level);
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, NULL);
+	std::vector<cache_store_t::tree_ptr_t> trees;
+	std::vector<committer_args> args(threads);
+	std::vector<pthread_t> ids(threads);
+	for(int i = 0; i < threads; i++)
+	{
+		char tree_name[8];
+		sprintf(tree_name, "t%d", i);
+		trees.push_back(store.attach(tree_name));
+		args[i].store = &store;
+		args[i].tree = trees[i].get();
+		args[i].mutex = &mutex;
+		args[i].commits = 800 / threads;
+	}
+	double start = now();
+	for(int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, committer, &args[i]);
+	for(int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+	double elapsed = now() - start;
+	pthread_mutex_destroy(&mutex);
+	cache_store_t::stats_type s = store.stats();
+	printf("%-10s %d threads: %6.0f commits/sec, %d syncs written, %d shared\n", name, 
+		threads, 800 / elapsed, (int) s.syncs, (int) s.sync_joins);
+}
+
+TEST(bench, durability)
+{
+	time_commits("none", file_bstore::durability_none, 1);
+	time_commits("flush", file_bstore::durability_flush, 1);
+	time_commits("fdatasync", file_bstore::durability_fdatasync, 1);
+	time_commits("fdatasync", file_bstore::durability_fdatasync, 4);
+}
@@ -0,0 +1,97 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <vector>
+#include "abtree/hilbert_fast.h"
+#include "abtree/spatial.h"
+#include "gtest/gtest.h"
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const size_t k_points = 1000000;
+
+static void time_impl(const char* name, hilbert_impl which, unsigned dims)
+{
+	if (!hilbert_fast_select(which))
+	{
+		printf("%-10s %uD: not supported\n", name, dims);
+		return;
+	}
+	unsigned bits = 64 / dims;
+	std::vector<bitmask_t> coords(k_points * dims);
+	for(size_t i = 0; i < coords.size(); i++)
+		coords[i] = random() & ((bitmask_t(1) << bits) - 1);
+	bitmask_t check = 0;
+	double start = now();
+	for(size_t i = 0; i < k_points; i++)
+		check ^= hilbert_c2i_fast(dims, bits, &coords[i * dims]);
+	double c2i_time = now() - start;
+	bitmask_t out[3];
+	start = now();
+	for(size_t i = 0; i < k_points; i++)
+	{
+		hilbert_i2c_fast(dims, bits, coords[i], out);
+		check ^= out[0];
+	}
+	double i2c_time = now() - start;
+	printf("%-10s %uD: c2i %6.1f ns/op, i2c %6.1f ns/op (%llx)\n", name, dims,
+		c2i_time * 1e9 / k_points, i2c_time * 1e9 / k_points, (unsigned long long) (check & 0xf));
+}
+
+TEST(bench, hilbert_index)
+{
+	for(unsigned dims = 2; dims <= 3; dims++)
+	{
+		time_impl("original", hilbert_impl_original, dims);
+		time_impl("table", hilbert_impl_table, dims);
+		time_impl("bmi2", hilbert_impl_bmi2, dims);
+	}
+	hilbert_fast_select(hilbert_impl_auto);
+}
+
+TEST(bench, hilbert_compare)
+{
+	std::vector<point<2> > pts(k_points);
+	for(size_t i = 0; i < k_points; i++)
+	{
+		pts[i].coords[0] = random() % 200000 - 100000;
+		pts[i].coords[1] = random() % 200000 - 100000;
+	}
+	std::vector<spatial_key<2> > keys(k_points);
+	double start = now();
+	for(size_t i = 0; i < k_points; i++)
+		keys[i] = spatial_key<2>(pts[i]);
+	double key_time = now() - start;
+	int check = 0;
+	start = now();
+	for(size_t i = 1; i < k_points; i++)
+		check += spatial_less()(pts[i - 1], pts[i]);
+	double ieee_time = now() - start;
+	start = now();
+	for(size_t i = 1; i < k_points; i++)
+		check += spatial_key_less()(keys[i - 1], keys[i]);
+	double key_cmp_time = now() - start;
+	printf("spatial_key build %6.1f ns/op, spatial_less %6.1f ns/op, spatial_key_less %6.1f ns/op (%d)\n",
+		key_time * 1e9 / k_points, ieee_time * 1e9 / k_points, key_cmp_time * 1e9 / k_points, check);
+}
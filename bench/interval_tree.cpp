@@ -0,0 +1,96 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <vector>
+#include "abtree/interval_tree.h"
+#include "gtest/gtest.h"
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+struct bench_interval
+{
+	bench_interval() : start(0), end(0), id(0) {}
+	bench_interval(int _start, int _end, int _id) : start(_start), end(_end), id(_id) {}
+	int get_start() const { return start; }
+	int get_end() const { return end; }
+	bool operator<(const bench_interval& rhs) const { return id < rhs.id; }
+	int start;
+	int end;
+	int id;
+};
+
+static const size_t k_intervals = 200000;
+
+static bench_interval random_interval(int id)
+{
+	int start = random() % 10000000;
+	return bench_interval(start, start + random() % 1000, id);
+}
+
+template<class Storage>
+static void time_storage(const char* name)
+{
+	typedef interval_tree<bench_interval, int, default_interval_functor<bench_interval, int>,
+		std::less<bench_interval>, Storage> tree_t;
+	srandom(1);
+	std::vector<bench_interval> live;
+	tree_t tree;
+	double start = now();
+	for(size_t i = 0; i < k_intervals; i++)
+	{
+		live.push_back(random_interval(i));
+		tree.insert(live.back());
+	}
+	double insert_time = now() - start;
+	start = now();
+	for(size_t i = 0; i < k_intervals; i++)
+	{
+		size_t j = random() % live.size();
+		tree.erase(live[j]);
+		live[j] = random_interval(k_intervals + i);
+		tree.insert(live[j]);
+	}
+	double churn_time = now() - start;
+	start = now();
+	size_t found = 0;
+	for(size_t i = 0; i < 100000; i++)
+	{
+		int pos = random() % 10000000;
+		typename tree_t::range_t r = tree.find(pos, pos + 100);
+		for(; r.first != r.second; ++r.first)
+			found += r.first->id & 1;
+	}
+	double query_time = now() - start;
+	printf("%-8s insert %6.0f ns, churn %6.0f ns, query %6.0f ns (%d)\n", name,
+		insert_time * 1e9 / k_intervals, churn_time * 1e9 / k_intervals, 
+		query_time * 1e9 / 100000, (int) found);
+}
+
+TEST(bench, interval_storage)
+{
+	printf("%d intervals, times per operation\n", (int) k_intervals);
+	time_storage<interval_heap_storage<bench_interval, int> >("heap");
+	time_storage<interval_pool_storage<bench_interval, int> >("pool");
+	time_storage<interval_inline_storage<bench_interval, int> >("inline");
+}
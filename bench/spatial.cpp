@@ -0,0 +1,77 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include "abtree/abtree.h"
+#include "abtree/spatial.h"
+#include "abtree/tree_walker.h"
+#include "gtest/gtest.h"
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+TEST(bench, count_within)
+{
+	typedef spatial_summary<2> summary_t;
+	typedef abtree<spatial_key<2>, summary_t, spatial_accumulate, spatial_key_less> bt_t;
+	bt_t tree;
+	for(size_t i = 0; i < 1000000; i++)
+	{
+		point<2> p;
+		p.coords[0] = random() % 200000 - 100000;
+		p.coords[1] = random() % 200000 - 100000;
+		tree.insert(std::make_pair(spatial_key<2>(p), summary_t(p)));
+	}
+	for(int size = 1000; size <= 100000; size *= 10)
+	{
+		std::vector<bounding_region<2> > boxes;
+		for(size_t i = 0; i < 100; i++)
+		{
+			bounding_region<2> box;
+			box.min_point.coords[0] = random() % 100000 - 100000;
+			box.min_point.coords[1] = random() % 100000 - 100000;
+			box.max_point = box.min_point;
+			box.max_point.coords[0] += size;
+			box.max_point.coords[1] += size;
+			boxes.push_back(box);
+		}
+		size_t enum_count = 0;
+		double start = now();
+		for(size_t i = 0; i < boxes.size(); i++)
+		{
+			typedef forward_subset_iterator<bt_t, region_overlaps<2> > subset_t;
+			std::pair<subset_t, subset_t> r = intersecting(tree, boxes[i]);
+			for(; r.first != r.second; ++r.first)
+				enum_count++;
+		}
+		double enum_time = now() - start;
+		size_t agg_count = 0;
+		start = now();
+		for(size_t i = 0; i < boxes.size(); i++)
+			agg_count += count_within(tree, boxes[i]);
+		double agg_time = now() - start;
+		ASSERT_EQ(enum_count, agg_count);
+		printf("box %6d: %8d points, enumerate %8.1f us/query, aggregate %8.1f us/query\n",
+			size, (int) (agg_count / boxes.size()), 
+			enum_time * 1e6 / boxes.size(), agg_time * 1e6 / boxes.size());
+	}
+}
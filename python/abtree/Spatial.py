@@ -1,7 +1,7 @@
 
 import collections
 from itertools import imap
-from abtree_c import Hilbert
+from abtree_c import Hilbert, Spatial2, Spatial3
 from abtree import Table
 
 class Spatial(collections.MutableMapping):
@@ -9,7 +9,11 @@ class Spatial(collections.MutableMapping):
 		self.dim = dim
 		self.store = store
 		self.name = name
-		if (store != None):
+		self.native = None
+		if (store == None and dim in Spatial.native_types):
+			# In memory, use the native index, which walks the tree in C++
+			self.native = Spatial.native_types[dim]()
+		elif (store != None):
 			# Make tables on disk
 			self.forward = store.attach(name + ":forward")
 			self.by_location = store.attach(name + ":by_location", Spatial.agg_region, None, Spatial.cmp_location)
@@ -19,18 +23,30 @@ class Spatial(collections.MutableMapping):
 			self.by_location = Table(Spatial.agg_region, None, Spatial.cmp_location)
 
 	def __contains__(self, key):
+		if self.native != None:
+			return self.native.contains(key)
 		return key in self.forward
 
 	def __len__(self):
+		if self.native != None:
+			return self.native.len()
 		return len(self.forward)
 
+	# Points are returned as tuples, whatever they were set as, the same
+	# from the native index and the tables
 	def __getitem__(self, key):
-		return self.forward[key]
+		if self.native != None:
+			return self.native.getitem(key)
+		return tuple(self.forward[key])
 
 	def __setitem__(self, key, value):
+		if self.native != None:
+			return self.native.setitem(key, value)
 		# Verify dimensionality of point
 		if (len(value) != self.dim):
 			raise ValueError("Tried to insert point of wrong dimensionality")
+		# Kept as lists, which Hilbert.cmp takes
+		value = list(value)
 		# If there is and existing point at this key...
 		if (key in self.forward):
 			# Get it's location, and remove from location table
@@ -41,6 +57,8 @@ class Spatial(collections.MutableMapping):
 		self.by_location[(value, key)] = (value, value)
 
 	def __delitem__(self, key):
+		if self.native != None:
+			return self.native.delitem(key)
 		# Get location of key (or raise KeyError)
 		old_val = self.forward[key] 
 		# Delete from map and location table
@@ -48,12 +66,16 @@ class Spatial(collections.MutableMapping):
 		del self.by_location[(old_val, key)]
 
 	def __iter__(self):
+		if self.native != None:
+			return iter(self.native.keys())
 		return iter(self.forward)
 
 	def within(self, p1, p2):
 		# Verify proper dimensionality
 		if len(p1) != self.dim or len(p2) != self.dim:
 			raise ValueError("Invalid dimensionality in 'within'")
+		if self.native != None:
+			return iter(self.native.within(p1, p2))
 		# Compute canonical form of bounding box
 		min_bounds = map(min, p1, p2)
 		max_bounds = map(max, p1, p2)
@@ -64,6 +86,21 @@ class Spatial(collections.MutableMapping):
 		# Covert the keys of by_location (loc, key) to straight keys
 		return imap(lambda k: k[1], it)
 
+	# Counts the points inside of the box with corners p1 and p2
+	def count_within(self, p1, p2):
+		if self.native != None:
+			return self.native.count_within(p1, p2)
+		return sum(1 for k in self.within(p1, p2))
+
+	# Returns the keys of the k points closest to p, nearest first
+	def nearest(self, p, k):
+		if len(p) != self.dim:
+			raise ValueError("Invalid dimensionality in 'nearest'")
+		if self.native != None:
+			return self.native.nearest(p, k)
+		dist = lambda key: sum((a - b) ** 2 for a, b in zip(self[key], p))
+		return sorted(self, key = dist)[:k]
+
 	# Computes the bounding box that holds both inputs bounding boxs
 	@staticmethod
 	def agg_region(box1, box2):
@@ -81,6 +118,8 @@ class Spatial(collections.MutableMapping):
 				return False # They don't intersect
 		return True  # Otherwise, the do intersect
 
+	native_types = { 2 : Spatial2, 3 : Spatial3 }
+
 	# Compares by location and then key
 	@staticmethod
 	def cmp_location(k1, k2):
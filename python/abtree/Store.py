@@ -14,17 +14,27 @@ class Store:
 		deserialize_func = json.loads,
 		max_write_cache = 10000, 
 		max_read_cache = 20000,
-		sync_delay = 1):
+		sync_delay = 1,
+		max_write_bytes = None,
+		max_read_bytes = None,
+		compact_target = 2.0,
+		compact_batch = 1024*1024,
+		durability = 'flush'):
+		# Made first, since the setters below take it
+		self.lock = threading.RLock()
 		self.policy = {
 			'serialize' : serialize_func,
 			'deserialize' : deserialize_func
 		}
 		self.store = abtree_c.Store(name, create, max_write_cache, max_read_cache, self.policy)
+		self.set_cache_limits(max_write_bytes = max_write_bytes, max_read_bytes = max_read_bytes)
+		self.set_durability(durability)
 		self.tables = {}
 		self.sync_delay = sync_delay
+		self.compact_target = compact_target
+		self.compact_batch = compact_batch
 		self.last_sync = time.time()
 		self.waiting_sync = None
-		self.lock = threading.RLock()
 
 	def new_table(self, aggregate_func = lambda a,b: None, empty_total = None, cmp_func = cmp):
 		new_policy = {
@@ -52,8 +62,49 @@ class Store:
 		self.tables[name] = t
 		return t
 
+	# How far each sync goes to make data durable: 'none' leaves it to
+	# stdio buffers, 'flush' hands it to the OS, so it survives the
+	# process dying, and 'fdatasync' waits for the disk, so it survives
+	# power loss as well.
+	def set_durability(self, durability):
+		levels = { 'none' : 0, 'flush' : 1, 'fdatasync' : 2 }
+		if durability not in levels:
+			raise ValueError('Unknown durability: %s' % durability)
+		with self.lock:
+			self.store.set_durability(levels[durability])
+
+	# Changes the cache limits, those left as None stay as they are.  The
+	# caches are limited both in nodes and in serialized bytes.
+	def set_cache_limits(self, 
+		max_write_cache = None, 
+		max_read_cache = None, 
+		max_write_bytes = None, 
+		max_read_bytes = None):
+		with self.lock:
+			if max_write_cache != None:
+				self.store.set_max_unwritten(max_write_cache)
+			if max_read_cache != None:
+				self.store.set_max_lru(max_read_cache)
+			if max_write_bytes != None:
+				self.store.set_max_unwritten_bytes(max_write_bytes)
+			if max_read_bytes != None:
+				self.store.set_max_lru_bytes(max_read_bytes)
+
+	# Returns cache, write buffer, store and compaction counters as a dict
+	# of dicts.  Latencies are dicts with the count, mean and percentiles in
+	# microseconds, and counts of samples under each power of two ns.
+	def stats(self):
+		with self.lock:
+			return self.store.stats()
+
+	# Old data is compacted a batch at a time before each timed sync, 
+	# whenever the store is more than compact_target times the size of
+	# the live data.  The C++ compactor thread can't be used, since nodes
+	# are serialized by python.
 	def _timer_run(self):
 		with self.lock:
+			if self.store.space_amplification() > self.compact_target:
+				self.store.compact(self.compact_batch)
 			self.sync()
 			self.last_sync = time.time()
 			self.waiting_sync = None
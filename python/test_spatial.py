@@ -0,0 +1,30 @@
+
+# Checks the in memory, native and on disk spatial indexes agree, run from
+# the top directory:
+#   python setup.py build && PYTHONPATH=$(echo build/lib.*) python python/test_spatial.py
+
+import shutil
+import unittest
+import abtree
+from abtree.Spatial import Spatial
+
+class SpatialTest(unittest.TestCase):
+	path = '/tmp/abtree_test_spatial'
+
+	def check(self, s, dim):
+		a = tuple(float(i) for i in range(dim))
+		b = [float(i + 10) for i in range(dim)]
+		s['a'] = a
+		s['b'] = b
+		self.assertEqual(s['a'], a)
+		self.assertEqual(s['b'], tuple(b))
+		self.assertEqual(sorted(s.within([-1] * dim, [5] * dim)), ['a'])
+
+	def test_paths(self):
+		self.check(Spatial(2), 2)  # Native
+		self.check(Spatial(4), 4)  # Python, in memory
+		shutil.rmtree(self.path, True)
+		self.check(Spatial(2, abtree.Store(self.path, True), 'points'), 2)
+
+if __name__ == '__main__':
+	unittest.main()
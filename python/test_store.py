@@ -0,0 +1,40 @@
+
+# Smoke test for the disk store, run from the top directory:
+#   python setup.py build && PYTHONPATH=$(echo build/lib.*) python python/test_store.py
+
+import shutil
+import unittest
+import abtree
+
+class StoreTest(unittest.TestCase):
+	path = '/tmp/abtree_test_store'
+
+	def setUp(self):
+		shutil.rmtree(self.path, True)
+
+	def test_open(self):
+		store = abtree.Store(self.path, True, max_write_bytes = 1 << 20, max_read_bytes = 1 << 20)
+		tree = store.attach('test')
+		tree['hello'] = 3
+		tree['world'] = 5
+		store.mark()
+		store.sync()
+		self.assertEqual(tree['hello'], 3)
+		self.assertEqual(len(store.stats()), 4)
+		store = None
+		tree = None
+		store = abtree.Store(self.path, False)
+		self.assertEqual(store.attach('test')['world'], 5)
+
+	def test_durability(self):
+		store = abtree.Store(self.path, True, durability = 'fdatasync')
+		tree = store.attach('test')
+		tree['hello'] = 3
+		store.mark()
+		store.sync()
+		store.set_durability('none')
+		self.assertRaises(ValueError, store.set_durability, 'always')
+		self.assertRaises(ValueError, abtree.Store, self.path, False, durability = 'always')
+
+if __name__ == '__main__':
+	unittest.main()
@@ -10,6 +10,7 @@ using namespace boost::python;
 #include "abtree/disk_abtree.h"
 #include "abtree/tree_walker.h"
 #include "abtree/hilbert.h"
+#include "abtree/spatial_index.h"
 
 struct obj_count
 {
@@ -179,8 +180,75 @@ public:
 	void mark() { m_store.mark(); }
 	void revert() { m_store.revert(); }
 	void sync() { m_store.sync(); }
+	void set_max_unwritten(size_t max_unwritten) { m_store.set_max_unwritten(max_unwritten); }
+	void set_max_lru(size_t max_lru) { m_store.set_max_lru(max_lru); }
+	void set_max_unwritten_bytes(size_t max_bytes) { m_store.set_max_unwritten_bytes(max_bytes); }
+	void set_max_lru_bytes(size_t max_bytes) { m_store.set_max_lru_bytes(max_bytes); }
+	size_t compact(size_t max_bytes) { return m_store.compact(max_bytes); }
+	double space_amplification() { return m_store.space_amplification(); }
+	void set_durability(int level) { m_store.get_file().set_durability((file_bstore::durability) level); }
+
+	dict stats()
+	{
+		store_t::stats_type s = m_store.stats();
+		dict cache;
+		cache["hits"] = s.hits;
+		cache["misses"] = s.misses;
+		cache["load_waits"] = s.load_waits;
+		cache["leaf_evictions"] = s.leaf_evictions;
+		cache["inner_evictions"] = s.inner_evictions;
+		cache["prefetches"] = s.prefetches;
+		cache["nodes"] = s.cached_nodes;
+		cache["inner_nodes"] = s.cached_inner;
+		cache["bytes"] = s.cached_bytes;
+		cache["load"] = latency_dict(s.load);
+		dict writes;
+		writes["unwritten_nodes"] = s.unwritten_nodes;
+		writes["unwritten_bytes"] = s.unwritten_bytes;
+		writes["unwritten_peak"] = s.unwritten_peak;
+		writes["nodes_written"] = s.nodes_written;
+		writes["bytes_written"] = s.bytes_written;
+		writes["write_front"] = latency_dict(s.write_front);
+		writes["syncs"] = s.syncs;
+		writes["sync_joins"] = s.sync_joins;
+		writes["sync_bytes"] = s.sync_bytes;
+		writes["sync"] = latency_dict(s.sync);
+		dict store;
+		store["reads"] = s.store_reads;
+		store["read_bytes"] = s.store_read_bytes;
+		store["read"] = latency_dict(s.store_read);
+		store["writes"] = s.store_writes;
+		store["write_bytes"] = s.store_write_bytes;
+		store["write"] = latency_dict(s.store_write);
+		dict compaction;
+		compaction["runs"] = s.compactions;
+		compaction["moves"] = s.compaction_moves;
+		compaction["bytes"] = s.compaction_bytes;
+		compaction["errors"] = s.compaction_errors;
+		compaction["time"] = latency_dict(s.compaction);
+		dict r;
+		r["cache"] = cache;
+		r["writes"] = writes;
+		r["store"] = store;
+		r["compaction"] = compaction;
+		return r;
+	}
 
 private:
+	static dict latency_dict(const btree_impl::latency_stats& l)
+	{
+		dict r;
+		r["count"] = l.count;
+		r["mean_us"] = l.mean_us();
+		r["p50_us"] = l.percentile_us(0.5);
+		r["p99_us"] = l.percentile_us(0.99);
+		boost::python::list buckets;
+		for(size_t i = 0; i < l.buckets.size(); i++)
+			buckets.append(l.buckets[i]);
+		r["log2_ns_buckets"] = buckets;
+		return r;
+	}
+
 	store_t m_store;
 };
 
@@ -409,6 +477,140 @@ public:
 	}
 };
 
+class py_object_less
+{
+public:
+	bool operator()(const object& a, const object& b) const
+	{
+		int r = PyObject_RichCompareBool(a.ptr(), b.ptr(), Py_LT);
+		if (r < 0)
+			throw boost::python::error_already_set();
+		return r;
+	}
+};
+
+// Native spatial index with python objects as ids, all of the tree walking
+// happens in C++ so no python code runs per node.
+template<size_t dims>
+class py_spatial
+{
+	typedef spatial_index<dims, object, py_object_less> index_t;
+	typedef typename index_t::point_type point_t;
+	typedef typename index_t::region_type region_t;
+public:
+	void setitem(const object& key, const object& value)
+	{
+		m_index.set(key, to_point(value));
+	}
+
+	object getitem(const object& key)
+	{
+		const point_t* p = m_index.get(key);
+		if (p == NULL)
+		{
+			PyErr_SetString(PyExc_KeyError, "no such key");
+			throw boost::python::error_already_set();
+		}
+		// A tuple, as the python Spatial returns
+		boost::python::list r;
+		for(size_t i = 0; i < dims; i++)
+			r.append(p->coords[i]);
+		return boost::python::tuple(r);
+	}
+
+	void delitem(const object& key)
+	{
+		if (!m_index.erase(key))
+		{
+			PyErr_SetString(PyExc_KeyError, "no such key");
+			throw boost::python::error_already_set();
+		}
+	}
+
+	bool contains(const object& key) { return m_index.get(key) != NULL; }
+	size_t len() { return m_index.size(); }
+
+	boost::python::list keys()
+	{
+		boost::python::list r;
+		for(typename index_t::const_iterator it = m_index.begin(); it != m_index.end(); ++it)
+			r.append(it->first);
+		return r;
+	}
+
+	boost::python::list within(const object& p1, const object& p2)
+	{
+		std::vector<object> ids;
+		m_index.within(to_region(p1, p2), std::back_inserter(ids));
+		return to_list(ids);
+	}
+
+	size_t count_within(const object& p1, const object& p2)
+	{
+		return m_index.count_within(to_region(p1, p2));
+	}
+
+	boost::python::list nearest(const object& p, size_t k)
+	{
+		std::vector<object> ids;
+		m_index.nearest(to_point(p), k, std::back_inserter(ids));
+		return to_list(ids);
+	}
+
+private:
+	static point_t to_point(const object& o)
+	{
+		if (boost::python::len(o) != (ssize_t) dims)
+		{
+			PyErr_SetString(PyExc_ValueError, "Point of wrong dimensionality");
+			throw boost::python::error_already_set();
+		}
+		point_t p;
+		for(size_t i = 0; i < dims; i++)
+			p.coords[i] = extract<double>(o[i]);
+		return p;
+	}
+
+	static region_t to_region(const object& p1, const object& p2)
+	{
+		point_t a = to_point(p1);
+		point_t b = to_point(p2);
+		region_t r;
+		for(size_t i = 0; i < dims; i++)
+		{
+			r.min_point.coords[i] = std::min(a.coords[i], b.coords[i]);
+			r.max_point.coords[i] = std::max(a.coords[i], b.coords[i]);
+		}
+		return r;
+	}
+
+	static boost::python::list to_list(const std::vector<object>& ids)
+	{
+		boost::python::list r;
+		for(size_t i = 0; i < ids.size(); i++)
+			r.append(ids[i]);
+		return r;
+	}
+
+	index_t m_index;
+};
+
+template<size_t dims>
+void def_spatial(const char* name)
+{
+	class_<py_spatial<dims>, boost::shared_ptr<py_spatial<dims> >, boost::noncopyable >(name)
+		.def("getitem", &py_spatial<dims>::getitem)
+		.def("setitem", &py_spatial<dims>::setitem)
+		.def("delitem", &py_spatial<dims>::delitem)
+		.def("contains", &py_spatial<dims>::contains)
+		.def("len", &py_spatial<dims>::len)
+		.def("keys", &py_spatial<dims>::keys)
+		.def("within", &py_spatial<dims>::within)
+		.def("count_within", &py_spatial<dims>::count_within)
+		.def("nearest", &py_spatial<dims>::nearest)
+		;
+}
+
 BOOST_PYTHON_MODULE(abtree_c)
 {
         PyEval_InitThreads();
@@ -435,6 +637,14 @@ BOOST_PYTHON_MODULE(abtree_c)
 		.def("mark", &py_store::mark)
 		.def("revert", &py_store::revert)
 		.def("sync", &py_store::sync)
+		.def("set_max_unwritten", &py_store::set_max_unwritten)
+		.def("set_max_lru", &py_store::set_max_lru)
+		.def("set_max_unwritten_bytes", &py_store::set_max_unwritten_bytes)
+		.def("set_max_lru_bytes", &py_store::set_max_lru_bytes)
+		.def("stats", &py_store::stats)
+		.def("compact", &py_store::compact)
+		.def("space_amplification", &py_store::space_amplification)
+		.def("set_durability", &py_store::set_durability)
 		;
 	class_<py_disk_tree, boost::shared_ptr<py_disk_tree>, boost::noncopyable >("DiskTree", 
 		init<const boost::shared_ptr<py_store>&, const object&>())
@@ -465,4 +675,6 @@ BOOST_PYTHON_MODULE(abtree_c)
 		.def("cmp", &hilbert_wrap::hilbert_cmp)
 		.staticmethod("cmp")
 		;
+	def_spatial<2>("Spatial2");
+	def_spatial<3>("Spatial3");
 }
@@ -7,8 +7,11 @@ btree_ext = Extension('abtree_c',
 	        'abtree/serial.cpp',
                 'abtree/file_bstore.cpp',
                 'abtree/file_io.cpp',
+                'abtree/slab_file.cpp',
+                'abtree/uring.cpp',
                 'abtree/io.cpp',
                 'abtree/hilbert.c', 
+                'abtree/hilbert_fast.c', 
 		'tiny_boost/libs/python/src/converter/arg_to_python_base.cpp',
 		'tiny_boost/libs/python/src/converter/builtin_converters.cpp',
 		'tiny_boost/libs/python/src/converter/from_python.cpp',
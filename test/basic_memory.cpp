@@ -45,3 +45,34 @@ TEST(memory_btree, basic)
 	ASSERT_EQ(tree2.total(tree2.begin(), tree2.end()), computed_total);
 }
 
+
+TEST(memory_btree, bulk_load)
+{
+	typedef abtree<int, int> bt_t;
+	for(size_t n = 0; n < 300; n += 7)
+	{
+		std::vector<std::pair<int, int> > entries;
+		for(size_t i = 0; i < n; i++)
+			entries.push_back(std::make_pair(int(i * 3), int(i)));
+		bt_t tree;
+		tree[5] = 1000;  // Replaced by the load
+		tree.bulk_load(entries.begin(), entries.end());
+		ASSERT_EQ(n, tree.size());
+		ASSERT_EQ(int(n * (n - 1) / 2), tree.total(tree.begin(), tree.end()));
+		bt_t::const_iterator it = tree.begin();
+		for(size_t i = 0; i < n; i++, ++it)
+		{
+			ASSERT_EQ(int(i * 3), it->first);
+			ASSERT_EQ(int(i), it->second);
+		}
+		ASSERT_TRUE(it == tree.end());
+		// Still a normal tree afterwards
+		for(size_t i = 0; i < n; i++)
+			tree[int(i * 3 + 1)] = 1;
+		for(size_t i = 0; i < n; i += 2)
+			tree.erase(int(i * 3));
+		ASSERT_EQ(n + n / 2, tree.size());
+		for(size_t i = 0; i < n; i++)
+			ASSERT_EQ(i % 2 == 1, tree.find(int(i * 3)) != tree.end());
+	}
+}
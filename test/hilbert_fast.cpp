@@ -0,0 +1,67 @@
+/*
+    Aggregate btree implementation
+    Copyright (C) 2012 Jeremy Bruestle
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include "abtree/hilbert_fast.h"
+#include "gtest/gtest.h"
+
+static bitmask_t random_bits(unsigned bits)
+{
+	bitmask_t r = (bitmask_t(random()) << 42) ^ (bitmask_t(random()) << 21) ^ bitmask_t(random());
+	if (bits < 64)
+		r &= (bitmask_t(1) << bits) - 1;
+	return r;
+}
+
+static void check_impl(hilbert_impl which)
+{
+	ASSERT_TRUE(hilbert_fast_select(which));
+	for(unsigned dims = 1; dims <= 6; dims++)
+	{
+		for(unsigned bits = 1; dims * bits <= 64; bits++)
+		{
+			for(size_t i = 0; i < 200; i++)
+			{
+				bitmask_t coord[6];
+				bitmask_t out1[6];
+				bitmask_t out2[6];
+				for(unsigned d = 0; d < dims; d++)
+					coord[d] = random_bits(bits);
+				bitmask_t index = hilbert_c2i(dims, bits, coord);
+				ASSERT_EQ(index, hilbert_c2i_fast(dims, bits, coord));
+				bitmask_t rindex = random_bits(dims * bits);
+				hilbert_i2c(dims, bits, rindex, out1);
+				hilbert_i2c_fast(dims, bits, rindex, out2);
+				for(unsigned d = 0; d < dims; d++)
+					ASSERT_EQ(out1[d], out2[d]);
+				hilbert_i2c_fast(dims, bits, index, out2);
+				for(unsigned d = 0; d < dims; d++)
+					ASSERT_EQ(coord[d], out2[d]);
+			}
+		}
+	}
+}
+
+TEST(hilbert, fast_equivalence)
+{
+	check_impl(hilbert_impl_table);
+	if (hilbert_fast_select(hilbert_impl_bmi2))
+		check_impl(hilbert_impl_bmi2);
+	else
+		printf("BMI2 not supported, skipping\n");
+	ASSERT_TRUE(hilbert_fast_select(hilbert_impl_auto));
+}
@@ -1,6 +1,7 @@
 
 #include "gtest/gtest.h"
 #include "abtree/interval_tree.h"
+#include "abtree/disk_interval_tree.h"
 #include <set>
 #include <boost/foreach.hpp>
 #include <boost/iterator/iterator_facade.hpp>
@@ -9,6 +10,7 @@
 class test_element
 {
 public:
+	test_element() : m_start(0), m_end(0) {}
 	test_element(int start, int end, const std::string& name)
 		: m_start(start)
 		, m_end(end)
@@ -37,6 +39,23 @@ private:
 	std::string m_name;
 };
 
+void serialize(writable& out, const test_element& te)
+{
+	serialize(out, te.get_start());
+	serialize(out, te.get_end());
+	serialize(out, te.get_name());
+}
+
+void deserialize(readable& in, test_element& te)
+{
+	int start, end;
+	std::string name;
+	deserialize(in, start);
+	deserialize(in, end);
+	deserialize(in, name);
+	te = test_element(start, end, name);
+}
+
 template<class value_t, class position_t, class IntervalGet = default_interval_functor<value_t, position_t> >
 class fake_interval_tree
 {
@@ -124,10 +143,15 @@ public:
 		return std::make_pair(overlap_iterator(this, start, end, false), overlap_iterator(this, start, end, true));
 	}
 	size_t size() const { return m_set.size(); }
+	size_t count_overlaps(const position_t& start, const position_t& end) const
+	{
+		range_t r = find(start, end);
+		return std::distance(r.first, r.second);
+	}
 	
 private:
 	position_t get_start(const value_t& v) const { return m_interval_functor(v).first; }
-        position_t get_end(const value_t& v) const { return m_interval_functor(v).first; }
+        position_t get_end(const value_t& v) const { return m_interval_functor(v).second; }
 
 	element_t to_element(const value_t& val) const { return std::make_pair(get_start(val), val); }
 	set_t m_set;
@@ -167,10 +191,9 @@ public:
 	it2_t m_it2;
 };
 
-template<class value_t, class position_t>
+template<class value_t, class position_t, class iv_t = interval_tree<value_t, position_t> >
 class check_interval_tree
 {
-	typedef interval_tree<value_t, position_t> iv_t;
 	typedef fake_interval_tree<value_t, position_t> fiv_t;
 public:
 	typedef cmp_iter<typename iv_t::const_iterator, typename fiv_t::const_iterator> const_iterator; 
@@ -178,6 +201,8 @@ public:
 	typedef std::pair<overlap_iterator, overlap_iterator> range_t;
 
 	check_interval_tree() {}
+	template<class Arg1, class Arg2>
+	check_interval_tree(Arg1& arg1, const Arg2& arg2) : m_iv(arg1, arg2) {}
 	void insert(const value_t& val) { m_iv.insert(val); m_fiv.insert(val); }
 	void erase(const value_t& val) { m_iv.erase(val); m_fiv.erase(val); }
 	void erase(const const_iterator& it) { m_iv.erase(it.m_it1); m_fiv.erase(it.m_it2); }
@@ -198,6 +223,13 @@ public:
 		assert(s1 == s2);
 		return s1;
 	}
+	size_t count_overlaps(const position_t& start, const position_t& end) const
+	{
+		size_t c1 = m_iv.count_overlaps(start, end);
+		size_t c2 = m_fiv.count_overlaps(start, end);
+		assert(c1 == c2);
+		return c1;
+	}
 	
 private:
 	iv_t m_iv;
@@ -213,14 +245,13 @@ void generate_random_region(int& start, int& end)
 	end = start + len;
 }
 
-TEST(interval_tree, basic)
+template<class tree_t>
+void random_interval_ops(tree_t& tree, size_t count)
 {
-	typedef check_interval_tree<test_element, int> tree_t;
-	tree_t tree;
 	int start, end;
 	int rr = 0;
 	int xx = 0;
-	for(size_t i = 0; i < 10000; i++)
+	for(size_t i = 0; i < count; i++)
 	{
 		switch(random() % 4)
 		{
@@ -238,11 +269,11 @@ TEST(interval_tree, basic)
 				// Test iterator, basic find, and erase
 				if (tree.size() == 0) continue;
 				size_t off = random() % tree.size();
-				tree_t::const_iterator it = tree.begin();
+				typename tree_t::const_iterator it = tree.begin();
 				for(size_t j = 0; j < off; j++) 
 					it++;
 				const test_element& te = *it;
-				tree_t::const_iterator it2 = tree.find(te);
+				typename tree_t::const_iterator it2 = tree.find(te);
 				assert(it == it2);
 				tree.erase(it2);
 			}
@@ -251,18 +282,182 @@ TEST(interval_tree, basic)
 			{
 				// Test range search
 				generate_random_region(start, end);
-				tree_t::range_t r = tree.find(start, end);	
+				typename tree_t::range_t r = tree.find(start, end);	
+				size_t found = 0;
 				foreach(const test_element& te, r)
 				{
 					rr++;
+					found++;
 					xx += te.get_start();
 				}
+				ASSERT_EQ(found, tree.count_overlaps(start, end));
 			}
 			break;
 		}
 	}
 	printf("Total size results = %d\n", (int) tree.size());
 	printf("Total range results = %d, meaningless number = %d\n", rr, xx);
-}	
-	
-				
+}
+
+TEST(interval_tree, basic)
+{
+	typedef check_interval_tree<test_element, int> tree_t;
+	tree_t tree;
+	random_interval_ops(tree, 10000);
+}
+
+TEST(interval_tree, disk)
+{
+	typedef disk_interval_tree<test_element, int> div_t;
+	typedef check_interval_tree<test_element, int, div_t> tree_t;
+	typedef div_t::store_type store_t;
+	system("rm -rf /tmp/interval_tree");
+	store_t store("/tmp/interval_tree", true, 100, 200);
+	tree_t tree(store, std::string("intervals"));
+	random_interval_ops(tree, 10000);
+	store.mark();
+	store.sync();
+	// Reopen, and compare against what was written
+	std::vector<test_element> before(tree.begin(), tree.end());
+	store_t store2("/tmp/interval_tree", false, 100, 200);
+	div_t reopened(store2, "intervals");
+	std::vector<test_element> after(reopened.begin(), reopened.end());
+	ASSERT_TRUE(before == after);
+	int start, end;
+	for(size_t i = 0; i < 100; i++)
+	{
+		generate_random_region(start, end);
+		div_t::range_t r1 = reopened.find(start, end);
+		tree_t::range_t r2 = tree.find(start, end);
+		ASSERT_EQ(std::distance(r2.first, r2.second), std::distance(r1.first, r1.second));
+		ASSERT_EQ(tree.count_overlaps(start, end), reopened.count_overlaps(start, end));
+	}
+}
+
+bool overlaps(const test_element& te, int start, int end)
+{
+	return te.get_start() < end && start < te.get_end();
+}
+
+TEST(interval_tree, batch)
+{
+	typedef interval_tree<test_element, int> iv_t;
+	typedef std::pair<size_t, test_element> match_t;
+	iv_t tree;
+	std::vector<test_element> all;
+	int start, end;
+	for(size_t i = 0; i < 5000; i++)
+	{
+		generate_random_region(start, end);
+		all.push_back(test_element(start, end, printstring("object%d", i)));
+		tree.insert(all.back());
+	}
+	std::vector<iv_t::query_type> queries;
+	std::vector<int> points;
+	for(size_t i = 0; i < 200; i++)
+	{
+		generate_random_region(start, end);
+		queries.push_back(std::make_pair(start, end));
+		points.push_back(start);
+	}
+	std::sort(queries.begin(), queries.end());
+	std::sort(points.begin(), points.end());
+
+	std::vector<match_t> found;
+	tree.find_batch(queries, std::back_inserter(found));
+	std::set<match_t> batch(found.begin(), found.end());
+	ASSERT_EQ(found.size(), batch.size());
+	std::set<match_t> single;
+	for(size_t i = 0; i < queries.size(); i++)
+		foreach(const test_element& te, tree.find(queries[i].first, queries[i].second))
+			single.insert(std::make_pair(i, te));
+	ASSERT_TRUE(single == batch);
+
+	found.clear();
+	tree.stab_batch(points, std::back_inserter(found));
+	std::set<match_t> stab(found.begin(), found.end());
+	std::set<match_t> simple;
+	for(size_t i = 0; i < points.size(); i++)
+		for(size_t j = 0; j < all.size(); j++)
+			if (all[j].get_start() <= points[i] && points[i] < all[j].get_end())
+				simple.insert(std::make_pair(i, all[j]));
+	ASSERT_TRUE(simple == stab);
+}
+
+TEST(interval_tree, join)
+{
+	typedef interval_tree<test_element, int> iv_t;
+	typedef disk_interval_tree<test_element, int> div_t;
+	typedef std::pair<test_element, test_element> pair_t;
+	system("rm -rf /tmp/interval_join");
+	div_t::store_type store("/tmp/interval_join", true, 100, 200);
+	iv_t left;
+	div_t right(store, "right");
+	std::vector<test_element> lv, rv;
+	int start, end;
+	for(size_t i = 0; i < 3000; i++)
+	{
+		generate_random_region(start, end);
+		lv.push_back(test_element(start, end, printstring("left%d", i)));
+		left.insert(lv.back());
+	}
+	for(size_t i = 0; i < 500; i++)
+	{
+		generate_random_region(start, end);
+		rv.push_back(test_element(start, end, printstring("right%d", i)));
+		right.insert(rv.back());
+	}
+	std::vector<pair_t> found;
+	left.overlap_join(right, std::back_inserter(found));
+	std::set<pair_t> joined(found.begin(), found.end());
+	ASSERT_EQ(found.size(), joined.size());
+	std::set<pair_t> simple;
+	for(size_t i = 0; i < lv.size(); i++)
+		for(size_t j = 0; j < rv.size(); j++)
+			if (overlaps(lv[i], rv[j].get_start(), rv[j].get_end()))
+				simple.insert(std::make_pair(lv[i], rv[j]));
+	ASSERT_TRUE(simple == joined);
+	// And the other way around
+	std::vector<pair_t> reversed;
+	right.overlap_join(left, std::back_inserter(reversed));
+	ASSERT_EQ(found.size(), reversed.size());
+}
+
+TEST(interval_tree, storage)
+{
+	typedef interval_tree<test_element, int, default_interval_functor<test_element, int>, 
+		std::less<test_element>, interval_heap_storage<test_element, int> > heap_t;
+	typedef interval_tree<test_element, int, default_interval_functor<test_element, int>, 
+		std::less<test_element>, interval_inline_storage<test_element, int> > inline_t;
+	check_interval_tree<test_element, int, heap_t> heap_tree;
+	random_interval_ops(heap_tree, 5000);
+	check_interval_tree<test_element, int, inline_t> inline_tree;
+	random_interval_ops(inline_tree, 5000);
+}
+
+// Orders by name, with a direction chosen at run time
+class name_cmp
+{
+public:
+	name_cmp(bool reverse = false) : m_reverse(reverse) {}
+	bool operator()(const test_element& a, const test_element& b) const 
+	{ 
+		return m_reverse ? b.get_name() < a.get_name() : a.get_name() < b.get_name(); 
+	}
+private:
+	bool m_reverse;
+};
+
+TEST(interval_tree, disk_value_cmp)
+{
+	typedef disk_interval_tree<test_element, int, default_interval_functor<test_element, int>, name_cmp> div_t;
+	system("rm -rf /tmp/interval_cmp");
+	div_t::store_type store("/tmp/interval_cmp", true, 100, 200);
+	div_t tree(store, "intervals", default_interval_functor<test_element, int>(), name_cmp(true));
+	for(size_t i = 0; i < 100; i++)
+		tree.insert(test_element(5, 10, printstring("%03d", (int) i)));
+	std::vector<test_element> all(tree.begin(), tree.end());
+	ASSERT_EQ(all.size(), 100);
+	for(size_t i = 0; i < all.size(); i++)
+		ASSERT_EQ(all[i].get_name(), printstring("%03d", (int) (99 - i)));
+}
@@ -0,0 +1,155 @@
+
+#include "gtest/gtest.h"
+#include "abtree/disk_abtree.h"
+#include "abtree/replacement.h"
+
+using namespace btree_impl;
+
+// Hits on a hot set of 'hot' offsets after a scan of 'scan' offsets that
+// are each used once, with a cache of 'capacity' nodes
+template<template<class> class Replacement>
+size_t hits_after_scan(size_t hot, size_t scan, size_t capacity)
+{
+	replacement_simulator<Replacement> sim(capacity);
+	for(size_t round = 0; round < 10; round++)
+		for(size_t i = 0; i < hot; i++)
+			sim.access(i);
+	for(size_t i = 0; i < scan; i++)
+		sim.access(hot + i);
+	size_t before = sim.hits();
+	for(size_t i = 0; i < hot; i++)
+		sim.access(i);
+	return sim.hits() - before;
+}
+
+TEST(replacement, scan_resistance)
+{
+	size_t clock_hits = hits_after_scan<clock_replacement>(50, 1000, 100);
+	size_t two_queue_hits = hits_after_scan<two_queue_replacement>(50, 1000, 100);
+	size_t car_hits = hits_after_scan<car_replacement>(50, 1000, 100);
+	ASSERT_EQ(clock_hits, (size_t) 0);
+	ASSERT_EQ(two_queue_hits, (size_t) 50);
+	ASSERT_EQ(car_hits, (size_t) 50);
+}
+
+TEST(replacement, capacity)
+{
+	// Nothing fits once it's full, everything does when it's big enough
+	replacement_simulator<car_replacement> small(10);
+	replacement_simulator<car_replacement> big(100);
+	for(size_t round = 0; round < 3; round++)
+	{
+		for(size_t i = 0; i < 50; i++)
+		{
+			small.access(i);
+			big.access(i);
+		}
+	}
+	ASSERT_EQ(big.hits(), (size_t) 100);
+	ASSERT_EQ(small.hits(), (size_t) 0);
+}
+
+struct replacement_test_policy
+{
+	typedef int key_type;
+	typedef int mapped_type;
+	static const size_t node_size = 20;
+	bool less(const int& a, const int& b) const { return a < b; }
+	void aggregate(int& out, const int& in) const { out += in; }
+	void serialize(writable& out, const int& k, const int& v) const { ::serialize(out, k); ::serialize(out, v);}
+	void deserialize(readable& in, int& k, int& v) const { ::deserialize(in, k); ::deserialize(in, v); }
+};
+
+template<template<class> class Replacement>
+void check_store(size_t max_inner = std::numeric_limits<size_t>::max())
+{
+	typedef abtree_store<replacement_test_policy, file_bstore, Replacement> store_t;
+	typedef typename store_t::tree_ptr_t tree_ptr_t;
+	typedef typename store_t::tree_type tree_t;
+	system("rm -rf /tmp/replacement_tree");
+	{
+		store_t store("/tmp/replacement_tree", true, 100, 10);
+		tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 5000; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+	}
+	store_t store("/tmp/replacement_tree", false, 100, 10);
+	store.set_max_inner(max_inner);
+	tree_ptr_t tree = store.attach("root");
+	for(int pass = 0; pass < 2; pass++)
+	{
+		// Point lookups mixed with full scans
+		for(int i = 0; i < 5000; i += 7)
+		{
+			typename tree_t::const_iterator it = tree->find(i);
+			ASSERT_TRUE(it != tree->end());
+			ASSERT_EQ(it->second, i);
+		}
+		int count = 0;
+		typename tree_t::const_iterator it, itEnd = tree->end();
+		for(it = tree->begin(); it != itEnd; ++it)
+			ASSERT_EQ(it->second, count++);
+		ASSERT_EQ(count, 5000);
+	}
+}
+
+TEST(replacement, store)
+{
+	check_store<clock_replacement>();
+	check_store<two_queue_replacement>();
+	check_store<car_replacement>();
+}
+
+TEST(replacement, inner_tier)
+{
+	// Inner nodes evicted as soon as they are unpinned
+	check_store<clock_replacement>(0);
+	check_store<car_replacement>(0);
+}
+
+// Inner nodes stay cached through scans, so a lookup reads at most the leaf
+template<template<class> class Replacement>
+void check_one_read()
+{
+	typedef abtree_store<replacement_test_policy, file_bstore, Replacement> store_t;
+	typedef typename store_t::tree_ptr_t tree_ptr_t;
+	typedef typename store_t::tree_type tree_t;
+	system("rm -rf /tmp/replacement_tree");
+	{
+		store_t store("/tmp/replacement_tree", true, 100, 10);
+		tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 20000; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+	}
+	// About 220 inner nodes over 2000 leaves, so there is room for every
+	// inner node, and a small fraction of the leaves
+	store_t store("/tmp/replacement_tree", false, 100, 400);
+	tree_ptr_t tree = store.attach("root");
+	int count = 0;
+	typename tree_t::const_iterator it, itEnd = tree->end();
+	for(it = tree->begin(); it != itEnd; ++it)
+		count++;
+	ASSERT_EQ(count, 20000);
+	size_t inner = store.stats().cached_inner;
+	ASSERT_GT(inner, size_t(200));
+	ASSERT_LT(inner, size_t(300));
+	for(int i = 0; i < 20000; i += 37)
+	{
+		uint64_t reads = store.stats().store_reads;
+		typename tree_t::const_iterator found = tree->find(i);
+		ASSERT_EQ(found->second, i);
+		ASSERT_LE(store.stats().store_reads - reads, uint64_t(1));
+	}
+	ASSERT_EQ(store.stats().cached_inner, inner);
+}
+
+TEST(replacement, one_read_lookups)
+{
+	check_one_read<clock_replacement>();
+	check_one_read<two_queue_replacement>();
+	check_one_read<car_replacement>();
+}
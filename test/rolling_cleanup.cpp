@@ -1,4 +1,11 @@
 
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <map>
 #include "gtest/gtest.h"
 #include "abtree/disk_abtree.h"
 
@@ -38,3 +45,871 @@ TEST(rolling, main)
 		store.sync();
 	}
 }
+
+template<class Tree>
+struct reader_args
+{
+	const Tree* tree;
+	int seed;
+	int errors;
+};
+
+template<class Tree>
+static void* check_reader(void* p)
+{
+	reader_args<Tree>* args = (reader_args<Tree>*) p;
+	for(int i = 0; i < 2000; i++)
+	{
+		int k = (i * 7919 + args->seed) % 1000;
+		typename Tree::const_iterator it = args->tree->find(k);
+		if (it == args->tree->end() || it->second != k * 2)
+			args->errors++;
+	}
+	return NULL;
+}
+
+template<class Store>
+static void concurrent_readers()
+{
+	typedef typename Store::tree_type tree_t;
+	system("rm -rf /tmp/fat_tree");
+	{
+		Store store("/tmp/fat_tree", true, 100, 200);
+		typename Store::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 1000; i++)
+			(*tree)[i] = i * 2;
+		store.mark();
+		store.sync();
+	}
+	// A cache far smaller than the tree, so readers keep loading nodes,
+	// often the same ones at once
+	Store store("/tmp/fat_tree", false, 100, 5);
+	typename Store::tree_ptr_t tree = store.attach("root");
+	reader_args<tree_t> args[4];
+	pthread_t threads[4];
+	for(int i = 0; i < 4; i++)
+	{
+		args[i].tree = tree.get();
+		args[i].seed = i;
+		args[i].errors = 0;
+		pthread_create(&threads[i], NULL, check_reader<tree_t>, &args[i]);
+	}
+	for(int i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ASSERT_EQ(args[i].errors, 0);
+	}
+}
+
+TEST(rolling, concurrent_readers)
+{
+	concurrent_readers<store_t>();
+}
+
+// Reads go to pread without the store's lock
+TEST(rolling, fd_concurrent_readers)
+{
+	concurrent_readers<abtree_store<my_policy, fd_bstore> >();
+}
+
+struct blob_policy
+{
+	typedef int key_type;
+	typedef std::string mapped_type;
+	static const size_t node_size = 20;
+	bool less(const int& a, const int& b) const { return a < b; }
+	void aggregate(std::string& out, const std::string& in) const {}
+	void serialize(writable& out, const int& k, const std::string& v) const { ::serialize(out, k); ::serialize(out, v);}
+	void deserialize(readable& in, int& k, std::string& v) const { ::deserialize(in, k); ::deserialize(in, v); }
+};
+
+TEST(rolling, byte_budgets)
+{
+	typedef abtree_store<blob_policy> blob_store_t;
+	typedef blob_store_t::tree_type blob_tree_t;
+	system("rm -rf /tmp/fat_tree");
+	{
+		// Node counts that would never be reached
+		blob_store_t store("/tmp/fat_tree", true, 100000, 100000);
+		store.set_max_unwritten_bytes(32 * 1024);
+		store.set_max_lru_bytes(64 * 1024);
+		blob_store_t::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+		{
+			(*tree)[i] = std::string(1000, 'a' + i % 26);
+			ASSERT_LE(store.unwritten_bytes(), size_t(32 * 1024));
+		}
+		store.mark();
+		store.sync();
+		ASSERT_EQ(store.unwritten_bytes(), size_t(0));
+		ASSERT_LE(store.cached_bytes(), size_t(64 * 1024));
+	}
+	blob_store_t store("/tmp/fat_tree", false, 100000, 100000);
+	store.set_max_lru_bytes(64 * 1024);
+	blob_store_t::tree_ptr_t tree = store.attach("root");
+	int count = 0;
+	for(blob_tree_t::const_iterator it = tree->begin(); it != tree->end(); ++it)
+	{
+		ASSERT_EQ(it->second, std::string(1000, 'a' + count % 26));
+		count++;
+	}
+	ASSERT_EQ(count, 2000);
+	// Budgets can shrink at runtime
+	store.set_max_lru_bytes(64 * 1024);
+	ASSERT_LE(store.cached_bytes(), size_t(64 * 1024));
+	ASSERT_GT(store.cached_bytes(), size_t(0));
+	store.set_max_lru_bytes(0);
+	ASSERT_EQ(store.cached_bytes(), size_t(0));
+}
+
+TEST(rolling, background_writer)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> expected;
+	{
+		store_t store("/tmp/fat_tree", true, 50, 200);
+		store.start_writer();
+		btree_ptr_t tree = store.attach("root");
+		for(size_t i = 0; i < 200; i++)
+		{
+			for(size_t j = 0; j < 50; j++)
+			{
+				int k = random() % 1000;
+				int v = random() % 1000;
+				(*tree)[k] = v;
+				expected[k] = v;
+			}
+			store.mark();
+			if (i % 10 == 0)
+				store.sync();
+		}
+		store.sync();
+	}
+	store_t store("/tmp/fat_tree", false, 50, 200);
+	btree_ptr_t tree = store.attach("root");
+	ASSERT_EQ(tree->size(), expected.size());
+	std::map<int, int>::const_iterator mit = expected.begin();
+	for(biterator_t it = tree->begin(); it != tree->end(); ++it, ++mit)
+	{
+		ASSERT_EQ(it->first, mit->first);
+		ASSERT_EQ(it->second, mit->second);
+	}
+}
+
+template<class Store>
+static void readahead()
+{
+	typedef typename Store::tree_type::const_iterator iterator_t;
+	system("rm -rf /tmp/fat_tree");
+	{
+		Store store("/tmp/fat_tree", true, 100, 200);
+		typename Store::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 5000; i++)
+			(*tree)[i] = 1;
+		store.mark();
+		store.sync();
+	}
+	Store store("/tmp/fat_tree", false, 100, 20);
+	store.set_readahead(8);
+	typename Store::tree_ptr_t tree = store.attach("root");
+	for(int pass = 0; pass < 3; pass++)
+	{
+		int count = 0;
+		for(iterator_t it = tree->begin(); it != tree->end(); ++it)
+			ASSERT_EQ(it->first, count++);
+		ASSERT_EQ(count, 5000);
+		count = 2500;
+		for(iterator_t it = tree->lower_bound(2500); it != tree->end(); ++it)
+			ASSERT_EQ(it->first, count++);
+		ASSERT_EQ(count, 5000);
+		tree->prefetch(1000 * pass, 4000);
+		ASSERT_EQ(tree->total(tree->lower_bound(1000 * pass), tree->lower_bound(4000)), 4000 - 1000 * pass);
+	}
+}
+
+TEST(rolling, readahead)
+{
+	readahead<store_t>();
+}
+
+// Readahead batches go through io_uring, or pread without it
+TEST(rolling, uring_readahead)
+{
+	readahead<abtree_store<my_policy, uring_bstore> >();
+}
+
+// Fails the calls picked, to check errors on the cache's own threads
+class failing_bstore : public file_bstore
+{
+public:
+	failing_bstore(const std::string& dir, bool create = false) : file_bstore(dir, create) {}
+
+	static volatile bool fail_reads;  // Of single nodes, as pins do
+	static volatile bool fail_batches;  // Of prefetch batches
+	static volatile bool fail_writes;  // Of batches of nodes
+	static volatile int failures;
+
+	void read_node(off_t which, node_view& view) 
+	{ 
+		fail(fail_reads);
+		file_bstore::read_node(which, view); 
+	}
+
+	void read_nodes(const std::vector<off_t>& which, std::vector<node_view>& views)
+	{
+		fail(fail_batches);
+		file_bstore::read_nodes(which, views);
+	}
+
+	void write_pending()
+	{
+		fail(fail_writes);
+		file_bstore::write_pending();
+	}
+
+private:
+	static void fail(bool really)
+	{
+		if (!really)
+			return;
+		abt_atomic_add(failures, 1);
+		throw io_exception("Injected failure");
+	}
+};
+
+volatile bool failing_bstore::fail_reads = false;
+volatile bool failing_bstore::fail_batches = false;
+volatile bool failing_bstore::fail_writes = false;
+volatile int failing_bstore::failures = 0;
+
+typedef abtree_store<my_policy, failing_bstore> failing_store_t;
+
+static void fill_failing(int count)
+{
+	system("rm -rf /tmp/fat_tree");
+	failing_store_t store("/tmp/fat_tree", true, 100, 200);
+	failing_store_t::tree_ptr_t tree = store.attach("root");
+	for(int i = 0; i < count; i++)
+		(*tree)[i] = 1;
+	store.mark();
+	store.sync();
+}
+
+// Waits for a background thread to hit an injected failure
+static bool wait_failure()
+{
+	for(int i = 0; i < 5000 && failing_bstore::failures == 0; i++)
+		usleep(1000);
+	// Long enough for an escaping exception to take the process down
+	usleep(50000);
+	return failing_bstore::failures != 0;
+}
+
+TEST(rolling, prefetch_errors)
+{
+	fill_failing(5000);
+	failing_store_t store("/tmp/fat_tree", false, 100, 20);
+	store.set_readahead(8);
+	failing_store_t::tree_ptr_t tree = store.attach("root");
+	failing_bstore::failures = 0;
+	failing_bstore::fail_reads = true;
+	tree->prefetch(1000, 4000);
+	bool failed = wait_failure();
+	failing_bstore::fail_reads = false;
+	ASSERT_TRUE(failed);
+	// The nodes are read again when they are needed
+	ASSERT_EQ(tree->total(tree->lower_bound(1000), tree->lower_bound(4000)), 3000);
+}
+
+TEST(rolling, prefetch_batch_errors)
+{
+	fill_failing(5000);
+	failing_store_t store("/tmp/fat_tree", false, 100, 20);
+	store.set_readahead(8);
+	failing_store_t::tree_ptr_t tree = store.attach("root");
+	failing_bstore::failures = 0;
+	failing_bstore::fail_batches = true;
+	// Readahead batches fail, the iterator's own reads don't
+	int count = 0;
+	for(failing_store_t::tree_type::const_iterator it = tree->begin(); it != tree->end(); ++it)
+		ASSERT_EQ(it->first, count++);
+	bool failed = wait_failure();
+	failing_bstore::fail_batches = false;
+	ASSERT_EQ(count, 5000);
+	ASSERT_TRUE(failed);
+}
+
+TEST(rolling, writer_errors)
+{
+	system("rm -rf /tmp/fat_tree");
+	failing_store_t store("/tmp/fat_tree", true, 50, 200);
+	// Callers never write themselves
+	store.start_writer(0.5, 1000.0);
+	failing_store_t::tree_ptr_t tree = store.attach("root");
+	failing_bstore::failures = 0;
+	failing_bstore::fail_writes = true;
+	std::string error;
+	try
+	{
+		for(int i = 0; i < 1000; i++)
+			(*tree)[i] = 1;
+		wait_failure();
+		failing_bstore::fail_writes = false;
+		store.mark();
+		store.sync();
+	}
+	catch(const io_exception& e)
+	{
+		error = e.what();
+	}
+	failing_bstore::fail_writes = false;
+	ASSERT_EQ(failing_bstore::failures, 1);
+	ASSERT_EQ(error, "Background writer failed: Injected failure");
+}
+
+// A batch that fails to write is written again by the next sync
+TEST(rolling, write_retry)
+{
+	system("rm -rf /tmp/fat_tree");
+	size_t cached;
+	{
+		// Everything is left for sync to write
+		failing_store_t store("/tmp/fat_tree", true, 100000, 1000);
+		failing_store_t::tree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 1000; i++)
+			(*tree)[i] = i;
+		store.mark();
+		failing_bstore::failures = 0;
+		failing_bstore::fail_writes = true;
+		ASSERT_THROW(store.sync(), io_exception);
+		failing_bstore::fail_writes = false;
+		store.sync();
+		// Every node of the tree made it to the cache
+		store_t::stats_type stats = store.stats();
+		ASSERT_EQ(stats.unwritten_nodes, size_t(0));
+		cached = stats.cached_nodes;
+	}
+	store_t store("/tmp/fat_tree", false, 100, 1000);
+	const btree_t& tree = *store.attach("root");
+	int count = 0;
+	for(biterator_t it = tree.begin(); it != tree.end(); ++it, ++count)
+		ASSERT_EQ(it->second, count);
+	ASSERT_EQ(count, 1000);
+	ASSERT_EQ(store.stats().cached_nodes, cached);
+}
+
+TEST(rolling, uring_read_nodes)
+{
+	system("rm -rf /tmp/fat_tree");
+	uring_bstore store("/tmp/fat_tree", true);
+	store.set_slab_size(20000);
+	std::vector<off_t> offs;
+	std::vector<std::vector<char> > nodes;
+	for(int i = 0; i < 20; i++)
+	{
+		// Some bigger than the first read of each
+		nodes.push_back(std::vector<char>(i % 3 ? 100 : 6000, 'a' + i));
+		offs.push_back(store.write_node(nodes.back()));
+	}
+	std::vector<file_bstore::node_view> views;
+	store.read_nodes(offs, views);
+	ASSERT_EQ(views.size(), nodes.size());
+	for(size_t i = 0; i < nodes.size(); i++)
+		ASSERT_TRUE(std::vector<char>(views[i].data, views[i].data + views[i].size) == nodes[i]);
+}
+
+TEST(rolling, stats)
+{
+	system("rm -rf /tmp/fat_tree");
+	{
+		store_t store("/tmp/fat_tree", true, 50, 1000);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 5000; i++)
+			(*tree)[i] = 0;
+		for(int i = 0; i < 5000; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+		store_t::stats_type stats = store.stats();
+		ASSERT_GT(stats.nodes_written, uint64_t(0));
+		// Nodes over budget went one at a time, the sync wrote the rest
+		// with one write, and the root with another
+		ASSERT_LT(stats.store_writes, stats.nodes_written);
+		ASSERT_GT(stats.store_writes, uint64_t(2));
+		ASSERT_EQ(stats.write_front.count, stats.nodes_written);
+		ASSERT_EQ(stats.syncs, uint64_t(1));
+		ASSERT_EQ(stats.sync.count, uint64_t(1));
+		ASSERT_GT(stats.sync_bytes, uint64_t(0));
+		ASSERT_LE(stats.sync_bytes, stats.bytes_written);
+		ASSERT_EQ(stats.unwritten_nodes, size_t(0));
+		ASSERT_GT(stats.unwritten_peak, size_t(0));
+		ASSERT_LE(stats.unwritten_peak, size_t(51));
+		ASSERT_EQ(stats.store_reads, uint64_t(0));
+		// Updates never compact
+		ASSERT_EQ(stats.compactions, uint64_t(0));
+	}
+	store_t store("/tmp/fat_tree", false, 50, 20);
+	btree_ptr_t tree_ptr = store.attach("root");
+	const btree_t& tree = *tree_ptr;
+	for(int pass = 0; pass < 2; pass++)
+	{
+		for(int i = 0; i < 5000; i++)
+			ASSERT_EQ(tree.find(i)->second, i);
+	}
+	store_t::stats_type stats = store.stats();
+	ASSERT_GT(stats.misses, uint64_t(0));
+	ASSERT_GT(stats.hits, stats.misses);
+	ASSERT_EQ(stats.store_reads, stats.misses);
+	ASSERT_EQ(stats.load.count, stats.misses);
+	ASSERT_GT(stats.store_read_bytes, uint64_t(0));
+	ASSERT_GT(stats.leaf_evictions, uint64_t(0));
+	ASSERT_LE(stats.cached_nodes, size_t(20));
+	ASSERT_GT(stats.load.percentile_us(0.99), 0.0);
+	ASSERT_LE(stats.load.percentile_us(0.5), stats.load.percentile_us(0.99));
+}
+
+template<class Tree>
+static void check_contents(const Tree& tree, const std::map<int, int>& truth)
+{
+	std::map<int, int>::const_iterator want = truth.begin();
+	for(typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it, ++want)
+	{
+		ASSERT_TRUE(want != truth.end());
+		ASSERT_EQ(it->first, want->first);
+		ASSERT_EQ(it->second, want->second);
+	}
+	ASSERT_TRUE(want == truth.end());
+}
+
+static void churn(btree_t& tree, std::map<int, int>& truth)
+{
+	for(int j = 0; j < 50; j++)
+	{
+		int k = random() % 2000;
+		int v = random() % 1000;
+		tree[k] = v;
+		truth[k] = v;
+	}
+}
+
+// Bytes of the nodes reachable from the root of the closed store, each
+// read once into a cache large enough to hold them all
+static uint64_t scanned_bytes()
+{
+	store_t store("/tmp/fat_tree", false, 100, 100000);
+	const btree_t& tree = *store.attach("root");
+	for(biterator_t it = tree.begin(); it != tree.end(); ++it) {}
+	return store.stats().store_read_bytes;
+}
+
+TEST(rolling, live_bytes)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> truth;
+	off_t live;
+	{
+		store_t store("/tmp/fat_tree", true, 20, 200);
+		store.start_writer();
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = truth[i] = i;
+		for(int round = 0; round < 100; round++)
+		{
+			churn(*tree, truth);
+			store.mark();
+			// Replaces nodes the marked root still uses
+			churn(*tree, truth);
+			store.sync();
+		}
+		// Nodes replaced while the last sync wrote them go with the next
+		store.mark();
+		store.sync();
+		store.mark();
+		store.sync();
+		live = store.get_file().live_size();
+	}
+	ASSERT_EQ(uint64_t(live), scanned_bytes());
+}
+
+// Replaced nodes are only garbage once a synced root no longer uses them
+TEST(rolling, garbage_after_sync)
+{
+	system("rm -rf /tmp/fat_tree");
+	off_t live;
+	{
+		store_t store("/tmp/fat_tree", true, 100, 200);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = i;
+		store.mark();
+		store.sync();
+		off_t before = store.get_file().live_size();
+		(*tree)[0] = 5000;
+		store.sync();
+		// The marked root still has the old path
+		ASSERT_EQ(store.get_file().live_size(), before);
+		store.mark();
+		store.sync();
+		live = store.get_file().live_size();
+	}
+	ASSERT_EQ(uint64_t(live), scanned_bytes());
+}
+
+TEST(rolling, compaction)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> truth;
+	double amplification;
+	{
+		store_t store("/tmp/fat_tree", true, 100, 200);
+		store.get_file().set_slab_size(16 * 1024);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = truth[i] = i;
+		store.mark();
+		store.sync();
+		for(int round = 0; round < 300; round++)
+		{
+			churn(*tree, truth);
+			if (store.space_amplification() > 1.5)
+				store.compact(16 * 1024);
+			store.mark();
+			store.sync();
+		}
+		// Without compaction this is a few Mb
+		ASSERT_LT(store.get_file().disk_size(), off_t(128 * 1024));
+		// With 16k slabs, at most a few slabs of garbage
+		ASSERT_LT(store.space_amplification(), 5.0);
+		ASSERT_GT(store.stats().compaction_moves, uint64_t(0));
+		check_contents(*tree, truth);
+		amplification = store.space_amplification();
+	}
+	store_t store("/tmp/fat_tree", false, 100, 200);
+	check_contents(*store.attach("root"), truth);
+	// Garbage is still known after a reload
+	ASSERT_NEAR(store.space_amplification(), amplification, 0.01);
+}
+
+// Budgets so small that each pass runs out below the root, with a cache
+// that evicts the parents in between, so they are read back from disk
+TEST(rolling, compaction_budget)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> truth;
+	off_t live;
+	{
+		store_t store("/tmp/fat_tree", true, 100, 20);
+		store.get_file().set_slab_size(16 * 1024);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = truth[i] = i;
+		store.mark();
+		store.sync();
+		for(int round = 0; round < 300; round++)
+		{
+			churn(*tree, truth);
+			store.compact(1);
+			store.mark();
+			store.sync();
+		}
+		ASSERT_GT(store.stats().compaction_moves, uint64_t(0));
+		check_contents(*tree, truth);
+		store.mark();
+		store.sync();
+		live = store.get_file().live_size();
+	}
+	// No node was moved or counted as garbage twice
+	ASSERT_EQ(uint64_t(live), scanned_bytes());
+	store_t store("/tmp/fat_tree", false, 100, 20);
+	check_contents(*store.attach("root"), truth);
+}
+
+TEST(rolling, background_compactor)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> truth;
+	{
+		store_t store("/tmp/fat_tree", true, 100, 200);
+		store.get_file().set_slab_size(64 * 1024);
+		store.start_compactor(1.5, 1024 * 1024);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = truth[i] = i;
+		for(int round = 0; round < 300; round++)
+		{
+			churn(*tree, truth);
+			store.mark();
+			store.sync();
+			usleep(2000);
+		}
+		store.stop_compactor();
+		store.mark();
+		store.sync();
+		ASSERT_GT(store.stats().compactions, uint64_t(0));
+		ASSERT_LT(store.get_file().disk_size(), off_t(1024 * 1024));
+		check_contents(*tree, truth);
+	}
+	store_t store("/tmp/fat_tree", false, 100, 200);
+	check_contents(*store.attach("root"), truth);
+}
+
+TEST(rolling, compactor_errors)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::map<int, int> truth;
+	{
+		store_t store("/tmp/fat_tree", true, 100, 200);
+		store.get_file().set_slab_size(64 * 1024);
+		btree_ptr_t tree = store.attach("root");
+		for(int i = 0; i < 2000; i++)
+			(*tree)[i] = truth[i] = i;
+		for(int round = 0; round < 50; round++)
+		{
+			churn(*tree, truth);
+			store.mark();
+			store.sync();
+		}
+	}
+	// Nothing is in memory, so compaction has to read
+	failing_store_t store("/tmp/fat_tree", false, 100, 200);
+	failing_store_t::tree_ptr_t tree = store.attach("root");
+	// Compaction follows the roots of the last sync
+	store.mark();
+	store.sync();
+	failing_bstore::failures = 0;
+	failing_bstore::fail_reads = true;
+	store.start_compactor(1.0, 1024 * 1024);
+	bool failed = wait_failure();
+	failing_bstore::fail_reads = false;
+	ASSERT_TRUE(failed);
+	// Backs off instead of retrying at once
+	ASSERT_EQ(store.stats().compaction_errors, uint64_t(1));
+	store.stop_compactor();
+	check_contents(*tree, truth);
+}
+
+TEST(rolling, garbage_ratio)
+{
+	system("rm -rf /tmp/fat_tree");
+	std::vector<off_t> offs;
+	{
+		file_bstore store("/tmp/fat_tree", true);
+		// Ten nodes to a slab
+		store.set_slab_size(10000);
+		std::vector<char> node(1000, 'x');
+		for(int i = 0; i < 25; i++)
+			offs.push_back(store.write_node(node));
+		ASSERT_EQ(store.live_size(), off_t(25000));
+		ASSERT_LT(store.space_amplification(), 1.1);
+		// The first slab is 20% garbage, the second all garbage
+		for(int i = 0; i < 2; i++)
+			store.free_node(offs[i], 1000);
+		for(int i = 10; i < 20; i++)
+			store.free_node(offs[i], 1000);
+		ASSERT_EQ(store.live_size(), off_t(13000));
+		ASSERT_GT(store.space_amplification(), 1.6);
+		// Taking both slabs frees more per byte moved than the first alone
+		off_t victim = store.pick_victim(offs[0]);
+		ASSERT_GT(victim, offs[19]);
+		ASSERT_LE(victim, offs[20]);
+		// Runs always start with the slab in use
+		victim = store.pick_victim(offs[10]);
+		ASSERT_GT(victim, offs[19]);
+		ASSERT_LE(victim, offs[20]);
+		// The slab being written is never picked
+		ASSERT_EQ(store.pick_victim(offs[25]), off_t(0));
+		store.write_root(std::vector<char>(1, 'r'));
+	}
+	// The counts are saved with the root
+	file_bstore store("/tmp/fat_tree", false);
+	ASSERT_EQ(store.live_size(), off_t(13000));
+	store.clear_before(offs[20]);
+	ASSERT_EQ(store.live_size(), off_t(5000));
+}
+
+struct syncer_args
+{
+	store_t* store;
+	btree_t* tree;
+	pthread_mutex_t* mutex;  // Trees and marks are not thread safe
+};
+
+static void* check_syncer(void* p)
+{
+	syncer_args* args = (syncer_args*) p;
+	for(int i = 0; i < 50; i++)
+	{
+		pthread_mutex_lock(args->mutex);
+		(*args->tree)[i] = i * 3;
+		args->store->mark();
+		pthread_mutex_unlock(args->mutex);
+		args->store->sync();
+	}
+	return NULL;
+}
+
+TEST(rolling, group_commit)
+{
+	system("rm -rf /tmp/fat_tree");
+	{
+		store_t store("/tmp/fat_tree", true, 100, 200);
+		store.get_file().set_durability(file_bstore::durability_fdatasync);
+		pthread_mutex_t mutex;
+		pthread_mutex_init(&mutex, NULL);
+		btree_ptr_t trees[4];
+		syncer_args args[4];
+		pthread_t threads[4];
+		for(int i = 0; i < 4; i++)
+		{
+			char name[8];
+			sprintf(name, "t%d", i);
+			trees[i] = store.attach(name);
+			args[i].store = &store;
+			args[i].tree = trees[i].get();
+			args[i].mutex = &mutex;
+		}
+		for(int i = 0; i < 4; i++)
+			pthread_create(&threads[i], NULL, check_syncer, &args[i]);
+		for(int i = 0; i < 4; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&mutex);
+		// Every call either wrote a sync, found nothing new, or shared one
+		store_t::stats_type s = store.stats();
+		ASSERT_LE(s.syncs + s.sync_joins, uint64_t(200));
+		ASSERT_GT(s.syncs, uint64_t(0));
+	}
+	// Each sync returned only once its marks were on disk
+	store_t store("/tmp/fat_tree", false, 100, 200);
+	for(int i = 0; i < 4; i++)
+	{
+		char name[8];
+		sprintf(name, "t%d", i);
+		btree_ptr_t tree_ptr = store.attach(name);
+		const btree_t& tree = *tree_ptr;
+		ASSERT_EQ(tree.size(), size_t(50));
+		for(int j = 0; j < 50; j++)
+			ASSERT_EQ(tree.find(j)->second, j * 3);
+	}
+}
+
+TEST(rolling, staged_writes)
+{
+	system("rm -rf /tmp/fat_tree");
+	file_bstore store("/tmp/fat_tree", true);
+	std::vector<off_t> offs;
+	for(int i = 0; i < 3; i++)
+		offs.push_back(store.write_node(std::vector<char>(100 + i, 'a' + i)));
+	// Offsets are given before anything is written
+	ASSERT_LT(offs[0], offs[1]);
+	ASSERT_EQ(offs[2] - offs[1], offs[1] - offs[0] + 1);
+	// Reads see staged nodes
+	std::vector<char> record;
+	store.read_node(offs[1], record);
+	ASSERT_TRUE(record == std::vector<char>(101, 'b'));
+	offs.push_back(store.write_node(std::vector<char>(50, 'd')));
+	store.write_pending();
+	store.read_node(offs[3], record);
+	ASSERT_TRUE(record == std::vector<char>(50, 'd'));
+	store.read_node(offs[0], record);
+	ASSERT_TRUE(record == std::vector<char>(100, 'a'));
+}
+
+TEST(rolling, mapped_slabs)
+{
+	system("rm -rf /tmp/fat_tree");
+	file_bstore store("/tmp/fat_tree", true);
+	store.set_slab_size(10000);
+	std::vector<off_t> offs;
+	for(int i = 0; i < 15; i++)
+		offs.push_back(store.write_node(std::vector<char>(1000, 'a' + i)));
+	store.write_pending();
+	// The first slab is closed, so it's read in place
+	file_bstore::node_view view;
+	store.read_node(offs[3], view);
+	ASSERT_TRUE(view.slab.get() != NULL);
+	ASSERT_EQ(view.size, size_t(1000));
+	ASSERT_EQ(view.data[999], 'd');
+	// The one being written is copied
+	file_bstore::node_view current;
+	store.read_node(offs[14], current);
+	ASSERT_TRUE(current.slab.get() == NULL);
+	ASSERT_TRUE(current.copy == std::vector<char>(1000, 'o'));
+	// A view outlives clearing it's slab
+	store.clear_before(offs[14]);
+	ASSERT_EQ(view.data[0], 'd');
+	ASSERT_EQ(view.data[999], 'd');
+}
+
+static void check_root(char c, size_t len)
+{
+	file_bstore store("/tmp/fat_tree");
+	std::vector<char> record;
+	store.read_root(record);
+	ASSERT_TRUE(record == std::vector<char>(len, c));
+}
+
+TEST(rolling, partial_append)
+{
+	system("rm -rf /tmp/fat_tree");
+	fd_bstore store("/tmp/fat_tree", true);
+	std::vector<off_t> offs;
+	offs.push_back(store.write_node(std::vector<char>(1000, 'a')));
+	store.write_pending();
+	struct stat st;
+	ASSERT_EQ(stat("/tmp/fat_tree/data_0", &st), 0);
+	offs.push_back(store.write_node(std::vector<char>(1000, 'b')));
+	offs.push_back(store.write_node(std::vector<char>(1000, 'c')));
+	// Let half of the next write reach the file
+	signal(SIGXFSZ, SIG_IGN);
+	struct rlimit old_limit;
+	getrlimit(RLIMIT_FSIZE, &old_limit);
+	struct rlimit limit = old_limit;
+	limit.rlim_cur = st.st_size + 1000;
+	setrlimit(RLIMIT_FSIZE, &limit);
+	ASSERT_THROW(store.write_pending(), io_exception);
+	setrlimit(RLIMIT_FSIZE, &old_limit);
+	// The retry writes over it, rather than after it
+	store.write_pending();
+	ASSERT_EQ(stat("/tmp/fat_tree/data_0", &st), 0);
+	ASSERT_EQ(st.st_size, store.disk_size());
+	std::vector<char> record;
+	for(int i = 0; i < 3; i++)
+	{
+		store.read_node(offs[i], record);
+		ASSERT_TRUE(record == std::vector<char>(1000, 'a' + i));
+	}
+}
+
+TEST(rolling, superblock)
+{
+	system("rm -rf /tmp/fat_tree");
+	{
+		file_bstore store("/tmp/fat_tree", true);
+		store.set_slab_size(10000);
+		for(int i = 0; i < 5; i++)
+		{
+			for(int j = 0; j < 5; j++)
+				store.write_node(std::vector<char>(1000, 'x'));
+			store.write_root(std::vector<char>(10 + i, 'a' + i));
+			store.commit();
+		}
+	}
+	check_root('e', 14);
+	// Without the superblock, the slabs are scanned
+	system("rm /tmp/fat_tree/super");
+	check_root('e', 14);
+	{
+		file_bstore store("/tmp/fat_tree");
+		store.write_root(std::vector<char>(20, 'f'));
+		store.write_root(std::vector<char>(21, 'g'));
+	}
+	check_root('g', 21);
+	// Those two went to slot 1 then slot 0, and a torn slot 0 leaves slot 1
+	int fd = open("/tmp/fat_tree/super", O_RDWR);
+	ASSERT_GE(fd, 0);
+	char junk[16];
+	memset(junk, 0xff, sizeof(junk));
+	ASSERT_EQ(pwrite(fd, junk, sizeof(junk), 0), ssize_t(sizeof(junk)));
+	close(fd);
+	check_root('f', 20);
+}
@@ -2,9 +2,13 @@
 #include "abtree/abtree.h"
 #include "abtree/spatial.h"
 #include "abtree/tree_walker.h"
+#include "abtree/spatial_index.h"
+#include "abtree/disk_abtree.h"
 #include "gtest/gtest.h"
 #include <boost/foreach.hpp>
 #include <set>
+#include <map>
+#include <iterator>
 #define foreach BOOST_FOREACH
 
 typedef point<2> point_t;
@@ -45,6 +49,14 @@ struct dumb_cmp
 	}
 };
 
+struct point_eq
+{
+	bool operator()(const point_t& a, const point_t& b) const
+	{
+		return a.coords[0] == b.coords[0] && a.coords[1] == b.coords[1];
+	}
+};
+
 TEST(spatial, basic)
 {
         typedef abtree<point_t, bounding_t, spatial_accumulate, spatial_less> bt_t;
@@ -98,3 +110,329 @@ TEST(spatial, basic)
 		printf("Case %d, %d nodes found, %d nodes checked\n", (int) i, (int) simple.size(), check_count);
 	}
 }
+
+template<class tree_t, class make_key_t>
+void check_spatial_tree(const make_key_t& make_key)
+{
+	typedef std::vector<point_t> vec_t;
+	tree_t tree;
+	vec_t vec;
+	for(size_t i = 0; i < 20000; i++)
+	{
+		point_t p;
+		p.coords[0] = random() % 200000 - 100000;
+		p.coords[1] = random() % 200000 - 100000;
+		bounding_t bound;
+		bound.min_point = p;
+		bound.max_point = p;
+		tree.insert(std::make_pair(make_key(p), bound));
+		vec.push_back(p);
+	}
+	// Keys come out in strictly increasing order
+	typename tree_t::const_iterator it = tree.begin();
+	typename tree_t::const_iterator prev = it;
+	for(++it; it != tree.end(); ++it, ++prev)
+		ASSERT_TRUE(spatial_key_less()(prev->first, it->first));
+	for(size_t i = 0; i < 20; i++)
+	{
+		point_t p;
+		p.coords[0] = random() % 200000 - 100000;
+		p.coords[1] = random() % 200000 - 100000;
+		bounding_t bounds;
+		bounds.min_point = p;
+		bounds.max_point = p;
+		bounds.max_point.coords[0] += random() % 10000;
+		bounds.max_point.coords[1] += random() % 10000;
+		is_inside check_it(bounds);
+		std::set<point_t, dumb_cmp> simple;
+		std::set<point_t, dumb_cmp> tricky;
+		for(size_t j = 0; j < vec.size(); j++)
+		{
+			if (check_it(vec[j]))
+				simple.insert(vec[j]);
+		}
+		foreach(const typename tree_t::value_type& kvp, forward_subset(tree, check_it))
+			tricky.insert(kvp.first.pt);
+		ASSERT_EQ(simple.size(), tricky.size());
+		ASSERT_TRUE(std::equal(simple.begin(), simple.end(), tricky.begin(), point_eq()));
+	}
+	// Every point can be found again by it's key
+	for(size_t i = 0; i < vec.size(); i += 97)
+		ASSERT_TRUE(tree.find(make_key(vec[i])) != tree.end());
+}
+
+struct make_ieee_key
+{
+	spatial_key<2> operator()(const point_t& p) const { return spatial_key<2>(p); }
+};
+
+struct make_linear_key
+{
+	make_linear_key()
+	{
+		bounding_t domain;
+		domain.min_point.coords[0] = domain.min_point.coords[1] = -100000;
+		domain.max_point.coords[0] = domain.max_point.coords[1] = 100000;
+		m_quantize = linear_quantizer<2>(domain);
+	}
+	spatial_key<2> operator()(const point_t& p) const { return spatial_key<2>(p, m_quantize); }
+	linear_quantizer<2> m_quantize;
+};
+
+TEST(spatial, hilbert_key)
+{
+	typedef abtree<spatial_key<2>, bounding_t, spatial_accumulate, spatial_key_less> bt_t;
+	check_spatial_tree<bt_t>(make_ieee_key());
+	check_spatial_tree<bt_t>(make_linear_key());
+}
+
+point_t random_point()
+{
+	point_t p;
+	p.coords[0] = random() % 200000 - 100000;
+	p.coords[1] = random() % 200000 - 100000;
+	return p;
+}
+
+double dist2(const point_t& a, const point_t& b)
+{
+	double dx = a.coords[0] - b.coords[0];
+	double dy = a.coords[1] - b.coords[1];
+	return dx*dx + dy*dy;
+}
+
+template<class index_t>
+void check_spatial_index(index_t& index, std::map<int, point_t>& truth)
+{
+	typedef std::map<int, point_t>::const_iterator truth_it_t;
+	ASSERT_EQ(truth.size(), index.size());
+	for(typename index_t::const_iterator it = index.begin(); it != index.end(); ++it)
+		ASSERT_TRUE(point_eq()(it->second, truth[it->first]));
+	for(size_t i = 0; i < 20; i++)
+	{
+		bounding_t box;
+		box.min_point = random_point();
+		box.max_point = box.min_point;
+		box.max_point.coords[0] += random() % 20000;
+		box.max_point.coords[1] += random() % 20000;
+		is_inside check_it(box);
+		std::set<int> simple;
+		for(truth_it_t it = truth.begin(); it != truth.end(); ++it)
+			if (check_it(it->second))
+				simple.insert(it->first);
+		std::set<int> tricky;
+		index.within(box, std::inserter(tricky, tricky.end()));
+		ASSERT_TRUE(simple == tricky);
+		ASSERT_EQ(simple.size(), index.count_within(box));
+	}
+	for(size_t i = 0; i < 20; i++)
+	{
+		point_t p = random_point();
+		std::vector<double> simple;
+		for(truth_it_t it = truth.begin(); it != truth.end(); ++it)
+			simple.push_back(dist2(p, it->second));
+		std::sort(simple.begin(), simple.end());
+		simple.resize(std::min(simple.size(), size_t(10)));
+		std::vector<int> ids;
+		index.nearest(p, 10, std::back_inserter(ids));
+		ASSERT_EQ(simple.size(), ids.size());
+		for(size_t j = 0; j < ids.size(); j++)
+			ASSERT_EQ(simple[j], dist2(p, truth[ids[j]]));
+	}
+}
+
+template<class index_t>
+void mutate_spatial_index(index_t& index, std::map<int, point_t>& truth)
+{
+	for(size_t i = 0; i < 5000; i++)
+	{
+		int id = random() % 4000;
+		point_t p = random_point();
+		switch(random() % 4)
+		{
+		case 0:
+			ASSERT_EQ(truth.count(id) == 0, index.insert(id, p));
+			truth.insert(std::make_pair(id, p));
+			break;
+		case 1:
+			ASSERT_EQ(truth.count(id) == 1, index.move(id, p));
+			if (truth.count(id)) truth[id] = p;
+			break;
+		case 2:
+			index.set(id, p);
+			truth[id] = p;
+			break;
+		case 3:
+			ASSERT_EQ(truth.erase(id), (size_t) index.erase(id));
+			break;
+		}
+		const point_t* loc = index.get(id);
+		ASSERT_EQ(truth.count(id) == 1, loc != NULL);
+		if (loc)
+		{
+			ASSERT_TRUE(point_eq()(*loc, truth[id]));
+		}
+	}
+}
+
+TEST(spatial, index)
+{
+	typedef spatial_index<2, int> index_t;
+	index_t index;
+	std::map<int, point_t> truth;
+	mutate_spatial_index(index, truth);
+	check_spatial_index(index, truth);
+	// Many ids at one location
+	point_t p = random_point();
+	for(int i = 10000; i < 10100; i++)
+	{
+		index.insert(i, p);
+		truth[i] = p;
+	}
+	check_spatial_index(index, truth);
+}
+
+TEST(spatial, index_disk)
+{
+	typedef abtree_store<spatial_index_policy<2, int> > store_t;
+	typedef spatial_index<2, int, std::less<int>, store_t::tree_type> index_t;
+	std::map<int, point_t> truth;
+	system("rm -rf /tmp/spatial_index");
+	{
+		store_t store("/tmp/spatial_index", true, 100, 200);
+		index_t index(store.attach("points"));
+		mutate_spatial_index(index, truth);
+		check_spatial_index(index, truth);
+		store.mark();
+		store.sync();
+	}
+	{
+		store_t store("/tmp/spatial_index", false, 100, 200);
+		index_t index(store.attach("points"));
+		check_spatial_index(index, truth);
+	}
+}
+
+// Coordinates are stored in the same byte order on every host
+TEST(spatial, double_bytes)
+{
+	std::vector<char> buf;
+	vector_writer out(buf);
+	serialize(out, 1.5);
+	serialize(out, -0.0);
+	const char expect[16] = { 0, 0, 0, 0, 0, 0, char(0xf8), 0x3f, 0, 0, 0, 0, 0, 0, 0, char(0x80) };
+	ASSERT_TRUE(buf == std::vector<char>(expect, expect + 16));
+	vector_reader in(buf);
+	double x;
+	deserialize(in, x);
+	ASSERT_EQ(x, 1.5);
+	deserialize(in, x);
+	ASSERT_TRUE(x == 0.0 && 1.0 / x < 0);
+}
+
+TEST(spatial, count_within)
+{
+	typedef spatial_summary<2> summary_t;
+	typedef abtree<spatial_key<2>, summary_t, spatial_accumulate, spatial_key_less> bt_t;
+	bt_t tree;
+	std::vector<point_t> vec;
+	for(size_t i = 0; i < 50000; i++)
+	{
+		point_t p = random_point();
+		tree.insert(std::make_pair(spatial_key<2>(p), summary_t(p)));
+		vec.push_back(p);
+	}
+	for(size_t i = 0; i < 50; i++)
+	{
+		bounding_t box;
+		box.min_point = random_point();
+		box.max_point = box.min_point;
+		box.max_point.coords[0] += random() % 100000;
+		box.max_point.coords[1] += random() % 100000;
+		is_inside check_it(box);
+		summary_t simple;
+		for(size_t j = 0; j < vec.size(); j++)
+			if (check_it(vec[j]))
+				spatial_accumulate()(simple, summary_t(vec[j]));
+		summary_t tricky = total_within(tree, box);
+		ASSERT_EQ(simple.count, tricky.count);
+		ASSERT_EQ(simple.count, count_within(tree, box));
+		if (simple.count == 0)
+			continue;
+		ASSERT_TRUE(point_eq()(simple.region.min_point, tricky.region.min_point));
+		ASSERT_TRUE(point_eq()(simple.region.max_point, tricky.region.max_point));
+	}
+}
+
+bounding_t random_extent()
+{
+	bounding_t e;
+	e.min_point = random_point();
+	e.max_point = e.min_point;
+	e.max_point.coords[0] += random() % 5000;
+	e.max_point.coords[1] += random() % 5000;
+	return e;
+}
+
+struct entry_less
+{
+	template<class Entry>
+	bool operator()(const Entry& a, const Entry& b) const { return extent_key_less()(a.first, b.first); }
+};
+
+struct entry_eq
+{
+	template<class Entry>
+	bool operator()(const Entry& a, const Entry& b) const { return !entry_less()(a, b) && !entry_less()(b, a); }
+};
+
+TEST(spatial, extent)
+{
+	typedef spatial_summary<2> summary_t;
+	typedef abtree<extent_key<2>, summary_t, spatial_accumulate, extent_key_less> bt_t;
+	typedef std::pair<extent_key<2>, summary_t> entry_t;
+	std::vector<entry_t> entries;
+	for(size_t i = 0; i < 20000; i++)
+	{
+		bounding_t e = random_extent();
+		entries.push_back(std::make_pair(extent_key<2>(e), summary_t(e)));
+	}
+	// Same extent twice only stays once
+	entries.push_back(entries[0]);
+	std::sort(entries.begin(), entries.end(), entry_less());
+	entries.erase(std::unique(entries.begin(), entries.end(), entry_eq()), entries.end());
+	ASSERT_EQ(size_t(20000), entries.size());
+	bt_t tree;
+	tree.bulk_load(entries.begin(), entries.end());
+	// Mix in some updates after the load
+	for(size_t i = 0; i < 5000; i++)
+	{
+		bounding_t e = random_extent();
+		entries.push_back(std::make_pair(extent_key<2>(e), summary_t(e)));
+		tree.insert(entries.back());
+	}
+	for(size_t i = 0; i < 5000; i++)
+	{
+		size_t j = random() % entries.size();
+		tree.erase(entries[j].first);
+		entries[j] = entries.back();
+		entries.pop_back();
+	}
+	ASSERT_EQ(entries.size(), tree.size());
+	for(size_t i = 0; i < 50; i++)
+	{
+		bounding_t box = random_extent();
+		size_t simple = 0;
+		for(size_t j = 0; j < entries.size(); j++)
+			if (region_overlap(box, entries[j].second.region))
+				simple++;
+		size_t tricky = 0;
+		foreach(const bt_t::value_type& kvp, intersecting(tree, box))
+		{
+			ASSERT_TRUE(region_overlap(box, kvp.first.extent));
+			tricky++;
+		}
+		ASSERT_EQ(simple, tricky);
+		ASSERT_EQ(simple, count_within(tree, box));
+	}
+}